@@ -1,7 +1,297 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <condition_variable>
+#include <coroutine>
+#define TOKEN_ITERATOR_COROUTINES 1
+#endif
+#include <utility>
+#include <vector>
 #include <clang-c/Index.h>
 #include <gsl/gsl>
 
+// Vectorized byte scans. Define TOKEN_ITERATOR_NO_SIMD to force the portable fallback.
+#if !defined(TOKEN_ITERATOR_NO_SIMD)
+#if defined(__AVX2__)
+#define TOKEN_ITERATOR_AVX2 1
+#define TOKEN_ITERATOR_SSE2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TOKEN_ITERATOR_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TOKEN_ITERATOR_NEON 1
+#include <arm_neon.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Instrumentation. Define TOKEN_ITERATOR_STATS to count the libclang calls made by the iterators, per thread,
+// and TOKEN_ITERATOR_STATS_TIMING to also record how long each step takes. Both compile to nothing by default.
+// Defining either as empty (-DTOKEN_ITERATOR_STATS=) turns it on, like defining it as 1. Defining it as 0 does not.
+#if defined(TOKEN_ITERATOR_STATS_TIMING) && (0 - TOKEN_ITERATOR_STATS_TIMING - 1) == 1
+#undef TOKEN_ITERATOR_STATS_TIMING
+#define TOKEN_ITERATOR_STATS_TIMING 1
+#endif
+#if defined(TOKEN_ITERATOR_STATS) && (0 - TOKEN_ITERATOR_STATS - 1) == 1
+#undef TOKEN_ITERATOR_STATS
+#define TOKEN_ITERATOR_STATS 1
+#endif
+
+#if TOKEN_ITERATOR_STATS_TIMING
+#undef TOKEN_ITERATOR_STATS
+#define TOKEN_ITERATOR_STATS 1
+#include <chrono>
+#endif
+
+#if TOKEN_ITERATOR_STATS
+// Latencies in power-of-two buckets. buckets[i] counts the calls that took [2^i, 2^(i+1)) nanoseconds.
+struct latency_histogram {
+    static constexpr unsigned int num_buckets = 40;
+    std::uint64_t buckets[num_buckets] = {};
+
+    void record(std::uint64_t nanoseconds) noexcept {
+        unsigned int bucket = 0;
+        while (nanoseconds >>= 1) ++bucket;
+        ++buckets[std::min(bucket, num_buckets - 1)];
+    }
+
+    std::uint64_t count() const noexcept {
+        std::uint64_t total = 0;
+        for (auto n : buckets) total += n;
+        return total;
+    }
+
+    latency_histogram &operator+=(const latency_histogram &other) noexcept {
+        for (unsigned int i = 0; i < num_buckets; ++i) buckets[i] += other.buckets[i];
+        return *this;
+    }
+
+    void dump(std::FILE* out, const char* name) const {
+        std::fprintf(out, "%s: %llu calls\n", name, static_cast<unsigned long long>(count()));
+        for (unsigned int i = 0; i < num_buckets; ++i) {
+            if (buckets[i] == 0) continue;
+            std::fprintf(out, "  >= %12llu ns: %llu\n", i ? (1ull << i) : 0ull, static_cast<unsigned long long>(buckets[i]));
+        }
+    }
+};
+
+struct token_iterator_stats {
+    // libclang calls
+    std::uint64_t get_token = 0;
+    std::uint64_t get_token_extent = 0;
+    std::uint64_t location_for_offset = 0;
+    std::uint64_t tokenize = 0;
+    std::uint64_t dispose_tokens = 0;
+
+    // Calls to token_iterator::operator-- that had to search the file buffer,
+    // and the clang_getToken() calls made by those searches
+    std::uint64_t backward_searches = 0;
+    std::uint64_t probes = 0;
+
+    // Steps of iterators with stats_instrumentation (see token_policy)
+    std::uint64_t steps = 0;
+
+    // Only recorded with TOKEN_ITERATOR_STATS_TIMING
+    latency_histogram increments;
+    latency_histogram decrements;
+
+    // The counters of the calling thread
+    static token_iterator_stats &local() noexcept;
+
+    // The counters of every thread that has exited, plus those of the calling thread.
+    // Threads that are still running are not included.
+    static token_iterator_stats collect() {
+        std::lock_guard<std::mutex> lock{ retired_mutex() };
+        auto total = retired();
+        total += local();
+        return total;
+    }
+
+    void reset() noexcept { *this = token_iterator_stats{}; }
+
+    token_iterator_stats &operator+=(const token_iterator_stats &other) noexcept {
+        get_token += other.get_token;
+        get_token_extent += other.get_token_extent;
+        location_for_offset += other.location_for_offset;
+        tokenize += other.tokenize;
+        dispose_tokens += other.dispose_tokens;
+        backward_searches += other.backward_searches;
+        probes += other.probes;
+        steps += other.steps;
+        increments += other.increments;
+        decrements += other.decrements;
+        return *this;
+    }
+
+    void dump(std::FILE* out) const {
+        auto print = [out](const char* name, std::uint64_t value) {
+            std::fprintf(out, "%-28s %llu\n", name, static_cast<unsigned long long>(value));
+        };
+        print("clang_getToken", get_token);
+        print("clang_getTokenExtent", get_token_extent);
+        print("clang_getLocationForOffset", location_for_offset);
+        print("clang_tokenize", tokenize);
+        print("clang_disposeTokens", dispose_tokens);
+        print("backward searches", backward_searches);
+        print("backward search probes", probes);
+        print("counted steps", steps);
+        if (increments.count()) increments.dump(out, "operator++");
+        if (decrements.count()) decrements.dump(out, "operator--");
+    }
+
+private:
+    static std::mutex &retired_mutex() noexcept {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static token_iterator_stats &retired() noexcept {
+        static token_iterator_stats stats;
+        return stats;
+    }
+};
+
+inline token_iterator_stats &token_iterator_stats::local() noexcept {
+    // Folded into retired() when the thread exits, so that collect() still sees short-lived workers
+    struct thread_slot {
+        token_iterator_stats stats;
+
+        ~thread_slot() {
+            std::lock_guard<std::mutex> lock{ retired_mutex() };
+            retired() += stats;
+        }
+    };
+
+    static thread_local thread_slot slot;
+    return slot.stats;
+}
+#endif
+
+#if TOKEN_ITERATOR_STATS_TIMING
+// Records the time until the end of the enclosing scope into a histogram of the calling thread
+class scoped_latency {
+    latency_histogram &m_histogram;
+    std::chrono::steady_clock::time_point m_start;
+
+public:
+    explicit scoped_latency(latency_histogram &histogram) noexcept
+    :m_histogram{ histogram }, m_start{ std::chrono::steady_clock::now() }
+    {}
+
+    scoped_latency(const scoped_latency&) = delete;
+    scoped_latency &operator=(const scoped_latency&) = delete;
+
+    ~scoped_latency() {
+        auto elapsed = std::chrono::steady_clock::now() - m_start;
+        m_histogram.record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+};
+#define TOKEN_ITERATOR_TIME(histogram) scoped_latency token_iterator_latency_{ token_iterator_stats::local().histogram }
+#else
+#define TOKEN_ITERATOR_TIME(histogram) ((void)0)
+#endif
+
+// What an instrumentation (see token_policy) records: the token_iterator_stats counter of the same name,
+// and the operator whose latency is recorded.
+enum class token_counter : std::uint8_t {
+    get_token, get_token_extent, location_for_offset, tokenize, dispose_tokens, backward_searches, probes, steps
+};
+
+enum class token_timer : std::uint8_t { increments, decrements };
+
+// Instrumentation that records nothing, whether TOKEN_ITERATOR_STATS is defined or not. Its hooks are empty.
+//
+// An instrumentation has a static count(token_counter, std::uint64_t n), and a timer constructible from
+// a token_timer that records the time until it is destroyed.
+struct no_instrumentation {
+    struct timer {
+        explicit timer(token_timer) noexcept {}
+    };
+
+    static void count(token_counter, std::uint64_t = 1) noexcept {}
+};
+
+// Instrumentation that records into token_iterator_stats::local() with TOKEN_ITERATOR_STATS
+// (and TOKEN_ITERATOR_STATS_TIMING for the timers). Without, it records nothing.
+// It also records the libclang calls that no iterator makes: those of file_token_index for itself,
+// of extract_tokens() by default, and of token_chunk_lexer.
+struct stats_instrumentation {
+#if TOKEN_ITERATOR_STATS_TIMING
+    class timer {
+        scoped_latency m_latency;
+
+    public:
+        explicit timer(token_timer t) noexcept
+        :m_latency{ (t == token_timer::increments) ? token_iterator_stats::local().increments
+                                                   : token_iterator_stats::local().decrements }
+        {}
+    };
+#else
+    using timer = no_instrumentation::timer;
+#endif
+
+    static void count(token_counter counter, std::uint64_t n = 1) noexcept {
+#if TOKEN_ITERATOR_STATS
+        auto &stats = token_iterator_stats::local();
+        switch (counter) {
+        case token_counter::get_token: stats.get_token += n; break;
+        case token_counter::get_token_extent: stats.get_token_extent += n; break;
+        case token_counter::location_for_offset: stats.location_for_offset += n; break;
+        case token_counter::tokenize: stats.tokenize += n; break;
+        case token_counter::dispose_tokens: stats.dispose_tokens += n; break;
+        case token_counter::backward_searches: stats.backward_searches += n; break;
+        case token_counter::probes: stats.probes += n; break;
+        case token_counter::steps: stats.steps += n; break;
+        }
+#else
+        (void)counter;
+        (void)n;
+#endif
+    }
+};
+
+// The count() of an instrumentation. Token windows are shared by iterators rather than typed by their policy,
+// so each one keeps the count() of the iterator that lexed it, for its libclang calls up to its disposal.
+using token_counter_hook = void (*)(token_counter, std::uint64_t);
+
+// mmap() for token_index_store. Elsewhere, stored indices are read into memory instead.
+#if defined(__unix__) || defined(__APPLE__)
+#define TOKEN_ITERATOR_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <chrono>
+#endif
+
 // clang_getTokenLocation() will sometimes return
 // a CXSourceLocation that points to the middle of the entity.
 // Use the start/end positions of clang_getTokenExtent() instead because they are better behaved.
@@ -16,262 +306,4681 @@ public:
         m_loc = (p == begin) ? clang_getRangeStart(extent) : clang_getRangeEnd(extent);
     }
 
+    // For locations obtained some other way, e.g. clang_getLocationForOffset()
+    explicit cursor_location(const CXSourceLocation &loc) noexcept
+    :m_loc{ loc }
+    {}
+
     const CXSourceLocation &get() const noexcept {
         return m_loc;
     }
 };
 
-class token_iterator {
-    struct token_deleter {
-        CXTranslationUnit tu;
+// Byte offset of loc within the file it is spelled in
+inline unsigned int spelling_offset(CXSourceLocation loc) noexcept {
+    unsigned int offset = 0;
+    clang_getSpellingLocation(loc, nullptr, nullptr, nullptr, &offset);
+    return offset;
+}
 
-        token_deleter() noexcept 
-        :tu{ nullptr }
-        {};
+// Whitespace, as classified by std::isspace() in the "C" locale
+constexpr bool is_space(char c) noexcept {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
 
-        token_deleter(CXTranslationUnit t) noexcept
-        :tu{ t }
-        {}
+// Index of the most significant set bit. mask must not be 0.
+inline unsigned int highest_bit(std::uint32_t mask) noexcept {
+    assert(mask);
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanReverse(&index, mask);
+    return index;
+#else
+    return 31 - __builtin_clz(mask);
+#endif
+}
 
-        void operator()(CXToken* tok) const {
-            if (tok) {
-                assert(tu);
-                clang_disposeTokens(tu, tok, 1);
-            }
+inline unsigned int highest_bit(std::uint64_t mask) noexcept {
+    assert(mask);
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanReverse64(&index, mask);
+    return index;
+#else
+    return 63 - __builtin_clzll(mask);
+#endif
+}
+
+inline unsigned int lowest_bit(std::uint32_t mask) noexcept {
+    assert(mask);
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+inline unsigned int lowest_bit(std::uint64_t mask) noexcept {
+    assert(mask);
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward64(&index, mask);
+    return index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+#if TOKEN_ITERATOR_SSE2
+// Bit i is set if p[i] is whitespace
+inline std::uint32_t space_mask16(const char* p) noexcept {
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    auto spaces = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+    // '\t' <= c <= '\r', as one unsigned comparison
+    auto shifted = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+    auto controls = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8('\r' - '\t')), shifted);
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_or_si128(spaces, controls)));
+}
+#endif
+
+#if TOKEN_ITERATOR_AVX2
+inline std::uint32_t space_mask32(const char* p) noexcept {
+    auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    auto spaces = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' '));
+    auto shifted = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+    auto controls = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8('\r' - '\t')), shifted);
+    return static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(spaces, controls)));
+}
+#endif
+
+#if TOKEN_ITERATOR_NEON
+// Nibble i is set if p[i] is whitespace (NEON has no movemask)
+inline std::uint64_t space_nibbles16(const char* p) noexcept {
+    auto bytes = vld1q_u8(reinterpret_cast<const std::uint8_t*>(p));
+    auto spaces = vceqq_u8(bytes, vdupq_n_u8(' '));
+    auto controls = vcleq_u8(vsubq_u8(bytes, vdupq_n_u8('\t')), vdupq_n_u8('\r' - '\t'));
+    auto mask = vorrq_u8(spaces, controls);
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+}
+#endif
+
+// Bit i is set if p[i] is '\n' or '\r'
+#if TOKEN_ITERATOR_SSE2
+inline std::uint32_t newline_mask16(const char* p) noexcept {
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    auto newlines = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')));
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(newlines));
+}
+#endif
+
+#if TOKEN_ITERATOR_AVX2
+inline std::uint32_t newline_mask32(const char* p) noexcept {
+    auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    auto newlines = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r')));
+    return static_cast<std::uint32_t>(_mm256_movemask_epi8(newlines));
+}
+#endif
+
+#if TOKEN_ITERATOR_NEON
+inline std::uint64_t newline_nibbles16(const char* p) noexcept {
+    auto bytes = vld1q_u8(reinterpret_cast<const std::uint8_t*>(p));
+    auto newlines = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8('\n')), vceqq_u8(bytes, vdupq_n_u8('\r')));
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(newlines), 4)), 0);
+}
+#endif
+
+constexpr std::size_t not_found = static_cast<std::size_t>(-1);
+
+// Index of the last character of s for which is_space() == space, or not_found
+inline std::size_t find_last_of_class(gsl::span<const char> s, bool space) noexcept {
+    const char* data = s.data();
+    std::size_t n = s.size();
+
+#if TOKEN_ITERATOR_AVX2
+    for (; n >= 32; n -= 32) {
+        auto mask = space_mask32(data + n - 32);
+        if (!space) mask = ~mask;
+        if (mask) return n - 32 + highest_bit(mask);
+    }
+#endif
+#if TOKEN_ITERATOR_SSE2
+    for (; n >= 16; n -= 16) {
+        auto mask = space_mask16(data + n - 16);
+        if (!space) mask = ~mask & 0xFFFF;
+        if (mask) return n - 16 + highest_bit(mask);
+    }
+#elif TOKEN_ITERATOR_NEON
+    for (; n >= 16; n -= 16) {
+        auto nibbles = space_nibbles16(data + n - 16);
+        if (!space) nibbles = ~nibbles;
+        if (nibbles) return n - 16 + highest_bit(nibbles) / 4;
+    }
+#endif
+
+    // Portable fallback, and the tail of the vectorized loops
+    while (n > 0) {
+        --n;
+        if (is_space(data[n]) == space) return n;
+    }
+    return not_found;
+}
+
+inline std::size_t find_last_space(gsl::span<const char> s) noexcept {
+    return find_last_of_class(s, true);
+}
+
+inline std::size_t find_last_not_space(gsl::span<const char> s) noexcept {
+    return find_last_of_class(s, false);
+}
+
+// Bit k of a kind mask selects CXTokenKind k
+constexpr unsigned int kind_bit(CXTokenKind kind) noexcept {
+    return 1u << kind;
+}
+
+// Same scans over an array of token kinds (one byte each), looking for any kind in KindMask
+template <unsigned int KindMask>
+constexpr bool kind_in_mask(std::uint8_t kind) noexcept {
+    return kind < 8 && ((KindMask >> kind) & 1u);
+}
+
+#if TOKEN_ITERATOR_SSE2
+// Bit i is set if the kind p[i] is in KindMask
+template <unsigned int KindMask>
+inline std::uint32_t kind_mask16(const std::uint8_t* p) noexcept {
+    auto kinds = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    auto matches = _mm_setzero_si128();
+    for (int kind = 0; kind < 8; ++kind) {
+        if (KindMask & (1u << kind)) {
+            matches = _mm_or_si128(matches, _mm_cmpeq_epi8(kinds, _mm_set1_epi8(static_cast<char>(kind))));
         }
-    };
+    }
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(matches));
+}
+#endif
 
-    using unique_token = std::unique_ptr<CXToken, token_deleter>;
-    unique_token m_tok;
+#if TOKEN_ITERATOR_AVX2
+template <unsigned int KindMask>
+inline std::uint32_t kind_mask32(const std::uint8_t* p) noexcept {
+    auto kinds = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    auto matches = _mm256_setzero_si256();
+    for (int kind = 0; kind < 8; ++kind) {
+        if (KindMask & (1u << kind)) {
+            matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(kinds, _mm256_set1_epi8(static_cast<char>(kind))));
+        }
+    }
+    return static_cast<std::uint32_t>(_mm256_movemask_epi8(matches));
+}
+#endif
 
-    unique_token clone() const {
-        if (!m_tok) return unique_token{};
-        return unique_token{ clang_getToken(tu(), clang_getRangeStart(extent())), tu() };
+#if TOKEN_ITERATOR_NEON
+// Nibble i is set if the kind p[i] is in KindMask
+template <unsigned int KindMask>
+inline std::uint64_t kind_nibbles16(const std::uint8_t* p) noexcept {
+    auto kinds = vld1q_u8(p);
+    auto matches = vdupq_n_u8(0);
+    for (int kind = 0; kind < 8; ++kind) {
+        if (KindMask & (1u << kind)) {
+            matches = vorrq_u8(matches, vceqq_u8(kinds, vdupq_n_u8(static_cast<std::uint8_t>(kind))));
+        }
     }
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+}
+#endif
 
-    CXTranslationUnit tu() const {
-        assert(m_tok);
-        return m_tok.get_deleter().tu;
+// Index of the first kind at or after pos that is in KindMask, or kinds.size()
+template <unsigned int KindMask>
+inline std::size_t find_next_kind(gsl::span<const std::uint8_t> kinds, std::size_t pos) noexcept {
+    const std::uint8_t* data = kinds.data();
+    const std::size_t n = kinds.size();
+
+#if TOKEN_ITERATOR_AVX2
+    for (; pos + 32 <= n; pos += 32) {
+        auto mask = kind_mask32<KindMask>(data + pos);
+        if (mask) return pos + lowest_bit(mask);
     }
+#endif
+#if TOKEN_ITERATOR_SSE2
+    for (; pos + 16 <= n; pos += 16) {
+        auto mask = kind_mask16<KindMask>(data + pos);
+        if (mask) return pos + lowest_bit(mask);
+    }
+#elif TOKEN_ITERATOR_NEON
+    for (; pos + 16 <= n; pos += 16) {
+        auto nibbles = kind_nibbles16<KindMask>(data + pos);
+        if (nibbles) return pos + lowest_bit(nibbles) / 4;
+    }
+#endif
 
-    CXSourceRange extent() const {
-        assert(m_tok);
-        return clang_getTokenExtent(tu(), *m_tok);
+    for (; pos < n; ++pos) {
+        if (kind_in_mask<KindMask>(data[pos])) return pos;
     }
+    return n;
+}
 
-    // NOTE: the start location is either the end location of the previous token 
-    //       or the location of the first character of the current token
-    // 
-    // The end location is consistent regardless of which start location scheme is used
+// Index of the last kind before pos that is in KindMask, or not_found
+template <unsigned int KindMask>
+inline std::size_t find_prev_kind(gsl::span<const std::uint8_t> kinds, std::size_t pos) noexcept {
+    const std::uint8_t* data = kinds.data();
+    assert(pos <= static_cast<std::size_t>(kinds.size()));
+
+#if TOKEN_ITERATOR_AVX2
+    for (; pos >= 32; pos -= 32) {
+        auto mask = kind_mask32<KindMask>(data + pos - 32);
+        if (mask) return pos - 32 + highest_bit(mask);
+    }
+#endif
+#if TOKEN_ITERATOR_SSE2
+    for (; pos >= 16; pos -= 16) {
+        auto mask = kind_mask16<KindMask>(data + pos - 16);
+        if (mask) return pos - 16 + highest_bit(mask);
+    }
+#elif TOKEN_ITERATOR_NEON
+    for (; pos >= 16; pos -= 16) {
+        auto nibbles = kind_nibbles16<KindMask>(data + pos - 16);
+        if (nibbles) return pos - 16 + highest_bit(nibbles) / 4;
+    }
+#endif
+
+    while (pos > 0) {
+        --pos;
+        if (kind_in_mask<KindMask>(data[pos])) return pos;
+    }
+    return not_found;
+}
+
+// Base class for objects shared through ref_ptr.
+// The count is deliberately non-atomic: like the CXTranslationUnit they wrap, these objects
+// must not be shared across threads (see "Concurrency" below).
+class ref_counted {
+    template <typename T> friend class ref_ptr;
+    mutable unsigned int m_refs = 0;
+
+protected:
+    ref_counted() = default;
+    ~ref_counted() = default;
 
 public:
-    using difference_type = std::ptrdiff_t;
-    using value_type = CXToken;
-    using pointer = const CXToken*;
-    using reference = const CXToken&;
-    using iterator_category = std::forward_iterator_tag;
+    ref_counted(const ref_counted&) = delete;
+    ref_counted &operator=(const ref_counted&) = delete;
+};
 
-    // The end sentinel
-    token_iterator() = default;
+// Intrusive smart pointer. Copying is a pointer copy and an increment.
+template <typename T>
+class ref_ptr {
+    template <typename U> friend class ref_ptr;
 
-    token_iterator(gsl::not_null<CXTranslationUnit> tu, const cursor_location &loc) 
-    :m_tok{ clang_getToken(tu, loc.get()), tu.get() }
-    {}
+    T* m_ptr = nullptr;
+
+    void retain() const noexcept {
+        if (m_ptr) ++m_ptr->m_refs;
+    }
+
+    void release() noexcept {
+        if (m_ptr && --m_ptr->m_refs == 0) {
+            delete m_ptr;
+        }
+        m_ptr = nullptr;
+    }
+
+public:
+    ref_ptr() = default;
+
+    explicit ref_ptr(T* ptr) noexcept
+    :m_ptr{ ptr }
+    { retain(); }
 
-    token_iterator(token_iterator &&other) noexcept
-    :m_tok{ std::move(other.m_tok) }
+    ref_ptr(const ref_ptr &other) noexcept
+    :m_ptr{ other.m_ptr }
+    { retain(); }
+
+    ref_ptr(ref_ptr &&other) noexcept
+    :m_ptr{ std::exchange(other.m_ptr, nullptr) }
     {}
 
-    token_iterator(const token_iterator &other)
-    :m_tok{ other.clone() } 
+    // ref_ptr<T> to ref_ptr<const T>. Not from derived classes: the destructors of ref_counted types are not virtual.
+    template <typename U, typename = std::enable_if_t<std::is_same<std::remove_const_t<T>, U>::value>>
+    ref_ptr(ref_ptr<U> &&other) noexcept
+    :m_ptr{ std::exchange(other.m_ptr, nullptr) }
     {}
 
-    token_iterator &operator=(token_iterator &&other) noexcept {
-        m_tok = std::move(other.m_tok);
+    ~ref_ptr() { release(); }
+
+    ref_ptr &operator=(const ref_ptr &other) noexcept {
+        other.retain();
+        release();
+        m_ptr = other.m_ptr;
         return *this;
     }
 
-    token_iterator &operator=(const token_iterator &other) {
-        m_tok = other.clone();
+    ref_ptr &operator=(ref_ptr &&other) noexcept {
+        if (this != &other) {
+            release();
+            m_ptr = std::exchange(other.m_ptr, nullptr);
+        }
         return *this;
     }
 
-    token_iterator &operator++() {
-        assert(m_tok);
-        auto prev_extent = extent();
-        auto prev_end = clang_getRangeEnd(prev_extent);
+    T* get() const noexcept { return m_ptr; }
+    T &operator*() const noexcept { assert(m_ptr); return *m_ptr; }
+    T* operator->() const noexcept { assert(m_ptr); return m_ptr; }
+    explicit operator bool() const noexcept { return m_ptr != nullptr; }
 
-        m_tok.reset(clang_getToken(tu(), prev_end));
-        return *this;
-    }
+    bool operator==(const ref_ptr &other) const noexcept { return m_ptr == other.m_ptr; }
+    bool operator!=(const ref_ptr &other) const noexcept { return m_ptr != other.m_ptr; }
 
-    token_iterator operator++(int) {
-        auto temp = *this;
-        operator++();
-        return temp;
+    friend void swap(ref_ptr &lhs, ref_ptr &rhs) noexcept {
+        std::swap(lhs.m_ptr, rhs.m_ptr);
     }
+};
 
-    // WARNING: Does not work across files, even if
-    // they are contained within the same TU!
-    token_iterator &operator--() {
-        // TODO: Refactor into separate reverse iterator class
-        //       Make forward and reverse iterators convertible between one another.
-        //       The "end" sentinels of each class may not be converted to the other type.
-        assert(m_tok);
-
-        // Record current location information
-        const auto curr_extent = extent();
-        const auto curr_start = clang_getRangeStart(curr_extent);
-        const auto curr_end = clang_getRangeEnd(curr_extent);
+template <typename T, typename... Args>
+ref_ptr<T> make_ref(Args&&... args) {
+    return ref_ptr<T>{ new T(std::forward<Args>(args)...) };
+}
 
-        // Retrieve file handle and current offset
-        CXFile file = nullptr;
-        unsigned int offset = 0;
-        clang_getSpellingLocation(curr_start, &file, nullptr, nullptr, &offset);
-        assert(file);
-        assert(offset > 0); // TODO: convert to past-the-end sentinel in reverse iterator class.
+// The comments, string/character literals and numbers of a file, found by a lightweight forward scan of its buffer.
+// 
+// This is not a lexer. It only has to agree with libclang on where comments and literals begin and end,
+// so that the backward search in token_iterator::operator-- can jump over them in one step
+// (and never probes libclang from the middle of one, which lexes garbage).
+// Numbers are recorded because their tails do not lex as one token either ("1.e5" from the '.' is a period),
+// which would mislead the search for where they begin.
+class lexical_spans : public ref_counted {
+public:
+    enum span_kind : std::uint8_t { comment, literal, number };
 
-        // Retrieve file buffer that we can offset into
-        std::size_t file_size = 0;
-        const char* file_buffer = clang_getFileContents(tu(), file, &file_size);
-        assert(file_buffer);
-        assert(offset < file_size);
+    struct span {
+        unsigned int begin;
+        unsigned int end;
+        span_kind kind;
+    };
 
-        auto search_span = gsl::make_span(file_buffer, file_size);
+    struct line {
+        unsigned int begin;
+        unsigned int end;
+    };
 
-        // Step 1: Decrement offset until the lexer binds the end to a different position.
-        // That's when we know a new token has been found!
-        unique_token candidate_tok{ nullptr, tu() };
-        CXSourceLocation candidate_end;
+private:
+    // Sorted and disjoint
+    std::vector<span> m_spans;
 
-        while (true) {
-            assert(offset > 0);
-            --offset;
+    // The lines joined to the next one by a line splice outside any span, with the lines they are joined to.
+    // Sorted and disjoint.
+    std::vector<line> m_spliced_lines;
 
-            if (std::isspace(search_span[offset])) {
-                // Fast path.
-                continue;
-            }
-            else {
-                auto candidate_loc = clang_getLocationForOffset(tu(), file, offset);
-                candidate_tok.reset(clang_getToken(tu(), candidate_loc));
+    static bool is_digit(char c) noexcept {
+        return c >= '0' && c <= '9';
+    }
 
-                if (candidate_tok) {
-                    candidate_end = clang_getRangeEnd(clang_getTokenExtent(tu(), *candidate_tok));
-                    if (!clang_equalLocations(candidate_end, curr_end)) {
-                        break;
-                    }
-                }
+    static bool is_horizontal_space(char c) noexcept {
+        return c == ' ' || c == '\t' || c == '\f' || c == '\v';
+    }
 
-                // In most (all?) cases, this branch will only be evaluated once
-                // before a valid candidate is found.
-            }
+    // The size of the identifier character at i, or 0 if there is none. Beyond ASCII, any well-formed UTF-8 sequence
+    // counts (clang also checks that it is in one of the ranges C++ allows), and a stray byte is a token of its own.
+    // Numbers are made of these too, except for '$'.
+    static std::size_t identifier_char_size(std::string_view buffer, std::size_t i, bool allow_dollar = true) noexcept {
+        const auto c = static_cast<unsigned char>(buffer[i]);
+        if (c < 0x80) return (is_identifier_char(buffer[i]) && (allow_dollar || c != '$')) ? 1 : 0;
+
+        const std::size_t size = (c >= 0xC2 && c <= 0xDF) ? 2 : (c >= 0xE0 && c <= 0xEF) ? 3 : (c >= 0xF0 && c <= 0xF4) ? 4 : 0;
+        if (size == 0 || i + size > buffer.size()) return 0;
+        for (std::size_t k = 1; k < size; ++k) {
+            if ((static_cast<unsigned char>(buffer[i + k]) & 0xC0) != 0x80) return 0;
         }
+        return size;
+    }
 
-        // Step 2: Ok, now to find the beginning of this token        
-        search_span = search_span.first(offset);
-        // Note that we dropped the offset-th character because we already know for sure it sits within
-        // the bounds of the candidate token
+    // The size of the line splice (a backslash, optional whitespace and a newline) at i, or 0 if there is none
+    static std::size_t splice_size(std::string_view buffer, std::size_t i) noexcept {
+        if (buffer[i] != '\\') return 0;
+        auto k = i + 1;
+        while (k < buffer.size() && is_horizontal_space(buffer[k])) ++k;
+        if (k < buffer.size() && buffer[k] == '\r') ++k;
+        else if (k == buffer.size() || buffer[k] != '\n') return 0;
+        if (k < buffer.size() && buffer[k] == '\n') ++k;
+        return k - i;
+    }
 
-        // Reduce the number of CXTokens created (and all the associated overhead) by performing binary search
-        // First, identify the bounds of the string (non-whitespace characters)
-        auto str_begin = std::find_if(search_span.rbegin(), search_span.rend(), 
-                                      [](char c){ return std::isspace(c); });
-        auto str_length = std::distance(search_span.rbegin(), str_begin);
-        search_span = search_span.last(str_length);
+    // The position of the first character at or after i that is not part of a line splice. Like clang, the scan reads
+    // through splices, wherever they are ("1'\\\n0" is one number).
+    static std::size_t skip_splices(std::string_view buffer, std::size_t i) noexcept {
+        while (i < buffer.size()) {
+            const auto splice = splice_size(buffer, i);
+            if (splice == 0) break;
+            i += splice;
+        }
+        return i;
+    }
 
-        if (!search_span.empty()) {
-            // We would love to use std::lower_bound, but we want to avoid unnecessary (re)-allocations
-            // Caching is an option, but inelegant
-            // You can't deny a span-based implementation is not nice too!
+    // The character at skip_splices(i), or '\0' at the end of the buffer
+    static char char_at(std::string_view buffer, std::size_t i) noexcept {
+        i = skip_splices(buffer, i);
+        return (i < buffer.size()) ? buffer[i] : '\0';
+    }
+
+    // i is just past the "//". Returns the position of the newline that ends the comment.
+    static std::size_t skip_line_comment(std::string_view buffer, std::size_t i) noexcept {
+        for (; i < buffer.size(); ++i) {
+            if (buffer[i] == '\n' && !is_continued(buffer, i)) return i;
+        }
+        return buffer.size();
+    }
 
-            // Helper. Returns false if the given pos goes past the candidate token
-            // Returns true if it's within the candidate token bounds, and replace the candidate token with
-            // the CXToken from this pos.
-            auto consider_next_candidate = [&](const char* pos) {
-                auto offset = gsl::narrow<unsigned int>(pos - file_buffer);
-                auto next_candidate_loc = clang_getLocationForOffset(tu(), file, offset);
+    // i is just past the "/*"
+    static std::size_t skip_block_comment(std::string_view buffer, std::size_t i) noexcept {
+        for (auto star = buffer.find('*', i); star != std::string_view::npos; star = buffer.find('*', star + 1)) {
+            const auto slash = skip_splices(buffer, star + 1);
+            if (slash < buffer.size() && buffer[slash] == '/') return slash + 1;
+        }
+        return buffer.size();
+    }
 
-                unique_token next_candidate_tok{ clang_getToken(tu(), next_candidate_loc), tu() };
-                if (next_candidate_tok) {
-                    auto next_candidate_end = clang_getRangeEnd(clang_getTokenExtent(tu(), *next_candidate_tok));
+    // i is at the opening quote. Unterminated literals end at the end of the line, like in clang.
+    static std::size_t skip_quoted(std::string_view buffer, std::size_t i) noexcept {
+        const char quote = buffer[i];
+        for (++i; i < buffer.size(); ++i) {
+            if (auto splice = splice_size(buffer, i)) {
+                // The line continues, even with whitespace after the backslash
+                i += splice - 1;
+            }
+            else if (buffer[i] == '\\') {
+                // Skip the escaped character. An escaped CRLF is a line continuation.
+                if (i + 2 < buffer.size() && buffer[i + 1] == '\r' && buffer[i + 2] == '\n') ++i;
+                ++i;
+            }
+            else if (buffer[i] == quote) {
+                return i + 1;
+            }
+            else if (buffer[i] == '\n' || buffer[i] == '\r') {
+                return i;
+            }
+        }
+        return buffer.size();
+    }
 
-                    if (!clang_equalLocations(next_candidate_end, candidate_end)) {
-                        return false;
-                    }
+    // The characters a raw string delimiter can be made of
+    static bool is_raw_delimiter_char(char c) noexcept {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) ||
+               std::string_view{ "_{}[]#<>%:;.?*+-/^&|~!=,\"'" }.find(c) != std::string_view::npos;
+    }
 
-                    candidate_tok = std::move(next_candidate_tok);
-                    return true;
-                }
+    // i is at the opening quote of R"delimiter( ... )delimiter"
+    static std::size_t skip_raw_string(std::string_view buffer, std::size_t i) noexcept {
+        constexpr std::size_t max_delimiter_length = 16;
 
-                return false;
-            };
+        auto paren = i + 1;
+        while (paren < buffer.size() && paren - i - 1 < max_delimiter_length && is_raw_delimiter_char(buffer[paren])) ++paren;
+        if (paren == buffer.size() || buffer[paren] != '(') {
+            // Not a raw string after all. Like clang, recover at the next quote, whichever line it is on.
+            auto quote = buffer.find('"', i + 1);
+            return (quote == std::string_view::npos) ? buffer.size() : quote + 1;
+        }
 
-            if (consider_next_candidate(search_span.data())) {
-                // Heuristic - consider the first character of the string first
-                // Nothing to do - consider_next_candidate() has side effects.
+        auto delimiter = buffer.substr(i + 1, paren - i - 1);
+
+        for (auto close = buffer.find(')', paren + 1); close != std::string_view::npos; close = buffer.find(')', close + 1)) {
+            if (buffer.substr(close + 1, delimiter.size()) == delimiter &&
+                close + 1 + delimiter.size() < buffer.size() &&
+                buffer[close + 1 + delimiter.size()] == '"') {
+                return close + delimiter.size() + 2;
             }
-            else {
-                // Drop the first character because we already checked that and it didn't work out
-                search_span = search_span.subspan(1);
+        }
+        return buffer.size();
+    }
 
-                // We would love to use std::lower_bound, but we want to avoid unnecessary (re)-allocations
-                // Caching is an option, but inelegant
-                // You can't deny a span-based implementation is not nice too!
-             
-                while (!search_span.empty()) {
-                    auto mid_pos = search_span.size() / 2;
+    // i is at the first character of a number (a "pp-number", so that 1'000 and 1e+5 are skipped whole)
+    // A sign only follows the 'p' of hexadecimal floats ("0x1p-3"), and the 'e' of any number.
+    static std::size_t skip_number(std::string_view buffer, std::size_t i) noexcept {
+        const bool hexadecimal = buffer[i] == '0' && (char_at(buffer, i + 1) | 0x20) == 'x';
+        char previous = buffer[i];
+        for (++i;;) {
+            const auto k = skip_splices(buffer, i);
+            if (k == buffer.size()) break;
 
-                    if (consider_next_candidate(&search_span[mid_pos])) {
-                        // Still in bounds. Continue to the left.
-                        search_span = search_span.first(mid_pos);
-                    }
-                    else {
-                        // Overshot. Backtrack to the right.
-                        search_span = search_span.subspan(mid_pos + 1); 
-                        // +1 because we already considered mid_pos
-                    }
-                }
+            const char c = buffer[k];
+            auto size = identifier_char_size(buffer, k, false);
+            if (size == 0 && c == '.') {
+                size = 1;
             }
-        }
-        // else: one character token
+            if (size == 0 && (c == '+' || c == '-') && ((previous | 0x20) == 'e' || (hexadecimal && (previous | 0x20) == 'p'))) {
+                size = 1;
+            }
+            if (size == 0 && c == '\'') {
+                // A digit separator
+                const auto n = skip_splices(buffer, k + 1);
+                if (n < buffer.size() && identifier_char_size(buffer, n, false) == 1) size = 1;
+            }
+            if (size == 0) break;
 
-        m_tok = std::move(candidate_tok);
-        return *this;
+            previous = c;
+            i = k + size;
+        }
+        return i;
     }
 
-    token_iterator operator--(int) {
-        auto temp = *this;
-        operator--();
-        return temp;
+    // True if there is a line splice in [begin, end)
+    static bool contains_splice(std::string_view buffer, std::size_t begin, std::size_t end) noexcept {
+        const auto text = buffer.substr(begin, end - begin);
+        for (auto i = text.find('\\'); i != std::string_view::npos; i = text.find('\\', i + 1)) {
+            if (splice_size(buffer, begin + i)) return true;
+        }
+        return false;
     }
 
-    inline reference operator*() const {
-        assert(m_tok);
-        return *m_tok;
+    void add(std::size_t begin, std::size_t end, span_kind kind) {
+        m_spans.push_back(span{ gsl::narrow<unsigned int>(begin), gsl::narrow<unsigned int>(end), kind });
     }
 
-    inline pointer operator->() const {
-        assert(m_tok);
-        return m_tok.get();
-    }
+public:
+    explicit lexical_spans(gsl::span<const char> file_buffer) {
+        std::string_view buffer{ file_buffer.data(), file_buffer.size() };
 
-    bool operator==(const token_iterator &other) const {
-        if (bool(m_tok) != bool(other.m_tok)) return false;
-        if (!m_tok) return true;
+        std::size_t line_begin = 0;
+        bool spliced = false;
 
-        return tu() == other.tu() && 
-               clang_equalLocations(clang_getRangeEnd(extent()), clang_getRangeEnd(other.extent()));
-    }
+        std::size_t i = 0;
+        while (i < buffer.size()) {
+            if (auto splice = splice_size(buffer, i)) {
+                spliced = true;
+                i += splice;
+                continue;
+            }
 
-    bool operator!=(const token_iterator &other) const {
-        return !operator==(other);
-    }
+            const char c = buffer[i];
+            const auto after = skip_splices(buffer, i + 1);
+            const char next = (after < buffer.size()) ? buffer[after] : '\0';
+            const auto begin = i;
 
-    bool is_end_sentinel() const noexcept { return !m_tok; }
-    operator bool() const noexcept { return !is_end_sentinel(); }
+            if (c == '\n') {
+                if (spliced) {
+                    m_spliced_lines.push_back(line{ gsl::narrow<unsigned int>(line_begin), gsl::narrow<unsigned int>(i) });
+                    spliced = false;
+                }
+                line_begin = ++i;
+                continue;
+            }
 
-    friend void swap(token_iterator &lhs, token_iterator &rhs) noexcept {
-        std::swap(lhs.m_tok, rhs.m_tok);
-    }
-};
+            if (c == '/' && next == '/') {
+                i = skip_line_comment(buffer, after + 1);
+                add(begin, i, comment);
+            }
+            else if (c == '/' && next == '*') {
+                i = skip_block_comment(buffer, after + 1);
+                add(begin, i, comment);
+            }
+            else if (c == '"' || c == '\'') {
+                i = skip_quoted(buffer, i);
+                add(begin, i, literal);
+            }
+            else if (c == '.' && next == '.' && char_at(buffer, after + 1) == '.') {
+                // An ellipsis, whose last period does not start a number ("...1." is "..." "1.")
+                i = skip_splices(buffer, after + 1) + 1;
+            }
+            else if (is_digit(c) || (c == '.' && is_digit(next))) {
+                i = skip_number(buffer, i);
+                add(begin, i, number);
+            }
+            else if (identifier_char_size(buffer, i)) {
+                // Its first characters, enough to tell an encoding prefix
+                std::string prefix;
+                for (auto size = identifier_char_size(buffer, i); size != 0;) {
+                    if (prefix.size() <= 3) prefix.append(buffer.substr(i, size));
+                    i += size;
+                    const auto k = skip_splices(buffer, i);
+                    size = (k < buffer.size()) ? identifier_char_size(buffer, k) : 0;
+                    if (size != 0) i = k;
+                }
+
+                const auto quote = skip_splices(buffer, i);
+                if (quote < buffer.size() && (buffer[quote] == '"' || buffer[quote] == '\'')) {
+                    // Encoding prefixes and raw strings are part of the literal
+                    if (buffer[quote] == '"' && (prefix == "R" || prefix == "u8R" || prefix == "uR" || prefix == "UR" || prefix == "LR")) {
+                        i = skip_raw_string(buffer, quote);
+                        add(begin, i, literal);
+                    }
+                    else if (prefix == "u8" || prefix == "u" || prefix == "U" || prefix == "L") {
+                        i = skip_quoted(buffer, quote);
+                        add(begin, i, literal);
+                    }
+                }
+            }
+            else {
+                ++i;
+            }
+
+            // The line is spliced if what was just skipped is
+            spliced = spliced || contains_splice(buffer, begin, i);
+        }
+
+        if (spliced) {
+            m_spliced_lines.push_back(line{ gsl::narrow<unsigned int>(line_begin), gsl::narrow<unsigned int>(buffer.size()) });
+        }
+    }
+
+    const std::vector<span> &spans() const noexcept { return m_spans; }
+
+    // The spliced line that contains offset, or nullptr. A splice joins the characters around it into one token
+    // ("+\\\n+" is "++"), and a token can start with one, so only lexing the line from its start splits it right.
+    const line* spliced_line(unsigned int offset) const noexcept {
+        auto it = std::upper_bound(m_spliced_lines.begin(), m_spliced_lines.end(), offset,
+                                   [](unsigned int offset, const line &l) { return offset < l.begin; });
+        if (it == m_spliced_lines.begin()) return nullptr;
+        --it;
+        return (offset < it->end) ? &*it : nullptr;
+    }
+
+    // The last span that begins before offset, or nullptr
+    const span* last_before(unsigned int offset) const noexcept {
+        auto it = std::lower_bound(m_spans.begin(), m_spans.end(), offset,
+                                   [](const span &s, unsigned int offset) { return s.begin < offset; });
+        return (it == m_spans.begin()) ? nullptr : &*std::prev(it);
+    }
+
+    // The span that contains offset, or nullptr
+    const span* find(unsigned int offset) const noexcept {
+        auto s = last_before(offset + 1);
+        return (s && offset < s->end) ? s : nullptr;
+    }
+
+    // True if the newline at i is escaped by a backslash, i.e. the line continues.
+    // Like clang, this allows whitespace between the backslash and the newline.
+    static bool is_continued(std::string_view buffer, std::size_t i) noexcept {
+        while (i > 0 && (buffer[i - 1] == ' ' || buffer[i - 1] == '\t' || buffer[i - 1] == '\f' ||
+                         buffer[i - 1] == '\v' || buffer[i - 1] == '\r')) {
+            --i;
+        }
+        return i > 0 && buffer[i - 1] == '\\';
+    }
+
+    // The characters of identifiers (and of numbers, which start with a digit or a period)
+    static bool is_identifier_char(char c) noexcept {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+               c == '_' || c == '$' || static_cast<unsigned char>(c) >= 0x80;
+    }
+
+    // The characters of the punctuators that are longer than one character, and '?', which starts trigraphs
+    // (clang lexes "#??=" as "#?" "?" "=" even when they are off)
+    static bool is_punctuator_char(char c) noexcept {
+        switch (c) {
+        case '!': case '#': case '%': case '&': case '*': case '+': case '-': case '.':
+        case '/': case ':': case '<': case '=': case '>': case '?': case '^': case '|':
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // The first character of the run of punctuator characters that ends with the one at offset, which must not be
+    // in a span. The character before the run ends a token of another kind, so a punctuator starts at the first
+    // character of the run, and lexing from there splits the run as a lex of the whole file does.
+    unsigned int punctuator_run_begin(gsl::span<const char> buffer, unsigned int offset) const noexcept {
+        assert(!find(offset));
+        auto s = last_before(offset);
+        const unsigned int limit = s ? s->end : 0;
+
+        auto begin = offset;
+        while (begin > limit && is_punctuator_char(buffer[begin - 1])) --begin;
+        return begin;
+    }
+
+    // The first character of the run of identifier characters that ends with the one at offset, which must not be
+    // in a span. Numbers are spans, so the run is an identifier (or keyword) from its first character, while its
+    // tail can lex as something else ("2" in "v2", "1e+5" in "R1e+5").
+    unsigned int identifier_run_begin(gsl::span<const char> buffer, unsigned int offset) const noexcept {
+        assert(!find(offset));
+        auto s = last_before(offset);
+        const unsigned int limit = s ? s->end : 0;
+
+        auto begin = offset;
+        while (begin > limit && is_identifier_char(buffer[begin - 1])) --begin;
+
+        // Bytes from 0x80 on only belong to it in well-formed sequences, so it starts after the last stray one
+        std::string_view view{ buffer.data(), buffer.size() };
+        for (auto i = begin; i < offset;) {
+            const auto size = identifier_char_size(view, i);
+            i += size ? size : 1;
+            if (size == 0) begin = gsl::narrow_cast<unsigned int>(i);
+        }
+        return std::min(begin, offset);
+    }
+
+    // The string or character literal that ends at offset, or nullptr. An identifier there may be its user-defined suffix.
+    const span* literal_ending_at(unsigned int offset) const noexcept {
+        auto s = last_before(offset);
+        return (s && s->kind == literal && s->end == offset) ? s : nullptr;
+    }
+
+    // The first newline at or after offset that ends a line outside any comment or literal, or the size of the buffer.
+    // No token crosses it, so the buffer can be lexed in pieces split there with the same tokens as in one go.
+    unsigned int next_line_break(gsl::span<const char> file_buffer, unsigned int offset) const noexcept {
+        std::string_view buffer{ file_buffer.data(), file_buffer.size() };
+
+        for (auto i = buffer.find('\n', offset); i != std::string_view::npos; i = buffer.find('\n', i)) {
+            if (auto s = find(gsl::narrow_cast<unsigned int>(i))) {
+                i = s->end;
+                continue;
+            }
+
+            if (is_continued(buffer, i)) {
+                ++i;
+                continue;
+            }
+
+            return gsl::narrow_cast<unsigned int>(i);
+        }
+        return gsl::narrow_cast<unsigned int>(buffer.size());
+    }
+
+    std::size_t memory_usage() const noexcept {
+        return sizeof(*this) + m_spans.capacity() * sizeof(span) + m_spliced_lines.capacity() * sizeof(line);
+    }
+};
+
+// The offset at which each line of a file buffer starts, found by one vectorized scan for line endings.
+// Lines end with "\n", "\r\n" or a lone "\r", like in clang. Lines and columns are 1-based, and columns count bytes,
+// so that they are the same as those of clang_getSpellingLocation().
+class line_table : public ref_counted {
+    std::vector<unsigned int> m_line_starts;
+
+    // Records the line that starts after the line ending character at i
+    void add_line_ending(std::string_view buffer, std::size_t i) {
+        // The '\n' of "\r\n" ends the line
+        if (buffer[i] == '\r' && i + 1 < buffer.size() && buffer[i + 1] == '\n') return;
+        m_line_starts.push_back(gsl::narrow_cast<unsigned int>(i + 1));
+    }
+
+public:
+    explicit line_table(std::string_view buffer) {
+        m_line_starts.reserve(buffer.size() / 32 + 1);
+        m_line_starts.push_back(0);
+
+        const char* data = buffer.data();
+        const std::size_t n = buffer.size();
+        std::size_t pos = 0;
+
+#if TOKEN_ITERATOR_AVX2
+        for (; pos + 32 <= n; pos += 32) {
+            for (auto mask = newline_mask32(data + pos); mask; mask &= mask - 1) {
+                add_line_ending(buffer, pos + lowest_bit(mask));
+            }
+        }
+#endif
+#if TOKEN_ITERATOR_SSE2
+        for (; pos + 16 <= n; pos += 16) {
+            for (auto mask = newline_mask16(data + pos); mask; mask &= mask - 1) {
+                add_line_ending(buffer, pos + lowest_bit(mask));
+            }
+        }
+#elif TOKEN_ITERATOR_NEON
+        for (; pos + 16 <= n; pos += 16) {
+            // One nibble per byte. Clear the whole nibble of each byte found.
+            for (auto nibbles = newline_nibbles16(data + pos); nibbles; ) {
+                auto byte = lowest_bit(nibbles) / 4;
+                add_line_ending(buffer, pos + byte);
+                nibbles &= ~(std::uint64_t{ 0xF } << (4 * byte));
+            }
+        }
+#endif
+
+        for (; pos < n; ++pos) {
+            if (data[pos] == '\n' || data[pos] == '\r') add_line_ending(buffer, pos);
+        }
+    }
+
+    unsigned int num_lines() const noexcept { return static_cast<unsigned int>(m_line_starts.size()); }
+
+    // Of the character at offset
+    unsigned int line(unsigned int offset) const noexcept {
+        auto it = std::upper_bound(m_line_starts.begin(), m_line_starts.end(), offset);
+        return static_cast<unsigned int>(std::distance(m_line_starts.begin(), it));
+    }
+
+    unsigned int column(unsigned int offset) const noexcept {
+        return offset - line_start(line(offset)) + 1;
+    }
+
+    // Offset of the first character of line
+    unsigned int line_start(unsigned int line) const noexcept {
+        assert(line >= 1 && line <= num_lines());
+        return m_line_starts[line - 1];
+    }
+
+    std::size_t memory_usage() const noexcept {
+        return sizeof(*this) + m_line_starts.capacity() * sizeof(unsigned int);
+    }
+
+    // Of the table of buffer_size bytes, before it is scanned. Exact unless its lines average under 32 bytes.
+    static std::size_t estimated_memory_usage(std::size_t buffer_size) noexcept {
+        return sizeof(line_table) + (buffer_size / 32 + 1) * sizeof(unsigned int);
+    }
+};
+
+// A token decoded into plain values, so that reading a field never calls into libclang.
+// 
+// spelling points into the clang_getFileContents() buffer, which lives as long as the TU.
+// It is the token as written: a token split by a line continuation keeps its backslash-newline.
+struct token_view {
+    CXTokenKind kind;
+    CXFile file;
+    unsigned int begin_offset;
+    unsigned int end_offset;
+    std::string_view spelling;
+};
+
+// Recycles the storage of released token windows, so that a walk which keeps creating and dropping windows
+// (every slow operator-- step does) stops allocating once warmed up.
+// 
+// One pool per thread, in line with the thread confinement of windows. Memory is returned to the pool
+// of the thread that releases the window, which is usually the thread that created it; a window released
+// on another thread just feeds that thread's pool.
+class token_window_pool {
+    // Enough for a handful of live iterators, each with a window or two
+    static constexpr std::size_t max_free_blocks = 64;
+
+    // Larger offset buffers (i.e. whole files) are freed as usual rather than hoarded
+    static constexpr std::size_t max_recycled_capacity = 4096;
+
+    std::vector<void*> m_blocks;
+    std::vector<std::vector<unsigned int>> m_offsets;
+
+    // Windows released during thread exit, after the pool is gone, go straight to the heap
+    static inline thread_local bool t_destroyed = false;
+
+    token_window_pool() {
+        m_blocks.reserve(max_free_blocks);
+        m_offsets.reserve(2 * max_free_blocks);
+    }
+
+public:
+    token_window_pool(const token_window_pool&) = delete;
+    token_window_pool &operator=(const token_window_pool&) = delete;
+
+    ~token_window_pool() {
+        for (auto block : m_blocks) ::operator delete(block);
+        t_destroyed = true;
+    }
+
+    // The pool of the calling thread, or nullptr during thread exit
+    static token_window_pool* local() noexcept {
+        if (t_destroyed) return nullptr;
+        static thread_local token_window_pool pool;
+        return &pool;
+    }
+
+    void* allocate(std::size_t size) {
+        if (!m_blocks.empty()) {
+            auto block = m_blocks.back();
+            m_blocks.pop_back();
+            return block;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* block) noexcept {
+        if (m_blocks.size() < max_free_blocks) {
+            m_blocks.push_back(block);
+        }
+        else {
+            ::operator delete(block);
+        }
+    }
+
+    // An empty buffer, with capacity left over from an earlier window if there is one
+    std::vector<unsigned int> take_offsets() noexcept {
+        if (m_offsets.empty()) return {};
+        auto offsets = std::move(m_offsets.back());
+        m_offsets.pop_back();
+        return offsets;
+    }
+
+    void give_back(std::vector<unsigned int> &&offsets) noexcept {
+        if (m_offsets.size() < 2 * max_free_blocks && offsets.capacity() > 0 &&
+            offsets.capacity() <= max_recycled_capacity) {
+            offsets.clear();
+            m_offsets.push_back(std::move(offsets));
+        }
+    }
+};
+
+// A change to the contents of a file: the removed bytes at offset were replaced by inserted bytes.
+struct text_edit {
+    unsigned int offset;
+    unsigned int removed;
+    unsigned int inserted;
+
+    // Where old_offset is after the edit. Offsets within the removed text move to the end of the inserted text.
+    unsigned int map(unsigned int old_offset) const noexcept {
+        if (old_offset < offset) return old_offset;
+        if (old_offset < offset + removed) return offset + inserted;
+        return old_offset - removed + inserted;
+    }
+};
+
+// Counts the reparses of a TU seen by a token_cache.
+// An index built at an older generation refers to tokens that no longer exist.
+class tu_generation : public ref_counted {
+    unsigned int m_value = 0;
+
+public:
+    unsigned int value() const noexcept { return m_value; }
+    void bump() noexcept { ++m_value; }
+};
+
+// Thrown when the tokens of an index, or an iterator over them, are used after their TU was reparsed
+// (i.e. once they are stale()). Only indices owned by a token_cache, and iterators over them, can tell.
+class stale_token_error : public std::logic_error {
+public:
+    using std::logic_error::logic_error;
+};
+
+// The read-only contents of a file, mapped into memory (or read, where mmap() is not available)
+class mapped_file {
+    const char* m_data = nullptr;
+    std::size_t m_size = 0;
+#if !TOKEN_ITERATOR_MMAP
+    std::unique_ptr<std::uint64_t[]> m_buffer;
+#endif
+
+    mapped_file() = default;
+
+public:
+    mapped_file(const mapped_file&) = delete;
+    mapped_file &operator=(const mapped_file&) = delete;
+
+    ~mapped_file() {
+#if TOKEN_ITERATOR_MMAP
+        if (m_data) munmap(const_cast<char*>(m_data), m_size);
+#endif
+    }
+
+    // Returns nullptr if path cannot be opened, or is empty
+    static std::unique_ptr<mapped_file> open(const std::string &path) {
+        std::unique_ptr<mapped_file> file{ new mapped_file };
+
+#if TOKEN_ITERATOR_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return nullptr;
+        }
+
+        void* data = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) return nullptr;
+
+        file->m_data = static_cast<const char*>(data);
+        file->m_size = static_cast<std::size_t>(st.st_size);
+#else
+        std::FILE* f = std::fopen(path.c_str(), "rb");
+        if (!f) return nullptr;
+
+        std::fseek(f, 0, SEEK_END);
+        long size = std::ftell(f);
+        std::fseek(f, 0, SEEK_SET);
+        if (size <= 0) {
+            std::fclose(f);
+            return nullptr;
+        }
+
+        // Suitably aligned for the arrays of a stored index
+        file->m_buffer.reset(new std::uint64_t[(static_cast<std::size_t>(size) + 7) / 8]);
+        file->m_size = std::fread(file->m_buffer.get(), 1, static_cast<std::size_t>(size), f);
+        file->m_data = reinterpret_cast<const char*>(file->m_buffer.get());
+        std::fclose(f);
+        if (file->m_size != static_cast<std::size_t>(size)) return nullptr;
+#endif
+
+        return file;
+    }
+
+    const char* data() const noexcept { return m_data; }
+    std::size_t size() const noexcept { return m_size; }
+};
+
+class token_window;
+
+// The compact {kind, begin offset, end offset} record of every token of a file, as parallel arrays sorted by offset.
+// Unlike CXTokens, these survive a reparse of the TU as long as the file is unchanged.
+// 
+// The arrays are either built in memory, or point into a file mapped by token_index_store.
+class token_table : public ref_counted {
+    std::vector<unsigned int> m_begin_offsets;
+    std::vector<unsigned int> m_end_offsets;
+    std::vector<std::uint8_t> m_kinds;
+
+    std::unique_ptr<mapped_file> m_mapping;
+    gsl::span<const unsigned int> m_mapped_begin_offsets;
+    gsl::span<const unsigned int> m_mapped_end_offsets;
+    gsl::span<const std::uint8_t> m_mapped_kinds;
+
+public:
+    token_table() = default;
+
+    token_table(std::unique_ptr<mapped_file> mapping, gsl::span<const unsigned int> begin_offsets,
+                gsl::span<const unsigned int> end_offsets, gsl::span<const std::uint8_t> kinds) noexcept
+    :m_mapping{ std::move(mapping) }, m_mapped_begin_offsets{ begin_offsets }, m_mapped_end_offsets{ end_offsets },
+     m_mapped_kinds{ kinds }
+    {
+        assert(m_mapping);
+        assert(begin_offsets.size() == end_offsets.size() && begin_offsets.size() == kinds.size());
+    }
+
+    bool mapped() const noexcept { return m_mapping != nullptr; }
+
+    unsigned int size() const noexcept {
+        return static_cast<unsigned int>(mapped() ? m_mapped_kinds.size() : m_kinds.size());
+    }
+
+    gsl::span<const unsigned int> begin_offsets() const noexcept {
+        return mapped() ? m_mapped_begin_offsets : gsl::span<const unsigned int>{ m_begin_offsets };
+    }
+
+    gsl::span<const unsigned int> end_offsets() const noexcept {
+        return mapped() ? m_mapped_end_offsets : gsl::span<const unsigned int>{ m_end_offsets };
+    }
+
+    gsl::span<const std::uint8_t> kinds() const noexcept {
+        return mapped() ? m_mapped_kinds : gsl::span<const std::uint8_t>{ m_kinds };
+    }
+
+    void reserve(std::size_t num_tokens) {
+        assert(!mapped());
+        m_begin_offsets.reserve(num_tokens);
+        m_end_offsets.reserve(num_tokens);
+        m_kinds.reserve(num_tokens);
+    }
+
+    void push_back(unsigned int begin_offset, unsigned int end_offset, std::uint8_t kind) {
+        assert(!mapped());
+        m_begin_offsets.push_back(begin_offset);
+        m_end_offsets.push_back(end_offset);
+        m_kinds.push_back(kind);
+    }
+
+    // Appends the tokens [first, last) of other, moved by delta bytes
+    void append(const token_table &other, unsigned int first, unsigned int last, std::ptrdiff_t delta = 0) {
+        auto begins = other.begin_offsets();
+        auto ends = other.end_offsets();
+        auto kinds = other.kinds();
+        for (auto i = first; i < last; ++i) {
+            push_back(gsl::narrow_cast<unsigned int>(begins[i] + delta), gsl::narrow_cast<unsigned int>(ends[i] + delta), kinds[i]);
+        }
+    }
+
+    // Appends the tokens of window from first on
+    void append(const token_window &window, unsigned int first = 0);
+
+    // Appends the tokens [first, last) of window
+    void append(const token_window &window, unsigned int first, unsigned int last);
+
+    // Mapped tables count the size of their mapping
+    std::size_t memory_usage() const noexcept {
+        return sizeof(*this) + (mapped() ? m_mapping->size() : 0) +
+               (m_begin_offsets.capacity() + m_end_offsets.capacity()) * sizeof(unsigned int) +
+               m_kinds.capacity() * sizeof(std::uint8_t);
+    }
+};
+
+// A batch of consecutive tokens lexed by a single libclang call.
+// Shared by every iterator positioned inside it, and disposed once the last one lets go.
+// 
+// The spelling offsets of every token are decoded up front, in one pass,
+// so that iterators never have to query libclang for the location of a token.
+// 
+// A bounded window covers a whole range of interest (e.g. a cursor extent or a file).
+// Iterators become the end sentinel when they step past its last token instead of lexing further.
+class token_window : public ref_counted {
+    CXTranslationUnit m_tu;
+    CXToken* m_tokens;
+    unsigned int m_num_tokens;
+    bool m_bounded;
+    token_counter_hook m_count;
+
+    CXFile m_file = nullptr;
+    std::string_view m_buffer;
+    std::vector<unsigned int> m_begin_offsets;
+    std::vector<unsigned int> m_end_offsets;
+
+    // Computed by the first backward search out of this window, and handed down to the windows after it
+    mutable ref_ptr<const lexical_spans> m_spans;
+
+    // Built on first use of line() or column(), and handed down like m_spans
+    mutable ref_ptr<const line_table> m_lines;
+
+    // Set on the windows lexed for an index owned by a token_cache, and handed down like m_spans
+    mutable ref_ptr<const tu_generation> m_generation;
+    mutable unsigned int m_generation_value = 0;
+
+    // Set on the windows lexed for an index: its table, and the position in it of the first token of this window
+    mutable ref_ptr<const token_table> m_table;
+    mutable unsigned int m_table_position = 0;
+
+    // Spellings from clang_getTokenSpelling(), for tokens that are not spelled in a file buffer.
+    // Filled on first use.
+    mutable std::vector<std::string> m_fallback_spellings;
+
+    void fill_fallback_spellings() const {
+        m_fallback_spellings.reserve(size());
+        for (unsigned int i = 0; i < size(); ++i) {
+            CXString spelling = clang_getTokenSpelling(m_tu, m_tokens[i]);
+            const char* str = clang_getCString(spelling);
+            m_fallback_spellings.emplace_back(str ? str : "");
+            clang_disposeString(spelling);
+        }
+    }
+
+    const line_table &lines() const {
+        if (!m_lines) m_lines = make_ref<const line_table>(m_buffer);
+        return *m_lines;
+    }
+
+    // For tokens that are not spelled in a file buffer
+    std::pair<unsigned int, unsigned int> spelling_line_column(unsigned int i) const {
+        unsigned int line = 0;
+        unsigned int column = 0;
+        clang_getSpellingLocation(clang_getRangeStart(clang_getTokenExtent(m_tu, m_tokens[i])), nullptr, &line, &column, nullptr);
+        return { line, column };
+    }
+
+public:
+    // Tokens starting at or past end_offset are lexed, but not exposed.
+    // (Some libclang versions return an extra token past the end of the requested range.)
+    // The libclang calls of the window are recorded with count.
+    token_window(CXTranslationUnit tu, CXToken* tokens, unsigned int num_tokens, bool bounded = false,
+                 unsigned int end_offset = std::numeric_limits<unsigned int>::max(),
+                 token_counter_hook count = &stats_instrumentation::count)
+    :m_tu{ tu }, m_tokens{ tokens }, m_num_tokens{ num_tokens }, m_bounded{ bounded }, m_count{ count }
+    {
+        if (auto pool = token_window_pool::local()) {
+            m_begin_offsets = pool->take_offsets();
+            m_end_offsets = pool->take_offsets();
+        }
+
+        m_begin_offsets.reserve(num_tokens);
+        m_end_offsets.reserve(num_tokens);
+
+        for (unsigned int i = 0; i < num_tokens; ++i) {
+            auto extent = clang_getTokenExtent(tu, tokens[i]);
+
+            unsigned int begin_offset = 0;
+            clang_getSpellingLocation(clang_getRangeStart(extent), m_begin_offsets.empty() ? &m_file : nullptr,
+                                      nullptr, nullptr, &begin_offset);
+            if (begin_offset >= end_offset) break;
+
+            m_begin_offsets.push_back(begin_offset);
+            m_end_offsets.push_back(spelling_offset(clang_getRangeEnd(extent)));
+        }
+        // One extent per token kept, and one for the token past end_offset if the loop stopped at it
+        m_count(token_counter::get_token_extent, std::min(num_tokens, size() + 1));
+
+        if (m_file) {
+            std::size_t file_size = 0;
+            const char* file_buffer = clang_getFileContents(tu, m_file, &file_size);
+            m_buffer = std::string_view{ file_buffer, file_buffer ? file_size : 0 };
+        }
+    }
+
+    ~token_window() {
+        if (m_tokens) {
+            clang_disposeTokens(m_tu, m_tokens, m_num_tokens);
+            m_count(token_counter::dispose_tokens, 1);
+        }
+
+        if (auto pool = token_window_pool::local()) {
+            pool->give_back(std::move(m_begin_offsets));
+            pool->give_back(std::move(m_end_offsets));
+        }
+    }
+
+    static void* operator new(std::size_t size) {
+        assert(size == sizeof(token_window));
+        auto pool = token_window_pool::local();
+        return pool ? pool->allocate(size) : ::operator new(size);
+    }
+
+    static void operator delete(void* block) noexcept {
+        auto pool = token_window_pool::local();
+        if (pool) {
+            pool->deallocate(block);
+        }
+        else {
+            ::operator delete(block);
+        }
+    }
+
+    CXTranslationUnit tu() const noexcept { return m_tu; }
+    CXFile file() const noexcept { return m_file; }
+    unsigned int size() const noexcept { return static_cast<unsigned int>(m_begin_offsets.size()); }
+    bool bounded() const noexcept { return m_bounded; }
+
+    const CXToken &operator[](unsigned int i) const noexcept {
+        assert(i < size());
+        return m_tokens[i];
+    }
+
+    unsigned int begin_offset(unsigned int i) const noexcept {
+        assert(i < size());
+        return m_begin_offsets[i];
+    }
+
+    unsigned int end_offset(unsigned int i) const noexcept {
+        assert(i < size());
+        return m_end_offsets[i];
+    }
+
+    // Sorted end offsets of every token
+    const std::vector<unsigned int> &end_offsets() const noexcept { return m_end_offsets; }
+
+    // Contents of file(), empty if the tokens are not spelled in a file
+    std::string_view buffer() const noexcept { return m_buffer; }
+
+    // Valid for as long as the TU, or as this window if buffer() is empty
+    std::string_view spelling(unsigned int i) const {
+        assert(i < size());
+        if (m_buffer.empty()) {
+            if (m_fallback_spellings.empty()) fill_fallback_spellings();
+            return m_fallback_spellings[i];
+        }
+
+        assert(m_end_offsets[i] <= m_buffer.size());
+        return m_buffer.substr(m_begin_offsets[i], m_end_offsets[i] - m_begin_offsets[i]);
+    }
+
+    token_view view(unsigned int i) const {
+        return token_view{ clang_getTokenKind((*this)[i]), m_file, begin_offset(i), end_offset(i), spelling(i) };
+    }
+
+    // Comments and literals of the file, if known
+    const ref_ptr<const lexical_spans> &spans() const noexcept { return m_spans; }
+    void set_spans(ref_ptr<const lexical_spans> spans) const noexcept { m_spans = std::move(spans); }
+
+    // Hands the tables of this file that were built for previous on to this window
+    void inherit(const token_window &previous) const noexcept {
+        assert(previous.m_file == m_file);
+        m_spans = previous.m_spans;
+        m_lines = previous.m_lines;
+        m_generation = previous.m_generation;
+        m_generation_value = previous.m_generation_value;
+    }
+
+    // Lexes the tokens [first, last) of table, the table of an index of file, into a window that is not bounded
+    // (walking past its last token lexes on). The tokens must still be those of the table.
+    static ref_ptr<const token_window> lex(CXTranslationUnit tu, CXFile file, ref_ptr<const token_table> table,
+                                           unsigned int first, unsigned int last,
+                                           token_counter_hook count = &stats_instrumentation::count) {
+        assert(table);
+        assert(first < last && last <= table->size());
+        const auto begin = table->begin_offsets()[first];
+        const auto end = table->end_offsets()[last - 1];
+        auto range = clang_getRange(clang_getLocationForOffset(tu, file, begin), clang_getLocationForOffset(tu, file, end));
+        count(token_counter::location_for_offset, 2);
+
+        CXToken* tokens = nullptr;
+        unsigned int num_tokens = 0;
+        clang_tokenize(tu, range, &tokens, &num_tokens);
+        count(token_counter::tokenize, 1);
+
+        auto window = make_ref<const token_window>(tu, tokens, num_tokens, false, end, count);
+        assert(window->size() == last - first);
+        window->set_origin(std::move(table), first);
+        return window;
+    }
+
+    // Marks the tokens of this window as the tokens [position, position + size()) of the table of an index
+    void set_origin(ref_ptr<const token_table> table, unsigned int position) const noexcept {
+        m_table = std::move(table);
+        m_table_position = position;
+    }
+
+    // Marks the tokens of this window as lexed at generation of their TU (see tu_generation)
+    void set_generation(ref_ptr<const tu_generation> generation, unsigned int value) const noexcept {
+        m_generation = std::move(generation);
+        m_generation_value = value;
+    }
+
+    // The table of the index this window was lexed for, or nullptr
+    const ref_ptr<const token_table> &table() const noexcept { return m_table; }
+    unsigned int table_position() const noexcept { return m_table_position; }
+
+    // True if the TU was reparsed after the index this window was lexed for was built,
+    // so that its CXTokens no longer exist. Only windows lexed for an index owned by a token_cache can tell.
+    bool stale() const noexcept {
+        return m_generation && m_generation->value() != m_generation_value;
+    }
+
+    // 1-based, of the first character of token i. Answered from the line table of the file buffer, built on first use.
+    unsigned int line(unsigned int i) const {
+        if (m_buffer.empty()) return spelling_line_column(i).first;
+        return lines().line(begin_offset(i));
+    }
+
+    unsigned int column(unsigned int i) const {
+        if (m_buffer.empty()) return spelling_line_column(i).second;
+        return lines().column(begin_offset(i));
+    }
+
+    // Approximate number of bytes owned by this window
+    std::size_t memory_usage() const noexcept {
+        std::size_t bytes = sizeof(*this) + m_num_tokens * sizeof(CXToken) +
+                            (m_begin_offsets.capacity() + m_end_offsets.capacity()) * sizeof(unsigned int);
+        for (const auto &spelling : m_fallback_spellings) {
+            bytes += sizeof(spelling) + spelling.capacity();
+        }
+        return bytes;
+    }
+
+    // Of a window of num_tokens tokens of a file, before it is lexed
+    static std::size_t estimated_memory_usage(unsigned int num_tokens) noexcept {
+        return sizeof(token_window) + std::size_t{ num_tokens } * (sizeof(CXToken) + 2 * sizeof(unsigned int));
+    }
+};
+
+inline void token_table::append(const token_window &window, unsigned int first) {
+    append(window, first, window.size());
+}
+
+inline void token_table::append(const token_window &window, unsigned int first, unsigned int last) {
+    assert(last <= window.size());
+    for (unsigned int i = first; i < last; ++i) {
+        push_back(window.begin_offset(i), window.end_offset(i), gsl::narrow_cast<std::uint8_t>(clang_getTokenKind(window[i])));
+    }
+}
+
+
+// Every token of a single file, lexed by one clang_tokenize() call.
+// Alongside the CXTokens, a compact {kind, begin offset, end offset} record is kept for each token
+// (see token_table) so that lookups and comparisons never go back to libclang.
+// 
+// After the TU is reparsed, update() builds the index of the new contents by lexing only the tokens around the edit.
+// The CXTokens of the new index are lexed again on first use, since a reparse invalidates every CXToken.
+class file_token_index : public ref_counted {
+    CXTranslationUnit m_tu;
+    CXFile m_file;
+    std::string_view m_buffer;
+    ref_ptr<const token_table> m_table;
+
+    // Lexed on first use by an index built by update()
+    mutable ref_ptr<const token_window> m_tokens;
+
+    // Built on first use of lines()
+    mutable ref_ptr<const line_table> m_lines;
+
+    // Set when the index is owned by a token_cache
+    ref_ptr<tu_generation> m_generation;
+    unsigned int m_generation_value = 0;
+
+    // Tokens that can be affected by an edit before them, because the lexer looked ahead into it (e.g. "." "." -> "...")
+    static constexpr unsigned int lookahead_tokens = 2;
+    static constexpr unsigned int relex_bytes = 4 * 1024;
+
+    // Tokens starting within [begin, end) of file, in a bounded window
+    static ref_ptr<const token_window> lex(CXTranslationUnit tu, CXFile file, unsigned int begin, unsigned int end) {
+        auto range = clang_getRange(clang_getLocationForOffset(tu, file, begin), clang_getLocationForOffset(tu, file, end));
+        stats_instrumentation::count(token_counter::location_for_offset, 2);
+
+        CXToken* tokens = nullptr;
+        unsigned int num_tokens = 0;
+        clang_tokenize(tu, range, &tokens, &num_tokens);
+        stats_instrumentation::count(token_counter::tokenize);
+        return make_ref<const token_window>(tu, tokens, num_tokens, true, end);
+    }
+
+    // Files smaller than this are not worth splitting
+    static constexpr unsigned int parallel_chunk_bytes = 1024 * 1024;
+    // More chunks than workers, so that the work stealing evens out chunks that lex slower
+    static constexpr std::size_t chunks_per_worker = 4;
+
+    static ref_ptr<const token_table> lex_parallel(gsl::not_null<CXTranslationUnit> tu, CXFile file,
+                                                   gsl::span<const CXTranslationUnit> replicas);
+
+    void attach(ref_ptr<tu_generation> generation) noexcept {
+        m_generation = std::move(generation);
+        m_generation_value = m_generation ? m_generation->value() : 0;
+    }
+
+    // Records where the tokens of window come from, so that iterators over it can tell when they are stale
+    // and move on through the table
+    void stamp(const token_window &window, unsigned int position) const noexcept {
+        window.set_origin(m_table, position);
+        window.set_generation(ref_ptr<const tu_generation>{ m_generation.get() }, m_generation_value);
+    }
+
+    void fetch_buffer() {
+        std::size_t file_size = 0;
+        const char* file_buffer = clang_getFileContents(m_tu, m_file, &file_size);
+        assert(file_buffer);
+        m_buffer = std::string_view{ file_buffer, file_size };
+    }
+
+    // Splices the new tokens around edit into old_table
+    void splice(const token_table &old_table, const text_edit &edit) {
+        const auto old_begins = old_table.begin_offsets();
+        const auto old_ends = old_table.end_offsets();
+        const auto old_size = old_table.size();
+        const auto delta = static_cast<std::ptrdiff_t>(edit.inserted) - static_cast<std::ptrdiff_t>(edit.removed);
+
+        // Start lexing from a token before the edit (and never from within a comment)
+        auto first_touched = static_cast<unsigned int>(std::lower_bound(old_ends.begin(), old_ends.end(), edit.offset) - old_ends.begin());
+        unsigned int keep = (first_touched > lookahead_tokens) ? first_touched - lookahead_tokens : 0;
+        unsigned int relex_begin = (keep < old_size) ? old_begins[keep] : 0;
+        if (relex_begin > edit.offset) {
+            keep = 0;
+            relex_begin = 0;
+        }
+
+        // Lex the kept token before as well, and leave it out: the kind of a token depends on the one before it
+        // (an identifier after "@" is an Objective-C keyword)
+        const unsigned int context = (keep > 0) ? 1 : 0;
+        const auto lex_begin = context ? old_begins[keep - 1] : relex_begin;
+
+        // The old tokens after the edit are candidates to resume from
+        auto first_after = static_cast<unsigned int>(std::lower_bound(old_begins.begin(), old_begins.end(), edit.offset + edit.removed) - old_begins.begin());
+        const auto inserted_end = edit.offset + edit.inserted;
+        const auto file_size = gsl::narrow<unsigned int>(m_buffer.size());
+
+        auto table = make_ref<token_table>();
+        for (unsigned int length = relex_bytes; ; length *= 2) {
+            auto relex_end = gsl::narrow<unsigned int>(std::min<std::size_t>(std::size_t{ inserted_end } + length, file_size));
+            auto window = lex(m_tu, m_file, lex_begin, relex_end);
+            assert(window->size() >= context);
+
+            // Raw lexing restarts from scratch at every token, so once a new token begins where a shifted old one did,
+            // everything after it is lexed exactly like before. The kind of that first token comes from the new lex
+            // too, as the token before it may have changed.
+            for (unsigned int i = context; i < window->size(); ++i) {
+                auto begin = window->begin_offset(i);
+                if (begin < inserted_end) continue;
+
+                auto old_begin = static_cast<std::ptrdiff_t>(begin) - delta;
+                auto found = std::lower_bound(old_begins.begin() + first_after, old_begins.end(), old_begin);
+                if (found == old_begins.end() || static_cast<std::ptrdiff_t>(*found) != old_begin) continue;
+
+                auto resume = static_cast<unsigned int>(found - old_begins.begin());
+                table->reserve(keep + (i + 1 - context) + (old_size - resume - 1));
+                table->append(old_table, 0, keep);
+                table->append(*window, context, i + 1);
+                table->append(old_table, resume + 1, old_size, delta);
+                m_table = std::move(table);
+                return;
+            }
+
+            if (relex_end == file_size) {
+                // Never caught up. Every token from relex_begin on is new.
+                table->reserve(keep + window->size() - context);
+                table->append(old_table, 0, keep);
+                table->append(*window, context);
+                m_table = std::move(table);
+                return;
+            }
+        }
+    }
+
+public:
+    file_token_index(gsl::not_null<CXTranslationUnit> tu, CXFile file, ref_ptr<tu_generation> generation = {})
+    :m_tu{ tu }, m_file{ file }
+    {
+        assert(file);
+        fetch_buffer();
+        attach(std::move(generation));
+
+        m_tokens = lex(tu, file, 0, gsl::narrow<unsigned int>(m_buffer.size()));
+        assert(std::is_sorted(m_tokens->end_offsets().begin(), m_tokens->end_offsets().end()));
+
+        auto table = make_ref<token_table>();
+        table->reserve(m_tokens->size());
+        table->append(*m_tokens);
+        m_table = std::move(table);
+        stamp(*m_tokens, 0);
+    }
+
+    // Lexes the file in chunks on 1 + replicas.size() threads, with the same tokens as a single clang_tokenize().
+    // replicas are other TUs parsed from the same sources with the same arguments as tu, since a TU can only
+    // be used by one thread at a time. Each one must have been parsed in a CXIndex of its own, not tu's or
+    // another replica's, and is only used on its own thread, and not after this returns.
+    // Replicas whose copy of the file is missing or differs are not used.
+    //
+    // Only the token table is lexed in parallel. The CXTokens are still lexed serially, by one clang_tokenize()
+    // of the whole file on the calling thread, the first time they are used (as for a stored index).
+    // So this only pays off when the replicas already exist (parsing them costs far more than lexing the file),
+    // and only for consumers of the table alone, like token_view_iterator and the kind filter of filtered_token_iterator.
+    // A token_iterator over the index, like operator[], still lexes its CXTokens on the calling thread,
+    // and gets no speed-up.
+    file_token_index(gsl::not_null<CXTranslationUnit> tu, CXFile file, gsl::span<const CXTranslationUnit> replicas,
+                     ref_ptr<tu_generation> generation = {})
+    :file_token_index{ tu, file, lex_parallel(tu, file, replicas), std::move(generation) }
+    {}
+
+    // An index over a table loaded by token_index_store. The CXTokens are lexed on first use.
+    file_token_index(gsl::not_null<CXTranslationUnit> tu, CXFile file, ref_ptr<const token_table> table,
+                     ref_ptr<tu_generation> generation = {})
+    :m_tu{ tu }, m_file{ file }, m_table{ std::move(table) }
+    {
+        assert(file);
+        assert(m_table);
+        fetch_buffer();
+        attach(std::move(generation));
+    }
+
+    // The index of old's file after the TU was reparsed, with edit applied to the file, or unchanged if edit is nullptr
+    file_token_index(const file_token_index &old, const text_edit* edit, ref_ptr<tu_generation> generation = {})
+    :m_tu{ old.m_tu }, m_file{ old.m_file }
+    {
+        fetch_buffer();
+        attach(std::move(generation));
+
+        if (edit) {
+            assert(edit->offset + edit->inserted <= m_buffer.size());
+            splice(*old.m_table, *edit);
+        }
+        else {
+            assert(old.m_buffer.size() == m_buffer.size());
+            m_table = old.m_table;
+        }
+    }
+
+    // The index of the same file after the TU was reparsed, with edit applied to the file
+    ref_ptr<const file_token_index> update(const text_edit &edit, ref_ptr<tu_generation> generation = {}) const {
+        return make_ref<const file_token_index>(*this, &edit, std::move(generation));
+    }
+
+    CXTranslationUnit tu() const noexcept { return m_tu; }
+    CXFile file() const noexcept { return m_file; }
+    unsigned int size() const noexcept { return m_table->size(); }
+    std::string_view buffer() const noexcept { return m_buffer; }
+    const ref_ptr<const token_table> &table() const noexcept { return m_table; }
+
+    // True if the TU was reparsed after this index was built. Only indices owned by a token_cache can tell.
+    bool stale() const noexcept {
+        return m_generation && m_generation->value() != m_generation_value;
+    }
+
+    unsigned int generation() const noexcept { return m_generation_value; }
+    const tu_generation* generation_counter() const noexcept { return m_generation.get(); }
+
+    // Throws stale_token_error if stale()
+    void check_live() const {
+        if (stale()) throw stale_token_error{ "token index used after its TU was reparsed" };
+    }
+
+    // True once the CXTokens of every token are lexed, i.e. tokens() does not lex
+    bool has_tokens() const noexcept { return bool(m_tokens); }
+
+    // The CXTokens of the tokens [first, last), in a window of their own that walks on like a token_iterator's.
+    // Its libclang calls are recorded with count.
+    ref_ptr<const token_window> lex_tokens(unsigned int first, unsigned int last,
+                                           token_counter_hook count = &stats_instrumentation::count) const {
+        check_live();
+        auto window = token_window::lex(m_tu, m_file, m_table, first, last, count);
+        stamp(*window, first);
+        return window;
+    }
+
+    // Every CXToken of the file, lexed on first use if the index was loaded, updated or lexed in parallel.
+    // Prefer token_iterator for walks: it only lexes the tokens around it.
+    const ref_ptr<const token_window> &tokens() const {
+        check_live();
+        if (!m_tokens) {
+            m_tokens = lex(m_tu, m_file, 0, gsl::narrow<unsigned int>(m_buffer.size()));
+            assert(std::equal(m_tokens->end_offsets().begin(), m_tokens->end_offsets().end(),
+                              m_table->end_offsets().begin(), m_table->end_offsets().end()));
+            stamp(*m_tokens, 0);
+        }
+        return m_tokens;
+    }
+
+    const CXToken &operator[](unsigned int i) const {
+        return (*tokens())[i];
+    }
+
+    CXTokenKind kind(unsigned int i) const noexcept {
+        assert(i < size());
+        return static_cast<CXTokenKind>(m_table->kinds()[i]);
+    }
+
+    // The kind of every token, one byte each
+    gsl::span<const std::uint8_t> kinds() const noexcept { return m_table->kinds(); }
+
+    unsigned int begin_offset(unsigned int i) const noexcept {
+        assert(i < size());
+        return m_table->begin_offsets()[i];
+    }
+
+    unsigned int end_offset(unsigned int i) const noexcept {
+        assert(i < size());
+        return m_table->end_offsets()[i];
+    }
+
+    // The file buffer is released by a reparse, so this throws once stale() like anything that reads it
+    std::string_view spelling(unsigned int i) const {
+        check_live();
+        return m_buffer.substr(begin_offset(i), end_offset(i) - begin_offset(i));
+    }
+
+    token_view view(unsigned int i) const {
+        return token_view{ kind(i), m_file, begin_offset(i), end_offset(i), spelling(i) };
+    }
+
+    // Where each line of the file starts, scanned on first use
+    const line_table &lines() const {
+        check_live();
+        if (!m_lines) m_lines = make_ref<const line_table>(m_buffer);
+        return *m_lines;
+    }
+
+    // 1-based, of the first character of token i
+    unsigned int line(unsigned int i) const { return lines().line(begin_offset(i)); }
+    unsigned int column(unsigned int i) const { return lines().column(begin_offset(i)); }
+
+    // Returns the index of the token covering offset, or of the first token after offset
+    // if it falls in between tokens. Returns size() if there is no such token.
+    unsigned int find(unsigned int offset) const {
+        const auto end_offsets = m_table->end_offsets();
+        auto it = std::upper_bound(end_offsets.begin(), end_offsets.end(), offset);
+        return gsl::narrow<unsigned int>(std::distance(end_offsets.begin(), it));
+    }
+
+    // Approximate number of bytes owned by this index
+    std::size_t memory_usage() const noexcept {
+        return sizeof(*this) + m_table->memory_usage() + tokens_memory_usage() + lines_memory_usage();
+    }
+
+    // The parts built on first use, which are not there yet when the index is created
+    std::size_t tokens_memory_usage() const noexcept { return m_tokens ? m_tokens->memory_usage() : 0; }
+    std::size_t lines_memory_usage() const noexcept { return m_lines ? m_lines->memory_usage() : 0; }
+
+    // memory_usage() once tokens() and lines() are built, estimating those that are not built yet,
+    // so that a budget can be charged for them before they are
+    std::size_t projected_memory_usage() const noexcept {
+        return memory_usage() + (m_tokens ? 0 : token_window::estimated_memory_usage(size())) +
+               (m_lines ? 0 : line_table::estimated_memory_usage(m_buffer.size()));
+    }
+};
+
+// The macro expansions of a file, over the tokens of its file_token_index. For every token, the first token and
+// one past the last token of the outermost expansion that contains it are stored, so that both the extent of an
+// expansion and a step over all of it are O(1). Outside of expansions, that is the token alone.
+// 
+// Built once from the CXCursor_MacroExpansion cursors of the TU, which only exist if it was parsed with
+// CXTranslationUnit_DetailedPreprocessingRecord. Without them, no token is part of an expansion.
+class macro_expansion_map : public ref_counted {
+    ref_ptr<const file_token_index> m_index;
+    std::vector<unsigned int> m_first;
+    std::vector<unsigned int> m_past;
+    std::vector<bool> m_expanded;
+    unsigned int m_num_expansions = 0;
+
+    struct visit_state {
+        CXFile file;
+        std::vector<std::pair<unsigned int, unsigned int>> extents;
+    };
+
+    static CXChildVisitResult visit(CXCursor cursor, CXCursor, CXClientData data) {
+        if (clang_getCursorKind(cursor) == CXCursor_MacroExpansion) {
+            auto &state = *static_cast<visit_state*>(data);
+            auto extent = clang_getCursorExtent(cursor);
+
+            CXFile file = nullptr;
+            unsigned int begin_offset = 0;
+            clang_getSpellingLocation(clang_getRangeStart(extent), &file, nullptr, nullptr, &begin_offset);
+            if (file == state.file) {
+                state.extents.emplace_back(begin_offset, spelling_offset(clang_getRangeEnd(extent)));
+            }
+        }
+        // Macro expansions are children of the TU cursor only
+        return CXChildVisit_Continue;
+    }
+
+public:
+    macro_expansion_map(gsl::not_null<CXTranslationUnit> tu, ref_ptr<const file_token_index> index)
+    :m_index{ std::move(index) }
+    {
+        assert(m_index);
+        visit_state state{ m_index->file(), {} };
+        clang_visitChildren(clang_getTranslationUnitCursor(tu), &macro_expansion_map::visit, &state);
+
+        const auto size = m_index->size();
+        m_first.resize(size);
+        m_past.resize(size);
+        m_expanded.resize(size);
+        for (unsigned int i = 0; i < size; ++i) {
+            m_first[i] = i;
+            m_past[i] = i + 1;
+        }
+
+        // Expansions within the arguments of a macro are nested in its expansion. Keep the outermost.
+        std::sort(state.extents.begin(), state.extents.end(), [](const auto &lhs, const auto &rhs) {
+            return lhs.first != rhs.first ? lhs.first < rhs.first : lhs.second > rhs.second;
+        });
+
+        unsigned int covered = 0;
+        for (const auto &extent : state.extents) {
+            if (extent.first < covered) continue;
+            covered = extent.second;
+
+            auto first = m_index->find(extent.first);
+            auto past = m_index->find(extent.second - 1) + 1;
+            if (first >= past || first >= size) continue;
+            past = std::min(past, size);
+
+            ++m_num_expansions;
+            for (auto i = first; i < past; ++i) {
+                m_first[i] = first;
+                m_past[i] = past;
+                m_expanded[i] = true;
+            }
+        }
+    }
+
+    const ref_ptr<const file_token_index> &index() const noexcept { return m_index; }
+    unsigned int size() const noexcept { return static_cast<unsigned int>(m_first.size()); }
+    unsigned int num_expansions() const noexcept { return m_num_expansions; }
+
+    // The tokens [first(i), past(i)) of the expansion that contains token i
+    unsigned int first(unsigned int i) const noexcept { assert(i < size()); return m_first[i]; }
+    unsigned int past(unsigned int i) const noexcept { assert(i < size()); return m_past[i]; }
+    bool in_expansion(unsigned int i) const noexcept { assert(i < size()); return m_expanded[i]; }
+
+    // The expansion location of token i, as the extent of its expansion in the file
+    unsigned int expansion_begin_offset(unsigned int i) const noexcept {
+        return m_index->begin_offset(first(i));
+    }
+
+    unsigned int expansion_end_offset(unsigned int i) const noexcept {
+        return m_index->end_offset(past(i) - 1);
+    }
+
+    std::size_t memory_usage() const noexcept {
+        return sizeof(*this) + (m_first.capacity() + m_past.capacity()) * sizeof(unsigned int) + m_expanded.capacity() / 8;
+    }
+};
+
+// 64-bit FNV-1a
+constexpr std::uint64_t fnv1a(std::string_view bytes, std::uint64_t hash = 14695981039346656037ull) noexcept {
+    for (char c : bytes) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Token tables saved to disk, so that later runs can skip lexing files that did not change.
+// 
+// Each table is stored in directory as <hash>.tokidx, keyed by the hash of the contents of the file as returned by
+// clang_getFileContents(). A change to the file changes the hash, so stale tables are never loaded (only orphaned).
+// Token kinds depend on the language options, so salt should identify them (e.g. the compiler arguments).
+// 
+// Stored tables are a header followed by the begin offsets, end offsets and kinds arrays, in native byte order.
+// They are loaded with mmap() and used in place.
+// 
+// The store has no mutable state, so it can be shared between threads, and processes can share a directory.
+// Files are written atomically, and checked when loaded.
+class token_index_store {
+    static constexpr char magic[8] = { 'T', 'O', 'K', 'I', 'D', 'X', '\0', '\0' };
+    static constexpr std::uint32_t version = 1;
+    static constexpr std::uint32_t byte_order = 0x01020304;
+
+    struct header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::uint64_t content_hash;
+        std::uint64_t content_size;
+        std::uint32_t num_tokens;
+        std::uint32_t reserved;
+    };
+    static_assert(sizeof(header) == 40, "header must not be padded");
+    static_assert(sizeof(header) % alignof(unsigned int) == 0, "arrays must be aligned");
+
+    std::string m_directory;
+    std::uint64_t m_seed;
+
+    std::string path_of(std::uint64_t hash) const {
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string name(16, '0');
+        for (int i = 15; i >= 0; --i, hash >>= 4) {
+            name[i] = digits[hash & 0xF];
+        }
+        return m_directory + "/" + name + ".tokidx";
+    }
+
+    // Creates a file next to path that no other thread or process writes to, and opens it for writing.
+    // In the same directory, so that renaming it to path is atomic.
+    static std::FILE* create_temp(const std::string &path, std::string &temp_path) {
+#if TOKEN_ITERATOR_MMAP
+        temp_path = path + ".XXXXXX";
+        int fd = mkstemp(&temp_path[0]);
+        if (fd < 0) return nullptr;
+
+        // mkstemp() makes the file private to its owner
+        std::FILE* f = (fchmod(fd, 0644) == 0) ? fdopen(fd, "wb") : nullptr;
+        if (!f) {
+            ::close(fd);
+            std::remove(temp_path.c_str());
+        }
+        return f;
+#else
+        // The time and the thread tell processes and threads apart, and the counter the files of a thread.
+        // Opening with "x" fails rather than sharing a file if two names still clash.
+        static std::atomic<unsigned int> counter{ 0 };
+        auto salt = std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + "." +
+                    std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+        for (int attempt = 0; attempt < 16; ++attempt) {
+            temp_path = path + "." + salt + "." + std::to_string(counter++) + ".tmp";
+            if (std::FILE* f = std::fopen(temp_path.c_str(), "wbx")) return f;
+        }
+        return nullptr;
+#endif
+    }
+
+public:
+    // directory must exist
+    explicit token_index_store(std::string directory, std::string_view salt = {})
+    :m_directory{ std::move(directory) }, m_seed{ fnv1a(salt) }
+    {}
+
+    std::uint64_t hash(std::string_view contents) const noexcept {
+        return fnv1a(contents, m_seed);
+    }
+
+    // Returns the stored table for contents, or nullptr if there is none (or it is not usable)
+    ref_ptr<const token_table> load(std::string_view contents) const {
+        auto content_hash = hash(contents);
+        auto file = mapped_file::open(path_of(content_hash));
+        if (!file || file->size() < sizeof(header)) return {};
+
+        header h;
+        std::memcpy(&h, file->data(), sizeof(h));
+        if (std::memcmp(h.magic, magic, sizeof(magic)) != 0 || h.version != version || h.byte_order != byte_order ||
+            h.content_hash != content_hash || h.content_size != contents.size()) {
+            return {};
+        }
+
+        const std::size_t n = h.num_tokens;
+        if (file->size() != sizeof(header) + n * (2 * sizeof(unsigned int) + sizeof(std::uint8_t))) return {};
+
+        auto begins = reinterpret_cast<const unsigned int*>(file->data() + sizeof(header));
+        auto ends = begins + n;
+        auto kinds = reinterpret_cast<const std::uint8_t*>(ends + n);
+
+        // The table is trusted from here on, so a corrupt or foreign file must not get through.
+        // One pass over it is still much cheaper than lexing.
+        if (n > 0 && ends[n - 1] > contents.size()) return {};
+        for (std::size_t i = 0; i < n; ++i) {
+            if (begins[i] > ends[i] || kinds[i] > CXToken_Comment) return {};
+            if (i > 0 && (begins[i] < begins[i - 1] || ends[i] < ends[i - 1])) return {};
+        }
+
+        return make_ref<const token_table>(std::move(file), gsl::make_span(begins, n), gsl::make_span(ends, n),
+                                           gsl::make_span(kinds, n));
+    }
+
+    // Stores table as the tokens of contents. Returns false if the file could not be written.
+    bool save(std::string_view contents, const token_table &table) const {
+        header h{};
+        std::memcpy(h.magic, magic, sizeof(magic));
+        h.version = version;
+        h.byte_order = byte_order;
+        h.content_hash = hash(contents);
+        h.content_size = contents.size();
+        h.num_tokens = table.size();
+
+        // Written under a unique name and renamed into place, so readers never see a partial file
+        auto path = path_of(h.content_hash);
+        std::string temp_path;
+        std::FILE* f = create_temp(path, temp_path);
+        if (!f) return false;
+
+        auto write = [&](const void* data, std::size_t size) {
+            return size == 0 || std::fwrite(data, 1, size, f) == size;
+        };
+
+        bool ok = write(&h, sizeof(h)) &&
+                  write(table.begin_offsets().data(), table.size() * sizeof(unsigned int)) &&
+                  write(table.end_offsets().data(), table.size() * sizeof(unsigned int)) &&
+                  write(table.kinds().data(), table.size() * sizeof(std::uint8_t));
+        ok = (std::fclose(f) == 0) && ok;
+
+        if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+// Where a basic_token_iterator reads its tokens from (see token_policy)
+struct live_tokens {};
+struct table_tokens {};
+
+// The compile-time configuration of a basic_token_iterator:
+//
+// - Value: what dereferencing yields. CXToken reads the CXTokens of the index (lexed on first use if the index
+//   was loaded or updated). token_view reads only its token table, whether in memory or mapped from a
+//   token_index_store, and never calls into libclang. Live iterators yield CXTokens only.
+// - Forward: the direction of operator++. A backward iterator, such as reverse_token_iterator, starts at the last token.
+// - KindMask: the kinds that are stepped onto (see kind_bit()). Other tokens are skipped, by a vectorized scan
+//   of the kinds of a table, or one token at a time when live.
+// - Instrumentation: what is recorded of the steps, and of the libclang calls of live iterators, including those
+//   of the windows they lex (no_instrumentation or stats_instrumentation, or any type with their interface).
+// - Storage: table_tokens iterates over a file_token_index. live_tokens lexes the file with libclang as it goes,
+//   a window of tokens at a time, and searches the file buffer for the token before the first of a window.
+//
+// Each option only adds code to the iterators that use it: with every kind and no instrumentation,
+// a step over a table is an increment or a decrement.
+template <typename Value = CXToken, bool Forward = true, unsigned int KindMask = 0xFF,
+          typename Instrumentation = no_instrumentation, typename Storage = table_tokens>
+struct token_policy {
+    static_assert(std::is_same<Value, CXToken>::value || std::is_same<Value, token_view>::value,
+                  "Value must be CXToken or token_view");
+    static_assert(KindMask != 0 && KindMask <= 0xFF, "KindMask must select at least one CXTokenKind");
+    static_assert(std::is_same<Storage, table_tokens>::value || std::is_same<Storage, live_tokens>::value,
+                  "Storage must be table_tokens or live_tokens");
+    static_assert(std::is_same<Storage, table_tokens>::value || std::is_same<Value, CXToken>::value,
+                  "Live iterators yield CXTokens");
+
+    using value_type = Value;
+    static constexpr bool forward = Forward;
+    static constexpr unsigned int kind_mask = KindMask;
+    static constexpr bool filtered = (KindMask != 0xFF);
+    using instrumentation = Instrumentation;
+    using storage = Storage;
+};
+
+template <typename Policy, typename Storage = typename Policy::storage>
+class basic_token_iterator;
+
+// Random access iterator over the tokens of a file_token_index.
+// 
+// Unlike token_iterator, the end of the file is a past-the-end position of the index
+// (rather than a sentinel) so that std::distance(), std::advance(), std::lower_bound() etc. are O(1) per step.
+// Iterators over different indices may only be compared for equality.
+using indexed_token_iterator = basic_token_iterator<token_policy<>>;
+
+// Shares one file_token_index per (CXTranslationUnit, CXFile) between every iterator that asks for it,
+// so that each file is lexed at most once no matter how many cursors are visited.
+// 
+// Memory is bounded by max_bytes: once exceeded, the least recently used files are dropped from the cache,
+// to be lexed again the next time they are asked for. Iterators which still refer to a dropped index keep it alive
+// until they let go. memory_breakdown() tells where the bytes go.
+// 
+// With a token_index_store, a file is loaded from the store rather than lexed if it is there, and saved to it otherwise.
+// 
+// The cache does not notice when a TU changes. After clang_reparseTranslationUnit(), call update() with
+// the edits that were made, or invalidate(). Either way, the indices built before the reparse become stale()
+// and must not be dereferenced. indexed_token_iterators over them can be moved to the new index with revalidate().
+class token_cache {
+public:
+    // An edit made to one file of a TU
+    struct file_edit {
+        CXFile file;
+        text_edit edit;
+    };
+
+private:
+    using key = std::pair<CXTranslationUnit, CXFile>;
+
+    struct entry {
+        key k;
+        ref_ptr<const file_token_index> index;
+        std::size_t bytes;
+        // Built on first use, for the current index
+        ref_ptr<const macro_expansion_map> expansions;
+    };
+
+    struct tu_state {
+        ref_ptr<tu_generation> generation = make_ref<tu_generation>();
+
+        // The edits of each update(), oldest first. edits[i] made generation first_generation + i + 1.
+        std::deque<std::vector<file_edit>> edits;
+        unsigned int first_generation = 0;
+    };
+
+    // Enough to revalidate iterators across a burst of keystrokes
+    static constexpr std::size_t max_logged_updates = 256;
+
+    // An estimate of the links of a node of m_entries and one of m_lookup, whose sizes the standard library
+    // does not expose: two pointers for a list node, three pointers and a color for a map node.
+    static constexpr std::size_t estimated_node_links = 6 * sizeof(void*);
+
+    // Least recently used first
+    std::list<entry> m_entries;
+    std::map<key, std::list<entry>::iterator> m_lookup;
+    std::map<CXTranslationUnit, tu_state> m_tus;
+    std::size_t m_max_bytes;
+    std::size_t m_bytes = 0;
+    const token_index_store* m_store;
+
+    static ref_ptr<const file_token_index> lex_index(gsl::not_null<CXTranslationUnit> tu, CXFile file,
+                                                     gsl::span<const CXTranslationUnit> replicas,
+                                                     ref_ptr<tu_generation> generation) {
+        if (replicas.empty()) {
+            return make_ref<const file_token_index>(tu, file, std::move(generation));
+        }
+        return make_ref<const file_token_index>(tu, file, replicas, std::move(generation));
+    }
+
+    ref_ptr<const file_token_index> make_index(gsl::not_null<CXTranslationUnit> tu, CXFile file,
+                                               gsl::span<const CXTranslationUnit> replicas) {
+        auto generation = m_tus[tu.get()].generation;
+        if (!m_store) {
+            return lex_index(tu, file, replicas, std::move(generation));
+        }
+
+        std::size_t file_size = 0;
+        const char* file_buffer = clang_getFileContents(tu, file, &file_size);
+        assert(file_buffer);
+        std::string_view contents{ file_buffer, file_size };
+
+        if (auto table = m_store->load(contents)) {
+            return make_ref<const file_token_index>(tu, file, std::move(table), std::move(generation));
+        }
+
+        auto index = lex_index(tu, file, replicas, std::move(generation));
+        m_store->save(contents, *index->table());
+        return index;
+    }
+
+    // What the index builds on first use is charged up front, so that building it cannot overrun the budget
+    std::size_t entry_bytes(const entry &e) const noexcept {
+        return e.index->projected_memory_usage() + (e.expansions ? e.expansions->memory_usage() : 0);
+    }
+
+    // Marks the entry as the most recently used, and measures what was built in it since it was last used
+    void touch(std::list<entry>::iterator it) {
+        m_entries.splice(m_entries.end(), m_entries, it);
+
+        auto bytes = entry_bytes(*it);
+        m_bytes = m_bytes - it->bytes + bytes;
+        it->bytes = bytes;
+    }
+
+    void erase(std::list<entry>::iterator it) {
+        m_bytes -= it->bytes;
+        m_lookup.erase(it->k);
+        m_entries.erase(it);
+    }
+
+    // Least recently used files first. Always keeps the most recent one, even if it alone exceeds the budget.
+    void evict() {
+        while (m_bytes > m_max_bytes && m_entries.size() > 1) {
+            erase(m_entries.begin());
+        }
+    }
+
+public:
+    static constexpr std::size_t default_max_bytes = 256 * 1024 * 1024;
+
+    // store, if any, must outlive the cache
+    explicit token_cache(std::size_t max_bytes = default_max_bytes, const token_index_store* store = nullptr) noexcept
+    :m_max_bytes{ max_bytes }, m_store{ store }
+    {}
+
+    token_cache(const token_cache&) = delete;
+    token_cache &operator=(const token_cache&) = delete;
+
+    // Returns the index for file, lexing it on first use.
+    // With replicas of tu, a file that is not cached is lexed in parallel (see file_token_index). That only
+    // helps if the replicas are parsed anyway, and only consumers of the token table: the first token_iterator
+    // over the index still lexes its CXTokens serially.
+    ref_ptr<const file_token_index> get(gsl::not_null<CXTranslationUnit> tu, CXFile file,
+                                        gsl::span<const CXTranslationUnit> replicas = {}) {
+        assert(file);
+        key k{ tu.get(), file };
+
+        auto found = m_lookup.find(k);
+        if (found != m_lookup.end()) {
+            touch(found->second);
+            evict();
+            return found->second->index;
+        }
+
+        auto index = make_index(tu, file, replicas);
+        auto bytes = index->projected_memory_usage();
+        m_entries.push_back(entry{ k, index, bytes, {} });
+        m_lookup.emplace(k, std::prev(m_entries.end()));
+        m_bytes += bytes;
+        evict();
+
+        return index;
+    }
+
+    // Returns the index for the file that loc is spelled in
+    ref_ptr<const file_token_index> get(gsl::not_null<CXTranslationUnit> tu, const cursor_location &loc) {
+        CXFile file = nullptr;
+        clang_getSpellingLocation(loc.get(), &file, nullptr, nullptr, nullptr);
+        return get(tu, file);
+    }
+
+    // Returns the macro expansions of file, finding them on first use.
+    // The TU must have been parsed with CXTranslationUnit_DetailedPreprocessingRecord for there to be any.
+    ref_ptr<const macro_expansion_map> expansions(gsl::not_null<CXTranslationUnit> tu, CXFile file) {
+        auto index = get(tu, file);
+        auto &e = *m_lookup.find(key{ tu.get(), file })->second;
+        if (!e.expansions) {
+            e.expansions = make_ref<const macro_expansion_map>(tu, std::move(index));
+            auto bytes = e.expansions->memory_usage();
+            e.bytes += bytes;
+            m_bytes += bytes;
+        }
+
+        auto expansions = e.expansions;
+        evict();
+        return expansions;
+    }
+
+    // Brings the files of tu up to date after it was reparsed with edits (at most one per file).
+    // Edited files are lexed again around their edit only, and the other files keep their tokens as they are.
+    void update(gsl::not_null<CXTranslationUnit> tu, gsl::span<const file_edit> edits) {
+        auto &state = m_tus[tu.get()];
+        state.generation->bump();
+        state.edits.emplace_back(edits.begin(), edits.end());
+        if (state.edits.size() > max_logged_updates) {
+            state.edits.pop_front();
+            ++state.first_generation;
+        }
+
+        for (auto &e : m_entries) {
+            if (e.k.first != tu.get()) continue;
+
+            auto edit = std::find_if(edits.begin(), edits.end(), [&](const file_edit &fe) { return fe.file == e.k.second; });
+            e.index = make_ref<const file_token_index>(*e.index, (edit != edits.end()) ? &edit->edit : nullptr, state.generation);
+            // The preprocessing record changed with the reparse
+            e.expansions = ref_ptr<const macro_expansion_map>{};
+
+            m_bytes -= e.bytes;
+            e.bytes = entry_bytes(e);
+            m_bytes += e.bytes;
+        }
+        evict();
+    }
+
+    void update(gsl::not_null<CXTranslationUnit> tu, CXFile file, const text_edit &edit) {
+        file_edit fe{ file, edit };
+        update(tu, gsl::make_span(&fe, 1));
+    }
+
+    // Moves it from a stale index to the current index of the same file, following the edits since.
+    // A token that was edited maps to the first token after the edit.
+    // Returns false, leaving it unchanged, if that is not possible (e.g. the TU was invalidated).
+    bool revalidate(indexed_token_iterator &it);
+
+    // Drops every file of tu. Must be called when tu is disposed, or reparsed without update().
+    void invalidate(CXTranslationUnit tu) {
+        for (auto it = m_entries.begin(); it != m_entries.end(); ) {
+            auto next = std::next(it);
+            if (it->k.first == tu) erase(it);
+            it = next;
+        }
+
+        auto found = m_tus.find(tu);
+        if (found != m_tus.end()) {
+            found->second.generation->bump();
+            m_tus.erase(found);
+        }
+    }
+
+    void clear() noexcept {
+        m_entries.clear();
+        m_lookup.clear();
+        for (auto &tu : m_tus) {
+            tu.second.generation->bump();
+        }
+        m_tus.clear();
+        m_bytes = 0;
+    }
+
+    std::size_t max_bytes() const noexcept { return m_max_bytes; }
+
+    // Evicts the least recently used files until the cache fits
+    void set_max_bytes(std::size_t max_bytes) {
+        m_max_bytes = max_bytes;
+        evict();
+    }
+
+    // Bytes counted against the budget. What an index builds on first use (its CXTokens after an update(),
+    // its line table) is charged from an estimate until it is built, and measured from the next time it is looked up.
+    std::size_t memory_usage() const noexcept { return m_bytes; }
+
+    std::size_t num_files() const noexcept { return m_entries.size(); }
+
+    struct memory_stats {
+        std::size_t files = 0;
+        // Kinds and offsets of every token, including the mapped files of a token_index_store
+        std::size_t token_tables = 0;
+        // Lexed CXTokens, with their decoded offsets
+        std::size_t token_windows = 0;
+        std::size_t line_tables = 0;
+        std::size_t expansion_maps = 0;
+        // The index objects, the lookup structures of the cache and its edit logs.
+        // The links of the nodes of the lookup structures are estimated (see estimated_node_links).
+        std::size_t bookkeeping = 0;
+
+        std::size_t total() const noexcept {
+            return token_tables + token_windows + line_tables + expansion_maps + bookkeeping;
+        }
+    };
+
+    // Measured now, so unlike memory_usage() it counts only what is built, as built (apart from estimated_node_links)
+    memory_stats memory_breakdown() const noexcept {
+        memory_stats stats;
+        stats.files = m_entries.size();
+        for (const auto &e : m_entries) {
+            stats.token_tables += e.index->table()->memory_usage();
+            stats.token_windows += e.index->tokens_memory_usage();
+            stats.line_tables += e.index->lines_memory_usage();
+            stats.expansion_maps += e.expansions ? e.expansions->memory_usage() : 0;
+            stats.bookkeeping += sizeof(file_token_index) + sizeof(entry) + sizeof(*m_lookup.begin()) + estimated_node_links;
+        }
+        for (const auto &tu : m_tus) {
+            stats.bookkeeping += sizeof(tu) + sizeof(tu_generation);
+            for (const auto &edits : tu.second.edits) {
+                stats.bookkeeping += sizeof(edits) + edits.capacity() * sizeof(file_edit);
+            }
+        }
+        return stats;
+    }
+};
+
+class tu_token_iterator;
+
+class token_range;
+
+// The configuration of token_iterator
+using live_token_policy = token_policy<CXToken, true, 0xFF, stats_instrumentation, live_tokens>;
+
+// Walks the tokens of a file lexed by libclang as it goes, as configured by Policy (see token_policy).
+// Tokens are lexed window_bytes at a time, and shared by the copies of an iterator.
+// The end sentinel is the default constructed iterator, so that no end position has to be looked up.
+template <typename Policy>
+class basic_token_iterator<Policy, live_tokens> {
+    template <typename, typename> friend class basic_token_iterator;
+    friend class tu_token_iterator;
+    friend class token_range;
+
+    using instrumentation = typename Policy::instrumentation;
+
+    struct token_deleter {
+        CXTranslationUnit tu;
+
+        token_deleter() noexcept 
+        :tu{ nullptr }
+        {};
+
+        token_deleter(CXTranslationUnit t) noexcept
+        :tu{ t }
+        {}
+
+        void operator()(CXToken* tok) const {
+            if (tok) {
+                assert(tu);
+                clang_disposeTokens(tu, tok, 1);
+                instrumentation::count(token_counter::dispose_tokens);
+            }
+        }
+    };
+
+    using unique_token = std::unique_ptr<CXToken, token_deleter>;
+    using shared_window = ref_ptr<const token_window>;
+
+    // Number of bytes lexed by each clang_tokenize() call when walking forward.
+    static constexpr unsigned int window_bytes = 16 * 1024;
+
+    shared_window m_window;
+    unsigned int m_index = 0;
+
+    // Where the current token is spelled. Copied out of the window whenever the iterator moves,
+    // so that comparing and stepping never query libclang for locations.
+    // The end position doubles as the identity of the token.
+    CXFile m_file = nullptr;
+    unsigned int m_begin_offset = 0;
+    unsigned int m_end_offset = 0;
+
+    // A window that records its libclang calls with instrumentation
+    static shared_window make_window(CXTranslationUnit tu, CXToken* tokens, unsigned int num_tokens, bool bounded = false,
+                                     unsigned int end_offset = std::numeric_limits<unsigned int>::max()) {
+        return make_ref<const token_window>(tu, tokens, num_tokens, bounded, end_offset, &instrumentation::count);
+    }
+
+    // Lex the tokens starting at loc, window_bytes at a time.
+    // Returns nullptr if there are no more tokens.
+    static shared_window lex_window(CXTranslationUnit tu, CXSourceLocation loc) {
+        CXFile file = nullptr;
+        unsigned int offset = 0;
+        clang_getSpellingLocation(loc, &file, nullptr, nullptr, &offset);
+
+        std::size_t file_size = 0;
+        if (!file || !clang_getFileContents(tu, file, &file_size)) {
+            // No file buffer to size the window against. Fall back to a single token.
+            instrumentation::count(token_counter::get_token);
+            return wrap(tu, clang_getToken(tu, loc));
+        }
+        return lex_window(tu, file, offset, file_size);
+    }
+
+    static shared_window lex_window(CXTranslationUnit tu, CXFile file, unsigned int offset, std::size_t file_size) {
+        auto loc = clang_getLocationForOffset(tu, file, offset);
+        instrumentation::count(token_counter::location_for_offset);
+
+        // Keep growing the window until it contains at least one token (i.e. skip over large comment blocks)
+        for (std::size_t length = window_bytes; ; length *= 2) {
+            auto end_offset = gsl::narrow<unsigned int>(std::min<std::size_t>(offset + length, file_size));
+            auto range = clang_getRange(loc, clang_getLocationForOffset(tu, file, end_offset));
+            instrumentation::count(token_counter::location_for_offset);
+
+            CXToken* tokens = nullptr;
+            unsigned int num_tokens = 0;
+            clang_tokenize(tu, range, &tokens, &num_tokens);
+            instrumentation::count(token_counter::tokenize);
+
+            if (num_tokens > 0) {
+                return make_window(tu, tokens, num_tokens);
+            }
+            
+            clang_disposeTokens(tu, tokens, num_tokens);
+            instrumentation::count(token_counter::dispose_tokens);
+            if (end_offset >= file_size) return shared_window{};
+        }
+    }
+
+    // Lex exactly the tokens that start within range, into a bounded window.
+    // Returns nullptr if there are none.
+    static shared_window lex_range(CXTranslationUnit tu, CXSourceRange range) {
+        CXToken* tokens = nullptr;
+        unsigned int num_tokens = 0;
+        clang_tokenize(tu, range, &tokens, &num_tokens);
+        instrumentation::count(token_counter::tokenize);
+
+        auto end_offset = spelling_offset(clang_getRangeEnd(range));
+        auto window = make_window(tu, tokens, num_tokens, true, end_offset);
+        if (window->size() == 0) return shared_window{};
+        return window;
+    }
+
+    // Take ownership of a single token returned by clang_getToken()
+    static shared_window wrap(CXTranslationUnit tu, CXToken* tok) {
+        if (!tok) return shared_window{};
+        return make_window(tu, tok, 1u);
+    }
+
+    CXTranslationUnit tu() const {
+        assert(m_window);
+        return m_window->tu();
+    }
+
+    const CXToken &current() const {
+        assert(m_window);
+        check_live();
+        return (*m_window)[m_index];
+    }
+
+    // Throws stale_token_error if the window was lexed for an index that went stale (see token_window::stale())
+    void check_live() const {
+        if (m_window && m_window->stale()) throw stale_token_error{ "token_iterator used after its TU was reparsed" };
+    }
+
+    // One past the last token of begins (the begin offsets of a table) that starts within window_bytes of token first
+    static unsigned int table_window_end(gsl::span<const unsigned int> begins, unsigned int first) {
+        const auto limit = std::size_t{ begins[first] } + window_bytes;
+        return static_cast<unsigned int>(std::lower_bound(begins.begin() + first + 1, begins.end(), limit) - begins.begin());
+    }
+
+    // For windows lexed for an index: the tokens of its table that start within window_bytes after (or before)
+    // those of window, lexed straight from the table. Returns nullptr at the end (or beginning) of the file.
+    static shared_window lex_next(const token_window &window) {
+        const auto &table = *window.table();
+        const auto first = window.table_position() + window.size();
+        if (first >= table.size()) return shared_window{};
+
+        auto last = table_window_end(table.begin_offsets(), first);
+        auto next = token_window::lex(window.tu(), window.file(), window.table(), first, last, &instrumentation::count);
+        next->inherit(window);
+        return next;
+    }
+
+    static shared_window lex_previous(const token_window &window) {
+        const auto last = window.table_position();
+        if (last == 0) return shared_window{};
+
+        const auto begins = window.table()->begin_offsets();
+        const auto limit = (begins[last - 1] > window_bytes) ? begins[last - 1] - window_bytes : 0;
+        auto first = std::lower_bound(begins.begin(), begins.begin() + (last - 1), limit) - begins.begin();
+
+        auto previous = token_window::lex(window.tu(), window.file(), window.table(), static_cast<unsigned int>(first), last,
+                                          &instrumentation::count);
+        previous->inherit(window);
+        return previous;
+    }
+
+    // Steps onto the last token that begins at or before offset, lexing from begin (where a token is known to start)
+    // up to the current token. Returns false, leaving the iterator unchanged, if there is no such token.
+    bool lex_from(CXFile file, unsigned int begin, unsigned int offset) {
+        auto range = clang_getRange(clang_getLocationForOffset(tu(), file, begin),
+                                    clang_getLocationForOffset(tu(), file, m_begin_offset));
+        instrumentation::count(token_counter::location_for_offset);
+        instrumentation::count(token_counter::location_for_offset);
+
+        CXToken* tokens = nullptr;
+        unsigned int num_tokens = 0;
+        clang_tokenize(tu(), range, &tokens, &num_tokens);
+        instrumentation::count(token_counter::tokenize);
+
+        // Unbounded: the tokens from the current one on, if lexed too, are where operator++ goes next anyway
+        auto window = make_window(tu(), tokens, num_tokens);
+        auto i = window->size();
+        while (i > 0 && window->begin_offset(i - 1) > offset) --i;
+        if (i == 0 || window->end_offset(i - 1) > m_begin_offset) return false;
+
+        window->inherit(*m_window);
+        m_window = std::move(window);
+        m_index = i - 1;
+        land();
+        return true;
+    }
+
+    // Must be called whenever the iterator moves to a new token
+    void land() noexcept {
+        if (m_window) {
+            m_file = m_window->file();
+            m_begin_offset = m_window->begin_offset(m_index);
+            m_end_offset = m_window->end_offset(m_index);
+        }
+    }
+
+    basic_token_iterator(shared_window window, unsigned int index) noexcept
+    :m_window{ std::move(window) }, m_index{ index }
+    {
+        land();
+    }
+
+    // Position at the pos-th token of index. Unless index has every CXToken already, only lexes window_bytes of them.
+    void land(const file_token_index &index, unsigned int pos) {
+        assert(pos < index.size());
+        if (index.has_tokens()) {
+            m_window = index.tokens();
+            m_index = pos;
+        }
+        else {
+            m_window = index.lex_tokens(pos, table_window_end(index.table()->begin_offsets(), pos), &instrumentation::count);
+            m_index = 0;
+        }
+        land();
+    }
+
+    // The token after this one, or the end sentinel
+    void step_forward() {
+        assert(m_window);
+        check_live();
+        if (++m_index < m_window->size()) {
+            // Fast path. Still inside the current window.
+            land();
+            return;
+        }
+
+        if (m_window->table()) {
+            // Lexed for an index, which knows where the next tokens are
+            auto next = lex_next(*m_window);
+            if (!next) {
+                *this = basic_token_iterator{};
+                return;
+            }
+            m_window = std::move(next);
+            m_index = 0;
+            land();
+            return;
+        }
+
+        if (m_window->bounded()) {
+            // Past the end of the range of interest
+            *this = basic_token_iterator{};
+            return;
+        }
+
+        // Window exhausted. Lex the next one, starting from where the last token left off.
+        assert(m_file);
+        std::size_t file_size = 0;
+        clang_getFileContents(tu(), m_file, &file_size);
+
+        auto previous = m_window;
+        m_window = lex_window(tu(), m_file, m_end_offset, file_size);
+        if (m_window) m_window->inherit(*previous);
+        m_index = 0;
+        land();
+    }
+
+    // The token before this one, or the end sentinel. Searches the file buffer for it when it is not in the window.
+    void step_backward() {
+        assert(m_window);
+        check_live();
+
+        if (m_index > 0) {
+            // Fast path. The previous token is in the current window.
+            --m_index;
+            land();
+            return;
+        }
+
+        if (m_window->table()) {
+            // Lexed for an index, which knows where the previous tokens are. No search needed.
+            auto previous = lex_previous(*m_window);
+            if (!previous) {
+                *this = basic_token_iterator{};
+                return;
+            }
+            m_index = previous->size() - 1;
+            m_window = std::move(previous);
+            land();
+            return;
+        }
+
+        // Retrieve file handle and current offset
+        CXFile file = m_file;
+        unsigned int offset = m_begin_offset;
+        assert(file);
+        instrumentation::count(token_counter::backward_searches);
+
+        // Probes are compared against the current end location
+        const auto curr_end = clang_getLocationForOffset(tu(), file, m_end_offset);
+        instrumentation::count(token_counter::location_for_offset);
+
+        // Retrieve file buffer that we can offset into
+        std::size_t file_size = 0;
+        const char* file_buffer = clang_getFileContents(tu(), file, &file_size);
+        assert(file_buffer);
+        assert(offset < file_size);
+
+        auto search_span = gsl::make_span(file_buffer, file_size);
+
+        // Comments and literals of this file, scanned once and shared by every window after this one
+        auto spans = m_window->spans();
+        if (!spans) {
+            spans = make_ref<const lexical_spans>(search_span);
+            m_window->set_spans(spans);
+        }
+
+        // Step 1: Decrement offset until the lexer binds the end to a different position.
+        // That's when we know a new token has been found!
+        unique_token candidate_tok{ nullptr, tu() };
+        CXSourceLocation candidate_end;
+        bool found_begin = false;
+
+        // Lexes the token at the given offset into candidate_tok. Returns false if there is none.
+        auto probe = [&](unsigned int at) {
+            candidate_tok.reset(clang_getToken(tu(), clang_getLocationForOffset(tu(), file, at)));
+            instrumentation::count(token_counter::location_for_offset);
+            instrumentation::count(token_counter::get_token);
+            instrumentation::count(token_counter::probes);
+            if (!candidate_tok) return false;
+
+            candidate_end = clang_getRangeEnd(clang_getTokenExtent(tu(), *candidate_tok));
+            instrumentation::count(token_counter::get_token_extent);
+            return true;
+        };
+
+        while (true) {
+            // Fast path. Skip runs of whitespace in bulk.
+            auto next_offset = find_last_not_space(search_span.first(offset));
+            if (next_offset == not_found) {
+                // Nothing but whitespace, and comments that were not returned as tokens, before this token
+                *this = basic_token_iterator{};
+                return;
+            }
+            offset = gsl::narrow_cast<unsigned int>(next_offset);
+
+            if (auto line = spans->spliced_line(offset)) {
+                // Line splices join characters into tokens that no probe from inside the line finds
+                if (lex_from(file, line->begin, offset)) return;
+            }
+
+            if (auto span = spans->find(offset)) {
+                // Never lex from the middle of a comment, a literal or a number: they are lexed from their
+                // first character. libclang returns comments as CXToken_Comment tokens, which operator++ steps onto,
+                // so a comment is the previous token too. If it does not come back as a token, the probe fails
+                // and the search goes on before the comment.
+                offset = span->begin;
+                found_begin = true;
+            }
+            else if (lexical_spans::is_punctuator_char(search_span[offset])) {
+                // A run of punctuators does not lex alike from each of its characters ("<<<" is "<<" "<", but "<<"
+                // from its second character), so probing inside one can find a token that is not there.
+                // Lex the run from its first character instead.
+                // A punctuator on its own is a token of one character.
+                auto run_begin = spans->punctuator_run_begin(search_span, offset);
+                if (run_begin < offset && lex_from(file, run_begin, offset)) return;
+                found_begin = (run_begin == offset);
+            }
+            else if (lexical_spans::is_identifier_char(search_span[offset])) {
+                // The tail of an identifier can lex as a token of its own, a number even ("2.size" from the "2"
+                // of "v2.size"), so probe from the first character of the run. It is the previous token if it
+                // reaches offset (not every byte from 0x80 is part of an identifier).
+                // Right after a literal, it may be the literal's user-defined suffix, or only partly ("_x" of
+                // "abc"_x$y), or not at all ("x" of 'a'x), which clang decides: lex from the literal instead.
+                auto run_begin = spans->identifier_run_begin(search_span, offset);
+                const auto literal = spans->literal_ending_at(run_begin);
+                if (literal && lex_from(file, literal->begin, offset)) return;
+
+                if (!literal && run_begin < offset && probe(run_begin) && spelling_offset(candidate_end) > offset &&
+                    !clang_equalLocations(candidate_end, curr_end)) {
+                    offset = run_begin;
+                    found_begin = true;
+                    break;
+                }
+                found_begin = !literal && run_begin == offset;
+            }
+            else if (search_span[offset] != '\\') {
+                // Any other character is a token of its own. A backslash can begin a universal character name.
+                found_begin = true;
+            }
+
+            if (probe(offset) && !clang_equalLocations(candidate_end, curr_end)) {
+                break;
+            }
+
+            // In most (all?) cases, this branch will only be evaluated once
+            // before a valid candidate is found.
+            found_begin = false;
+        }
+
+        // Step 2: Ok, now to find the beginning of this token        
+        search_span = search_span.first(offset);
+        // Note that we dropped the offset-th character because we already know for sure it sits within
+        // the bounds of the candidate token
+
+        // Reduce the number of CXTokens created (and all the associated overhead) by performing binary search
+        // First, identify the bounds of the string (non-whitespace characters)
+        auto last_space = find_last_space(search_span);
+        auto str_length = (last_space == not_found) ? search_span.size() : search_span.size() - last_space - 1;
+
+        // Helper. Returns false if the given pos goes past the candidate token
+        // Returns true if it's within the candidate token bounds, and replace the candidate token with
+        // the CXToken from this pos.
+        auto consider_next_candidate = [&](const char* pos) {
+            auto offset = gsl::narrow<unsigned int>(pos - file_buffer);
+            auto next_candidate_loc = clang_getLocationForOffset(tu(), file, offset);
+
+            unique_token next_candidate_tok{ clang_getToken(tu(), next_candidate_loc), tu() };
+            instrumentation::count(token_counter::location_for_offset);
+            instrumentation::count(token_counter::get_token);
+            instrumentation::count(token_counter::probes);
+            if (next_candidate_tok) {
+                auto next_candidate_end = clang_getRangeEnd(clang_getTokenExtent(tu(), *next_candidate_tok));
+                instrumentation::count(token_counter::get_token_extent);
+
+                if (!clang_equalLocations(next_candidate_end, candidate_end)) {
+                    return false;
+                }
+
+                candidate_tok = std::move(next_candidate_tok);
+                return true;
+            }
+
+            return false;
+        };
+
+        // The token cannot start inside a comment, literal or number that precedes it.
+        // The one exception is a string/character literal with a user-defined suffix, which is a single token.
+        // (A number swallows its suffix, so it never ends right before one.)
+        if (auto span = found_begin ? nullptr : spans->last_before(offset)) {
+            if (span->end > offset - str_length) {
+                str_length = offset - span->end;
+            }
+            if (span->kind == lexical_spans::literal && span->end == offset - str_length &&
+                consider_next_candidate(file_buffer + span->begin)) {
+                found_begin = true;
+            }
+        }
+
+        search_span = search_span.last(found_begin ? 0 : str_length);
+
+        if (!search_span.empty()) {
+            // We would love to use std::lower_bound, but we want to avoid unnecessary (re)-allocations
+            // Caching is an option, but inelegant
+            // You can't deny a span-based implementation is not nice too!
+
+            if (consider_next_candidate(search_span.data())) {
+                // Heuristic - consider the first character of the string first
+                // Nothing to do - consider_next_candidate() has side effects.
+            }
+            else {
+                // The run holds more than this token (e.g. "a+b" or a long identifier followed by an operator).
+                // Gallop backwards from the end of the token, so that the number of probes is logarithmic
+                // in the length of the token rather than of the run.
+                // Position 0 is known to be outside of the token, and the end of the run inside of it.
+                std::size_t outside = 0;
+                std::size_t inside = search_span.size();
+
+                for (std::size_t step = 1; step < inside - outside; step *= 2) {
+                    auto pos = inside - step;
+                    if (!consider_next_candidate(&search_span[pos])) {
+                        outside = pos;
+                        break;
+                    }
+                    inside = pos;
+                }
+
+                // Then bisect (outside, inside)
+                search_span = search_span.subspan(outside + 1, inside - outside - 1);
+
+                // We would love to use std::lower_bound, but we want to avoid unnecessary (re)-allocations
+                // Caching is an option, but inelegant
+                // You can't deny a span-based implementation is not nice too!
+             
+                while (!search_span.empty()) {
+                    auto mid_pos = search_span.size() / 2;
+
+                    if (consider_next_candidate(&search_span[mid_pos])) {
+                        // Still in bounds. Continue to the left.
+                        search_span = search_span.first(mid_pos);
+                    }
+                    else {
+                        // Overshot. Backtrack to the right.
+                        search_span = search_span.subspan(mid_pos + 1); 
+                        // +1 because we already considered mid_pos
+                    }
+                }
+            }
+        }
+        // else: one character token, or the start was already found
+
+        auto previous = m_window;
+        m_window = wrap(tu(), candidate_tok.release());
+        m_window->inherit(*previous);
+        m_index = 0;
+        land();
+    }
+
+    template <bool Forward>
+    void step() {
+        if constexpr (Forward) {
+            step_forward();
+        }
+        else {
+            step_backward();
+        }
+    }
+
+    // Steps on in the direction of Forward until the token is of a kind in Policy::kind_mask, or the end sentinel
+    template <bool Forward>
+    void skip_unmatched() {
+        if constexpr (Policy::filtered) {
+            while (m_window && !(kind_bit(clang_getTokenKind(current())) & Policy::kind_mask)) {
+                step<Forward>();
+            }
+        }
+    }
+
+    // NOTE: the start location is either the end location of the previous token 
+    //       or the location of the first character of the current token
+    // 
+    // The end location is consistent regardless of which start location scheme is used
+
+public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = CXToken;
+    using pointer = const CXToken*;
+    using reference = const CXToken&;
+    using iterator_category = std::forward_iterator_tag;
+
+    // The end sentinel
+    basic_token_iterator() = default;
+
+    // Copies share the underlying token window.
+    basic_token_iterator(const basic_token_iterator&) noexcept = default;
+    basic_token_iterator(basic_token_iterator&&) noexcept = default;
+    basic_token_iterator &operator=(const basic_token_iterator&) noexcept = default;
+    basic_token_iterator &operator=(basic_token_iterator&&) noexcept = default;
+
+    // Forward: the first matching token at or after loc. Backward: the first token at or after loc if it matches,
+    // or else the last matching token before it.
+    basic_token_iterator(gsl::not_null<CXTranslationUnit> tu, const cursor_location &loc) 
+    :m_window{ lex_window(tu, loc.get()) }
+    {
+        land();
+        skip_unmatched<Policy::forward>();
+    }
+
+    // Resolves loc against the cached index of its file, with a binary search.
+    // If the index has every CXToken already (it was lexed whole), iterating stays within them. Otherwise (it was
+    // loaded from a store, updated or lexed in parallel) the tokens are lexed window_bytes at a time, where the
+    // table of the index says they are, in both directions.
+    //
+    // Once the TU is reparsed (see token_cache::update()), using the iterator throws stale_token_error.
+    basic_token_iterator(token_cache &cache, gsl::not_null<CXTranslationUnit> tu, const cursor_location &loc)
+    {
+        auto index = cache.get(tu, loc);
+        auto pos = index->find(spelling_offset(loc.get()));
+        if (pos < index->size()) {
+            land(*index, pos);
+            skip_unmatched<Policy::forward>();
+        }
+    }
+
+    // Refers to the same token as it, an iterator over an index (or to the next matching one),
+    // or is the end sentinel if it is at its end.
+    template <typename P>
+    explicit basic_token_iterator(const basic_token_iterator<P, table_tokens> &it);
+
+    basic_token_iterator &operator++() {
+        [[maybe_unused]] typename instrumentation::timer timer{ token_timer::increments };
+        instrumentation::count(token_counter::steps);
+        step<Policy::forward>();
+        skip_unmatched<Policy::forward>();
+        return *this;
+    }
+
+    basic_token_iterator operator++(int) {
+        auto temp = *this;
+        operator++();
+        return temp;
+    }
+
+    // WARNING: Does not work across files, even if
+    // they are contained within the same TU! Use tu_token_iterator to follow #include directives.
+    // 
+    // Each step backward that leaves the current window costs several libclang lexes, unless the iterator was
+    // built from a token_cache. Prefer reverse_token_iterator for long backward walks.
+    //
+    // Becomes the end sentinel if there is no matching token before this one.
+    basic_token_iterator &operator--() {
+        [[maybe_unused]] typename instrumentation::timer timer{ token_timer::decrements };
+        instrumentation::count(token_counter::steps);
+        step<!Policy::forward>();
+        skip_unmatched<!Policy::forward>();
+        return *this;
+    }
+
+    basic_token_iterator operator--(int) {
+        auto temp = *this;
+        operator--();
+        return temp;
+    }
+
+    inline reference operator*() const {
+        return current();
+    }
+
+    inline pointer operator->() const {
+        return &current();
+    }
+
+    // Same as clang_getTokenSpelling(), without the CXString: a slice of the file buffer the token is spelled in.
+    // Valid for as long as the TU, or as the window that holds the token for tokens without a file buffer.
+    // Like token_view, it is the token as written: an identifier split by a line continuation keeps it, where
+    // clang_getTokenSpelling() removes it.
+    std::string_view spelling() const {
+        assert(m_window);
+        check_live();
+        return m_window->spelling(m_index);
+    }
+
+    // The current token, decoded
+    token_view view() const {
+        assert(m_window);
+        check_live();
+        return m_window->view(m_index);
+    }
+
+    // 1-based line and column of the first character of the token, like clang_getSpellingLocation(),
+    // but looked up in a line table of the file instead of decoded by libclang
+    unsigned int line() const {
+        assert(m_window);
+        check_live();
+        return m_window->line(m_index);
+    }
+
+    unsigned int column() const {
+        assert(m_window);
+        check_live();
+        return m_window->column(m_index);
+    }
+
+    // Two iterators are equal if their tokens end at the same location
+    bool operator==(const basic_token_iterator &other) const noexcept {
+        if (bool(m_window) != bool(other.m_window)) return false;
+        if (!m_window) return true;
+
+        return m_end_offset == other.m_end_offset &&
+               m_file == other.m_file &&
+               tu() == other.tu();
+    }
+
+    bool operator!=(const basic_token_iterator &other) const noexcept {
+        return !operator==(other);
+    }
+
+    // Orders the tokens of a file by position. The end sentinel compares greater than everything else.
+    // The relative order of tokens from different files is unspecified, but consistent.
+    bool operator<(const basic_token_iterator &other) const noexcept {
+        if (!other.m_window) return bool(m_window);
+        if (!m_window) return false;
+
+        if (tu() != other.tu()) return std::less<CXTranslationUnit>{}(tu(), other.tu());
+        if (m_file != other.m_file) return std::less<CXFile>{}(m_file, other.m_file);
+        return m_end_offset < other.m_end_offset;
+    }
+
+    bool is_end_sentinel() const noexcept { return !m_window; }
+    operator bool() const noexcept { return !is_end_sentinel(); }
+
+    friend void swap(basic_token_iterator &lhs, basic_token_iterator &rhs) noexcept {
+        swap(lhs.m_window, rhs.m_window);
+        std::swap(lhs.m_index, rhs.m_index);
+        std::swap(lhs.m_file, rhs.m_file);
+        std::swap(lhs.m_begin_offset, rhs.m_begin_offset);
+        std::swap(lhs.m_end_offset, rhs.m_end_offset);
+    }
+};
+
+// Walks the tokens of a file forward, lexed by libclang as it goes. The iterator most code wants:
+// it needs no index, and lexes only the tokens around it.
+using token_iterator = basic_token_iterator<live_token_policy>;
+
+// Walks the tokens of a single file backwards in O(1) per step, over a file_token_index.
+// 
+// operator++ moves towards the beginning of the file, and the end sits before the first token.
+// Unlike std::reverse_iterator, converting to and from token_iterator preserves the referenced token.
+// The end sentinel of token_iterator may not be converted to it.
+using reverse_token_iterator = basic_token_iterator<token_policy<CXToken, false>>;
+
+// Iterates over the tokens of a file_token_index, as configured by Policy (see token_policy).
+//
+// The arrays of the token table are looked up once, on construction, so that a step and a dereference are
+// plain index arithmetic whatever the table is backed by. Unfiltered iterators are random access,
+// filtered ones bidirectional. Yielding token_views, they are only C++17 input iterators, like token_view_iterator.
+//
+// A backward iterator keeps the position one past its token, like std::reverse_iterator: position() and base()
+// are those of the forward iterator that follows its token, and the end is position 0.
+template <typename Policy>
+class basic_token_iterator<Policy, table_tokens> {
+    template <typename, typename> friend class basic_token_iterator;
+
+    static constexpr bool views = std::is_same<typename Policy::value_type, token_view>::value;
+    static constexpr unsigned int kind_mask = Policy::kind_mask;
+
+    ref_ptr<const file_token_index> m_index;
+    const std::uint8_t* m_kinds = nullptr;
+    const unsigned int* m_begin_offsets = nullptr;
+    const unsigned int* m_end_offsets = nullptr;
+    unsigned int m_size = 0;
+    unsigned int m_pos = 0;
+
+    // Of the token the iterator refers to
+    unsigned int token_position() const noexcept {
+        assert(m_index);
+        assert(Policy::forward ? (m_pos < m_size) : (m_pos > 0));
+        return Policy::forward ? m_pos : m_pos - 1;
+    }
+
+    gsl::span<const std::uint8_t> kinds() const noexcept {
+        return gsl::make_span(m_kinds, m_size);
+    }
+
+    // The first matching token at or after pos, or m_size
+    unsigned int next_match(unsigned int pos) const noexcept {
+        if constexpr (Policy::filtered) {
+            return gsl::narrow_cast<unsigned int>(find_next_kind<kind_mask>(kinds(), pos));
+        }
+        else {
+            return pos;
+        }
+    }
+
+    // One past the last matching token before pos, or 0
+    unsigned int prev_match_end(unsigned int pos) const noexcept {
+        if constexpr (Policy::filtered) {
+            auto prev = find_prev_kind<kind_mask>(kinds(), pos);
+            return (prev == not_found) ? 0 : gsl::narrow_cast<unsigned int>(prev + 1);
+        }
+        else {
+            return pos;
+        }
+    }
+
+    void step_forward() noexcept {
+        if constexpr (Policy::filtered) {
+            m_pos = next_match(m_pos + 1);
+        }
+        else {
+            ++m_pos;
+        }
+    }
+
+    void step_backward() noexcept {
+        if constexpr (Policy::filtered) {
+            auto prev = find_prev_kind<kind_mask>(kinds(), m_pos);
+            assert(prev != not_found);
+            m_pos = gsl::narrow_cast<unsigned int>(prev);
+        }
+        else {
+            --m_pos;
+        }
+    }
+
+    static void count_step() noexcept {
+        Policy::instrumentation::count(token_counter::steps);
+    }
+
+    // Forward, of the token of it in index, or the end for the end sentinel. Backward, one past it.
+    static unsigned int position_of(const file_token_index &index, const token_iterator &it) {
+        if (it.is_end_sentinel()) {
+            assert(Policy::forward);
+            return index.size();
+        }
+        assert(it.m_file == index.file());
+        assert(it.m_end_offset > 0);
+        const auto pos = index.find(it.m_end_offset - 1);
+        return Policy::forward ? pos : pos + 1;
+    }
+
+    // The file that the token referred to by it is spelled in
+    static CXFile file_of(const token_iterator &it) {
+        assert(!it.is_end_sentinel());
+        return it.m_file;
+    }
+
+public:
+    using policy = Policy;
+    using difference_type = std::ptrdiff_t;
+    using value_type = typename Policy::value_type;
+    using pointer = std::conditional_t<views, void, const CXToken*>;
+    using reference = std::conditional_t<views, token_view, const CXToken&>;
+    using iterator_category = std::conditional_t<views, std::input_iterator_tag,
+                                                 std::conditional_t<Policy::filtered, std::bidirectional_iterator_tag,
+                                                                    std::random_access_iterator_tag>>;
+    using iterator_concept = std::conditional_t<Policy::filtered, std::bidirectional_iterator_tag,
+                                                std::random_access_iterator_tag>;
+
+    // Singular iterator
+    basic_token_iterator() = default;
+
+    // Forward: the first matching token at or after pos. Backward: the last matching token before pos.
+    basic_token_iterator(ref_ptr<const file_token_index> index, unsigned int pos) noexcept
+    :m_index{ std::move(index) }
+    {
+        assert(m_index);
+        const auto &table = *m_index->table();
+        m_kinds = table.kinds().data();
+        m_begin_offsets = table.begin_offsets().data();
+        m_end_offsets = table.end_offsets().data();
+        m_size = table.size();
+
+        assert(pos <= m_size);
+        m_pos = Policy::forward ? next_match(pos) : prev_match_end(pos);
+    }
+
+    // Forward: the token at loc, or the first matching token after it. Backward: the token at loc, or the last matching
+    // token before it.
+    basic_token_iterator(token_cache &cache, gsl::not_null<CXTranslationUnit> tu, const cursor_location &loc)
+    :basic_token_iterator{ cache.get(tu, loc), loc }
+    {}
+
+    basic_token_iterator(ref_ptr<const file_token_index> index, const cursor_location &loc)
+    :basic_token_iterator{ index, index->find(spelling_offset(loc.get())) }
+    {
+        if constexpr (!Policy::forward) {
+            // find() lands on the first token after loc when loc is in between tokens
+            auto pos = m_index->find(spelling_offset(loc.get()));
+            if (pos < m_size && m_begin_offsets[pos] <= spelling_offset(loc.get())) {
+                m_pos = prev_match_end(pos + 1);
+            }
+        }
+    }
+
+    // Refers to the same token as it (or, as above, the nearest matching one), reusing an existing index of its file.
+    // Forward, the end sentinel converts to the end of the file. Backward, it may not be converted.
+    basic_token_iterator(ref_ptr<const file_token_index> index, const token_iterator &it)
+    :basic_token_iterator{ index, position_of(*index, it) }
+    {}
+
+    // The same, with the cached index of the file of it
+    basic_token_iterator(token_cache &cache, const token_iterator &it)
+    :basic_token_iterator{ cache.get(it.tu(), file_of(it)), it }
+    {}
+
+    // The same, lexing the whole file of it to build the index
+    explicit basic_token_iterator(const token_iterator &it)
+    :basic_token_iterator{ make_ref<const file_token_index>(it.tu(), file_of(it)), it }
+    {}
+
+    // Positioned at it.position() (see the constructor above)
+    template <typename P = Policy,
+              typename = std::enable_if_t<!std::is_same<basic_token_iterator<P>, indexed_token_iterator>::value>>
+    explicit basic_token_iterator(const indexed_token_iterator &it) noexcept
+    :basic_token_iterator{ it.index(), it.position() }
+    {}
+
+    static basic_token_iterator begin(ref_ptr<const file_token_index> index) noexcept {
+        auto size = index->size();
+        return basic_token_iterator{ std::move(index), Policy::forward ? 0 : size };
+    }
+
+    static basic_token_iterator end(ref_ptr<const file_token_index> index) noexcept {
+        auto size = index->size();
+        return basic_token_iterator{ std::move(index), Policy::forward ? size : 0 };
+    }
+
+    const ref_ptr<const file_token_index> &index() const noexcept { return m_index; }
+    unsigned int position() const noexcept { return m_pos; }
+    indexed_token_iterator base() const noexcept { return indexed_token_iterator{ m_index, m_pos }; }
+
+    // True past the last matching token (before the first one, backward), and for singular iterators
+    bool is_end_sentinel() const noexcept { return !m_index || m_pos == (Policy::forward ? m_size : 0); }
+    explicit operator bool() const noexcept { return !is_end_sentinel(); }
+
+    // True if the TU was reparsed since. See token_cache::revalidate().
+    bool stale() const noexcept { return m_index && m_index->stale(); }
+
+    unsigned int line() const { return m_index->line(token_position()); }
+    unsigned int column() const { return m_index->column(token_position()); }
+
+    reference operator*() const {
+        auto i = token_position();
+        m_index->check_live();
+        if constexpr (views) {
+            auto begin = m_begin_offsets[i];
+            auto end = m_end_offsets[i];
+            return token_view{ static_cast<CXTokenKind>(m_kinds[i]), m_index->file(), begin, end,
+                               m_index->buffer().substr(begin, end - begin) };
+        }
+        else {
+            return (*m_index)[i];
+        }
+    }
+
+    template <typename P = Policy, typename = std::enable_if_t<!std::is_same<typename P::value_type, token_view>::value>>
+    pointer operator->() const {
+        return &operator*();
+    }
+
+    basic_token_iterator &operator++() {
+        count_step();
+        if constexpr (Policy::forward) {
+            assert(m_pos < m_size);
+            step_forward();
+        }
+        else {
+            assert(m_pos > 0);
+            --m_pos;
+            m_pos = prev_match_end(m_pos);
+        }
+        return *this;
+    }
+
+    // There must be a matching token before this one
+    basic_token_iterator &operator--() {
+        count_step();
+        if constexpr (Policy::forward) {
+            step_backward();
+        }
+        else {
+            assert(m_pos < m_size);
+            m_pos = next_match(m_pos);
+            assert(m_pos < m_size);
+            ++m_pos;
+        }
+        return *this;
+    }
+
+    basic_token_iterator operator++(int) {
+        auto temp = *this;
+        operator++();
+        return temp;
+    }
+
+    basic_token_iterator operator--(int) {
+        auto temp = *this;
+        operator--();
+        return temp;
+    }
+
+    // Random access, for unfiltered iterators only
+
+    template <typename P = Policy, typename = std::enable_if_t<!P::filtered>>
+    basic_token_iterator &operator+=(difference_type n) {
+        count_step();
+        assert(m_index);
+        if constexpr (!Policy::forward) n = -n;
+        assert(n >= -static_cast<difference_type>(m_pos));
+        assert(n <= static_cast<difference_type>(m_size - m_pos));
+        m_pos = static_cast<unsigned int>(static_cast<difference_type>(m_pos) + n);
+        return *this;
+    }
+
+    template <typename P = Policy, typename = std::enable_if_t<!P::filtered>>
+    basic_token_iterator &operator-=(difference_type n) {
+        return operator+=(-n);
+    }
+
+    template <typename P = Policy, typename = std::enable_if_t<!P::filtered>>
+    reference operator[](difference_type n) const {
+        return *(*this + n);
+    }
+
+    template <typename P = Policy, typename = std::enable_if_t<!P::filtered>>
+    friend basic_token_iterator operator+(basic_token_iterator it, difference_type n) { return it += n; }
+
+    template <typename P = Policy, typename = std::enable_if_t<!P::filtered>>
+    friend basic_token_iterator operator+(difference_type n, basic_token_iterator it) { return it += n; }
+
+    template <typename P = Policy, typename = std::enable_if_t<!P::filtered>>
+    friend basic_token_iterator operator-(basic_token_iterator it, difference_type n) { return it -= n; }
+
+    template <typename P = Policy, typename = std::enable_if_t<!P::filtered>>
+    friend difference_type operator-(const basic_token_iterator &lhs, const basic_token_iterator &rhs) noexcept {
+        assert(lhs.m_index == rhs.m_index);
+        auto distance = static_cast<difference_type>(lhs.m_pos) - static_cast<difference_type>(rhs.m_pos);
+        return Policy::forward ? distance : -distance;
+    }
+
+    // Iterators over different indices of a file are equal at the same token, and at their ends
+    bool operator==(const basic_token_iterator &other) const noexcept {
+        if (m_index == other.m_index) return m_pos == other.m_pos;
+        if (is_end_sentinel() || other.is_end_sentinel()) return is_end_sentinel() && other.is_end_sentinel();
+
+        return m_index->tu() == other.m_index->tu() && m_index->file() == other.m_index->file() &&
+               m_begin_offsets[token_position()] == other.m_begin_offsets[other.token_position()];
+    }
+
+    bool operator!=(const basic_token_iterator &other) const noexcept { return !operator==(other); }
+
+    bool operator<(const basic_token_iterator &other) const noexcept {
+        assert(m_index == other.m_index);
+        return Policy::forward ? (m_pos < other.m_pos) : (other.m_pos < m_pos);
+    }
+
+    bool operator>(const basic_token_iterator &other) const noexcept { return other < *this; }
+    bool operator<=(const basic_token_iterator &other) const noexcept { return !(other < *this); }
+    bool operator>=(const basic_token_iterator &other) const noexcept { return !(*this < other); }
+
+    friend void swap(basic_token_iterator &lhs, basic_token_iterator &rhs) noexcept {
+        swap(lhs.m_index, rhs.m_index);
+        std::swap(lhs.m_kinds, rhs.m_kinds);
+        std::swap(lhs.m_begin_offsets, rhs.m_begin_offsets);
+        std::swap(lhs.m_end_offsets, rhs.m_end_offsets);
+        std::swap(lhs.m_size, rhs.m_size);
+        std::swap(lhs.m_pos, rhs.m_pos);
+    }
+};
+
+template <typename Policy>
+template <typename P>
+basic_token_iterator<Policy, live_tokens>::basic_token_iterator(const basic_token_iterator<P, table_tokens> &it)
+{
+    if (it) {
+        land(*it.m_index, it.token_position());
+        skip_unmatched<Policy::forward>();
+    }
+}
+
+// indexed_token_iterator in "fast mode": dereferencing yields a token_view by value instead of the CXToken,
+// so consumers never need to call back into libclang.
+//
+// Since the value is not a reference, this is only a C++17 input iterator.
+// It is a random access iterator to C++20 ranges.
+using token_view_iterator = basic_token_iterator<token_policy<token_view>>;
+
+// The same, from the last token to the first
+using reverse_token_view_iterator = basic_token_iterator<token_policy<token_view, false>>;
+
+// Iterates over the tokens of a file_token_index whose kind is in KindMask (see kind_bit()), e.g.
+//
+//     filtered_token_iterator<kind_bit(CXToken_Identifier) | kind_bit(CXToken_Keyword)>
+//
+// The tokens in between are skipped by a vectorized scan over the kind array of the index,
+// so they are never looked at individually. The end of the file is a past-the-end position, like indexed_token_iterator.
+template <unsigned int KindMask>
+using filtered_token_iterator = basic_token_iterator<token_policy<CXToken, true, KindMask>>;
+
+using identifier_token_iterator = filtered_token_iterator<kind_bit(CXToken_Identifier) | kind_bit(CXToken_Keyword)>;
+
+// Walks a file one macro expansion at a time: each step lands either on a token outside of any expansion,
+// or on the first token (the macro name) of an expansion, and steps over the rest of it in O(1).
+class expansion_token_iterator {
+    ref_ptr<const macro_expansion_map> m_map;
+    unsigned int m_pos = 0;
+
+public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = CXToken;
+    using pointer = const CXToken*;
+    using reference = const CXToken&;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    // Singular iterator
+    expansion_token_iterator() = default;
+
+    // At the expansion that contains the pos-th token, or at that token
+    expansion_token_iterator(ref_ptr<const macro_expansion_map> map, unsigned int pos) noexcept
+    :m_map{ std::move(map) }, m_pos{ pos }
+    {
+        assert(m_map);
+        assert(m_pos <= m_map->size());
+        if (m_pos < m_map->size()) m_pos = m_map->first(m_pos);
+    }
+
+    // At the expansion that loc is part of, or at the token at loc (or the first one after it).
+    // loc is resolved by its expansion location, so that a location within a macro expansion (such as that
+    // of a cursor produced by one) lands on the invocation in the file, and not in the macro definition.
+    expansion_token_iterator(token_cache &cache, gsl::not_null<CXTranslationUnit> tu, const cursor_location &loc)
+    {
+        CXFile file = nullptr;
+        unsigned int offset = 0;
+        clang_getExpansionLocation(loc.get(), &file, nullptr, nullptr, &offset);
+
+        auto map = cache.expansions(tu, file);
+        auto pos = map->index()->find(offset);
+        *this = expansion_token_iterator{ std::move(map), pos };
+    }
+
+    static expansion_token_iterator begin(ref_ptr<const macro_expansion_map> map) noexcept {
+        return expansion_token_iterator{ std::move(map), 0 };
+    }
+
+    static expansion_token_iterator end(ref_ptr<const macro_expansion_map> map) noexcept {
+        auto size = map->size();
+        return expansion_token_iterator{ std::move(map), size };
+    }
+
+    const ref_ptr<const macro_expansion_map> &map() const noexcept { return m_map; }
+    unsigned int position() const noexcept { return m_pos; }
+
+    bool in_expansion() const noexcept { return m_map->in_expansion(m_pos); }
+
+    // The tokens of the current expansion, or just the current token
+    indexed_token_iterator expansion_begin() const noexcept {
+        return indexed_token_iterator{ m_map->index(), m_pos };
+    }
+
+    indexed_token_iterator expansion_end() const noexcept {
+        return indexed_token_iterator{ m_map->index(), m_map->past(m_pos) };
+    }
+
+    reference operator*() const {
+        assert(m_map);
+        return (*m_map->index())[m_pos];
+    }
+
+    pointer operator->() const {
+        return &operator*();
+    }
+
+    expansion_token_iterator &operator++() {
+        m_pos = m_map->past(m_pos);
+        return *this;
+    }
+
+    expansion_token_iterator &operator--() {
+        assert(m_pos > 0);
+        m_pos = m_map->first(m_pos - 1);
+        return *this;
+    }
+
+    expansion_token_iterator operator++(int) {
+        auto temp = *this;
+        operator++();
+        return temp;
+    }
+
+    expansion_token_iterator operator--(int) {
+        auto temp = *this;
+        operator--();
+        return temp;
+    }
+
+    bool operator==(const expansion_token_iterator &other) const noexcept {
+        return m_map == other.m_map && m_pos == other.m_pos;
+    }
+
+    bool operator!=(const expansion_token_iterator &other) const noexcept { return !operator==(other); }
+};
+
+inline bool token_cache::revalidate(indexed_token_iterator &it) {
+    const auto &old = it.index();
+    assert(old);
+    if (!old->stale()) return true;
+
+    auto found = m_tus.find(old->tu());
+    if (found == m_tus.end()) return false;
+
+    const auto &state = found->second;
+    if (old->generation_counter() != state.generation.get() || old->generation() < state.first_generation) {
+        return false;
+    }
+
+    const bool at_end = it.position() == old->size();
+    unsigned int offset = at_end ? 0 : old->begin_offset(it.position());
+    for (auto i = old->generation() - state.first_generation; i < state.edits.size(); ++i) {
+        for (const auto &fe : state.edits[i]) {
+            if (fe.file == old->file()) offset = fe.edit.map(offset);
+        }
+    }
+
+    auto index = get(old->tu(), old->file());
+    auto pos = at_end ? index->size() : index->find(offset);
+    it = indexed_token_iterator{ std::move(index), pos };
+    return true;
+}
+
+// The tokens within a cursor's extent (or any other source range), lexed by a single clang_tokenize() call.
+// Iterators become the end sentinel once they step past the last token of the range,
+// so the end of the range is never looked up again.
+class token_range {
+    token_iterator m_begin;
+
+public:
+    token_range(gsl::not_null<CXTranslationUnit> tu, CXSourceRange extent)
+    :m_begin{ token_iterator::lex_range(tu, extent), 0 }
+    {}
+
+    token_range(gsl::not_null<CXTranslationUnit> tu, const CXCursor &cursor)
+    :token_range{ tu, clang_getCursorExtent(cursor) }
+    {}
+
+    token_iterator begin() const noexcept { return m_begin; }
+    token_iterator end() const noexcept { return token_iterator{}; }
+
+    bool empty() const noexcept { return m_begin.is_end_sentinel(); }
+    std::size_t size() const noexcept { return empty() ? 0 : m_begin.m_window->size(); }
+};
+
+// The tokens within a cursor's extent, looked up in a cached file_token_index.
+// Supports random access.
+class indexed_token_range {
+    indexed_token_iterator m_begin;
+    indexed_token_iterator m_end;
+
+public:
+    indexed_token_range(ref_ptr<const file_token_index> index, CXSourceRange extent)
+    {
+        auto begin_offset = spelling_offset(clang_getRangeStart(extent));
+        auto end_offset = spelling_offset(clang_getRangeEnd(extent));
+        auto first = index->find(begin_offset);
+        auto last = index->find(end_offset);
+
+        // Like token_range, keep a token that the range ends inside of: it starts within the range
+        if (begin_offset < end_offset && last < index->size() && index->begin_offset(last) < end_offset) ++last;
+        m_begin = indexed_token_iterator{ index, first };
+        m_end = indexed_token_iterator{ std::move(index), std::max(first, last) };
+    }
+
+    indexed_token_range(token_cache &cache, gsl::not_null<CXTranslationUnit> tu, const CXCursor &cursor)
+    :indexed_token_range{ cache.get(tu, cursor_location{ cursor }), clang_getCursorExtent(cursor) }
+    {}
+
+    indexed_token_iterator begin() const noexcept { return m_begin; }
+    indexed_token_iterator end() const noexcept { return m_end; }
+
+    bool empty() const noexcept { return m_begin == m_end; }
+    std::size_t size() const noexcept { return static_cast<std::size_t>(m_end - m_begin); }
+
+    const CXToken &operator[](std::size_t i) const noexcept {
+        return m_begin[static_cast<std::ptrdiff_t>(i)];
+    }
+};
+
+// The tokens of a source range as parallel arrays, for passes that scan them in bulk.
+// No CXTokens are kept, so it stays valid across reparses of the TU (but not edits of the file).
+// Reuse one across extract_tokens() calls to keep its capacity.
+struct token_soa {
+    CXFile file = nullptr;
+    std::vector<std::uint8_t> kinds;
+    std::vector<unsigned int> begin_offsets;
+    std::vector<unsigned int> end_offsets;
+
+    // 1-based, of the first character. Only filled in if asked for.
+    std::vector<unsigned int> lines;
+    std::vector<unsigned int> columns;
+
+    std::size_t size() const noexcept { return kinds.size(); }
+    bool empty() const noexcept { return kinds.empty(); }
+
+    // Keeps the capacity
+    void clear() noexcept {
+        file = nullptr;
+        kinds.clear();
+        begin_offsets.clear();
+        end_offsets.clear();
+        lines.clear();
+        columns.clear();
+    }
+};
+
+// Replaces the contents of out with the tokens that start within extent, lexed by a single clang_tokenize() call.
+// The libclang calls are recorded with Instrumentation (see token_policy).
+template <typename Instrumentation = stats_instrumentation>
+void extract_tokens(gsl::not_null<CXTranslationUnit> tu, CXSourceRange extent, token_soa &out, bool with_lines = false) {
+    out.clear();
+
+    CXToken* tokens = nullptr;
+    unsigned int num_tokens = 0;
+    clang_tokenize(tu, extent, &tokens, &num_tokens);
+    Instrumentation::count(token_counter::tokenize);
+
+    // Sized up front so that the loop below is plain stores
+    out.kinds.resize(num_tokens);
+    out.begin_offsets.resize(num_tokens);
+    out.end_offsets.resize(num_tokens);
+    if (with_lines) {
+        out.lines.resize(num_tokens);
+        out.columns.resize(num_tokens);
+    }
+
+    auto kinds = out.kinds.data();
+    auto begins = out.begin_offsets.data();
+    auto ends = out.end_offsets.data();
+    auto lines = out.lines.data();
+    auto columns = out.columns.data();
+
+    // clang_tokenize() also returns the token that starts at the end of the range
+    const auto end_offset = spelling_offset(clang_getRangeEnd(extent));
+
+    unsigned int n = 0;
+    for (; n < num_tokens; ++n) {
+        auto token_extent = clang_getTokenExtent(tu, tokens[n]);
+        Instrumentation::count(token_counter::get_token_extent);
+
+        // Lines and columns are only worked out when asked for
+        clang_getSpellingLocation(clang_getRangeStart(token_extent), n == 0 ? &out.file : nullptr,
+                                  with_lines ? &lines[n] : nullptr, with_lines ? &columns[n] : nullptr, &begins[n]);
+        if (begins[n] >= end_offset) break;
+
+        kinds[n] = gsl::narrow_cast<std::uint8_t>(clang_getTokenKind(tokens[n]));
+        ends[n] = spelling_offset(clang_getRangeEnd(token_extent));
+    }
+
+    clang_disposeTokens(tu, tokens, num_tokens);
+    Instrumentation::count(token_counter::dispose_tokens);
+
+    out.kinds.resize(n);
+    out.begin_offsets.resize(n);
+    out.end_offsets.resize(n);
+    if (with_lines) {
+        out.lines.resize(n);
+        out.columns.resize(n);
+    }
+}
+
+template <typename Instrumentation = stats_instrumentation>
+void extract_tokens(gsl::not_null<CXTranslationUnit> tu, const CXCursor &cursor, token_soa &out, bool with_lines = false) {
+    extract_tokens<Instrumentation>(tu, clang_getCursorExtent(cursor), out, with_lines);
+}
+
+// A set of token sequence patterns, matched together in one forward pass over the tokens.
+//
+// Each pattern is a list of elements, each of which matches a token by kind, by spelling, by both, or any token.
+// The patterns are compiled into a bit-parallel NFA (shift-and): every element of every pattern is one bit of the state,
+// and each token updates all of them at once with a few word operations. The cost per token is a hash lookup of its
+// spelling and (number of elements / 64) word operations, independent of how the elements are shared out between patterns.
+class token_matcher {
+public:
+    struct element {
+        // Empty matches any spelling
+        std::string spelling;
+        // Matches any kind if false
+        bool has_kind = false;
+        CXTokenKind kind = CXToken_Punctuation;
+    };
+
+    static element any_token() { return element{}; }
+    static element spelled(std::string spelling) { return element{ std::move(spelling) }; }
+    static element of_kind(CXTokenKind kind, std::string spelling = {}) { return element{ std::move(spelling), true, kind }; }
+
+    struct match {
+        std::size_t pattern;
+        // Position of the first token of the match among the tokens searched, from 0
+        std::size_t first_token;
+        unsigned int begin_offset;
+        unsigned int end_offset;
+    };
+
+private:
+    static constexpr unsigned int num_kinds = CXToken_Comment + 1;
+    using mask = std::vector<std::uint64_t>;
+
+    // Bit i of each mask stands for the i-th element of all patterns, in the order they were added
+    std::size_t m_num_elements = 0;
+    mask m_starts;
+    mask m_finals;
+    mask m_any_spelling;
+    mask m_kinds[num_kinds];
+
+    // Keyed by views of the strings in m_spellings, which never move
+    std::deque<std::string> m_spellings;
+    std::unordered_map<std::string_view, mask> m_spelled;
+
+    // Pattern and length of the pattern that ends at each element
+    std::vector<std::size_t> m_pattern_of;
+    std::vector<std::size_t> m_lengths;
+    std::size_t m_max_length = 0;
+
+    std::size_t num_words() const noexcept { return m_starts.size(); }
+
+    static void set_bit(mask &m, std::size_t bit) noexcept {
+        m[bit / 64] |= std::uint64_t{ 1 } << (bit % 64);
+    }
+
+    void grow(std::size_t words) {
+        if (words <= num_words()) return;
+        m_starts.resize(words);
+        m_finals.resize(words);
+        m_any_spelling.resize(words);
+        for (auto &m : m_kinds) m.resize(words);
+        for (auto &entry : m_spelled) entry.second.resize(words);
+    }
+
+    mask &spelled_mask(const std::string &spelling) {
+        auto found = m_spelled.find(spelling);
+        if (found != m_spelled.end()) return found->second;
+
+        m_spellings.push_back(spelling);
+        return m_spelled.emplace(m_spellings.back(), mask(num_words())).first->second;
+    }
+
+public:
+    // Returned by add_spellings() for a pattern without elements, which is not added
+    static constexpr std::size_t no_pattern = static_cast<std::size_t>(-1);
+
+    // Returns the number that identifies the pattern in matches: 0 for the first pattern added, then 1, ...
+    std::size_t add(gsl::span<const element> pattern) {
+        assert(!pattern.empty());
+        const auto first = m_num_elements;
+        m_num_elements += pattern.size();
+        grow((m_num_elements + 63) / 64);
+
+        for (std::size_t i = 0; i < pattern.size(); ++i) {
+            const auto &e = pattern[i];
+            const auto bit = first + i;
+
+            if (e.spelling.empty()) {
+                set_bit(m_any_spelling, bit);
+            }
+            else {
+                set_bit(spelled_mask(e.spelling), bit);
+            }
+
+            for (unsigned int kind = 0; kind < num_kinds; ++kind) {
+                if (!e.has_kind || e.kind == static_cast<CXTokenKind>(kind)) set_bit(m_kinds[kind], bit);
+            }
+        }
+
+        set_bit(m_starts, first);
+        set_bit(m_finals, m_num_elements - 1);
+
+        const auto id = m_lengths.size();
+        m_pattern_of.resize(m_num_elements, id);
+        m_lengths.push_back(pattern.size());
+        m_max_length = std::max(m_max_length, pattern.size());
+        return id;
+    }
+
+    std::size_t add(std::initializer_list<element> pattern) {
+        return add(gsl::make_span(pattern.begin(), pattern.size()));
+    }
+
+    // A pattern of exact spellings separated by whitespace, e.g. "std :: move (".
+    // Adds nothing and returns no_pattern if there are none.
+    std::size_t add_spellings(std::string_view spellings) {
+        std::vector<element> pattern;
+        for (std::size_t i = spellings.find_first_not_of(" \t\n"); i != std::string_view::npos; ) {
+            auto end = std::min(spellings.find_first_of(" \t\n", i), spellings.size());
+            pattern.push_back(spelled(std::string{ spellings.substr(i, end - i) }));
+            i = spellings.find_first_not_of(" \t\n", end);
+        }
+        return pattern.empty() ? no_pattern : add(pattern);
+    }
+
+    std::size_t size() const noexcept { return m_lengths.size(); }
+    bool empty() const noexcept { return m_lengths.empty(); }
+
+    // The state of one pass. Feed it every token in order; fn(const match&) is called as each match completes.
+    // Matches ending at the same token are reported in the order their patterns were added.
+    class search {
+        const token_matcher* m_matcher;
+        mask m_state;
+        std::vector<unsigned int> m_begin_offsets;
+        std::size_t m_num_tokens = 0;
+
+    public:
+        explicit search(const token_matcher &matcher)
+        :m_matcher{ &matcher }, m_state(matcher.num_words()), m_begin_offsets(std::max<std::size_t>(matcher.m_max_length, 1))
+        {}
+
+        template <typename Fn>
+        void feed(const token_view &token, Fn &&fn) {
+            const auto &matcher = *m_matcher;
+            const auto &kinds = matcher.m_kinds[token.kind < num_kinds ? token.kind : 0];
+            auto spelled = matcher.m_spelled.find(token.spelling);
+            const auto* spelled_bits = (spelled == matcher.m_spelled.end()) ? nullptr : spelled->second.data();
+
+            m_begin_offsets[m_num_tokens % m_begin_offsets.size()] = token.begin_offset;
+
+            // state = ((state << 1) | starts) & (elements this token satisfies)
+            std::uint64_t carry = 0;
+            for (std::size_t w = 0; w < m_state.size(); ++w) {
+                auto accepts = kinds[w] & (matcher.m_any_spelling[w] | (spelled_bits ? spelled_bits[w] : 0));
+                auto shifted = (m_state[w] << 1) | carry;
+                carry = m_state[w] >> 63;
+                m_state[w] = (shifted | matcher.m_starts[w]) & accepts;
+
+                for (auto hits = m_state[w] & matcher.m_finals[w]; hits; hits &= hits - 1) {
+                    auto pattern = matcher.m_pattern_of[w * 64 + lowest_bit(hits)];
+                    auto first = m_num_tokens + 1 - matcher.m_lengths[pattern];
+                    fn(match{ pattern, first, m_begin_offsets[first % m_begin_offsets.size()], token.end_offset });
+                }
+            }
+
+            ++m_num_tokens;
+        }
+    };
+
+    // Over any sequence of token_views, e.g. token_view_iterators or a token_generator
+    template <typename Iterator, typename Sentinel, typename Fn>
+    void find_all(Iterator first, Sentinel last, Fn &&fn) const {
+        search s{ *this };
+        for (; first != last; ++first) {
+            s.feed(*first, fn);
+        }
+    }
+
+    template <typename Fn>
+    void find_all(const token_range &range, Fn &&fn) const {
+        search s{ *this };
+        for (auto it = range.begin(); it; ++it) {
+            s.feed(it.view(), fn);
+        }
+    }
+
+    std::vector<match> find_all(const token_range &range) const {
+        std::vector<match> matches;
+        find_all(range, [&](const match &m) { matches.push_back(m); });
+        return matches;
+    }
+};
+
+// Every token of a TU in inclusion order, i.e. the order in which the preprocessor reads them:
+// the tokens of an included file follow the line of its #include directive.
+// 
+// The TU is flattened into a table of segments, each a run of consecutive tokens of one file_token_index,
+// so that crossing a file boundary is a step to the next (or previous) segment.
+// A file that is included more than once appears once per inclusion.
+// 
+// Built from clang_getInclusions(), so it must be rebuilt when the TU is reparsed.
+class tu_token_index : public ref_counted {
+public:
+    struct segment {
+        ref_ptr<const file_token_index> index;
+        unsigned int first;
+        unsigned int last;
+    };
+
+private:
+    struct inclusion {
+        CXFile file;
+        // Include directives from the main file down to the one that included file
+        std::vector<std::pair<CXFile, unsigned int>> stack;
+    };
+
+    struct node {
+        CXFile file;
+        // Offset of the #include directive, and the included node
+        std::vector<std::pair<unsigned int, std::size_t>> children;
+    };
+
+    std::vector<segment> m_segments;
+    std::map<CXFile, std::vector<std::size_t>> m_segments_of_file;
+
+    static void visit_inclusion(CXFile file, CXSourceLocation* stack, unsigned int depth, CXClientData data) {
+        auto &inclusions = *static_cast<std::vector<inclusion>*>(data);
+        inclusion inc{ file, {} };
+
+        for (unsigned int i = depth; i-- > 0; ) {
+            CXFile includer = nullptr;
+            unsigned int offset = 0;
+            clang_getSpellingLocation(stack[i], &includer, nullptr, nullptr, &offset);
+            inc.stack.emplace_back(includer, offset);
+        }
+
+        inclusions.push_back(std::move(inc));
+    }
+
+    // Offset of the end of the line containing offset, honouring line continuations the way the lexer does
+    static unsigned int line_end(gsl::span<const char> buffer, unsigned int offset) {
+        std::string_view text{ buffer.data(), static_cast<std::size_t>(buffer.size()) };
+        std::size_t i = offset;
+        for (; i < text.size(); ++i) {
+            if (text[i] == '\n' && !lexical_spans::is_continued(text, i)) break;
+        }
+        return gsl::narrow<unsigned int>(i);
+    }
+
+    void add_segment(ref_ptr<const file_token_index> index, unsigned int first, unsigned int last) {
+        if (first == last) return;
+        m_segments_of_file[index->file()].push_back(m_segments.size());
+        m_segments.push_back(segment{ std::move(index), first, last });
+    }
+
+    void flatten(token_cache &cache, gsl::not_null<CXTranslationUnit> tu, std::vector<node> &nodes, std::size_t id) {
+        auto index = cache.get(tu, nodes[id].file);
+
+        std::size_t file_size = 0;
+        const char* file_buffer = clang_getFileContents(tu, index->file(), &file_size);
+        assert(file_buffer);
+        auto buffer = gsl::make_span(file_buffer, file_size);
+
+        auto &children = nodes[id].children;
+        std::stable_sort(children.begin(), children.end(),
+                         [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
+
+        unsigned int pos = 0;
+        for (const auto &child : children) {
+            // The included tokens go after the last token of the directive
+            auto splice = std::max(pos, index->find(line_end(buffer, child.first)));
+            add_segment(index, pos, splice);
+            pos = splice;
+            flatten(cache, tu, nodes, child.second);
+        }
+        auto size = index->size();
+        add_segment(std::move(index), pos, size);
+    }
+
+public:
+    // Files are lexed through cache, and stay alive for as long as this index does
+    tu_token_index(token_cache &cache, gsl::not_null<CXTranslationUnit> tu) {
+        std::vector<inclusion> inclusions;
+        clang_getInclusions(tu, &visit_inclusion, &inclusions);
+
+        // Parents first
+        std::stable_sort(inclusions.begin(), inclusions.end(),
+                         [](const inclusion &lhs, const inclusion &rhs) { return lhs.stack.size() < rhs.stack.size(); });
+
+        // An inclusion is identified by its stack of include directives,
+        // which tells apart repeated inclusions of the same file
+        std::vector<node> nodes;
+        std::map<std::vector<std::pair<CXFile, unsigned int>>, std::size_t> lookup;
+
+        for (auto &inc : inclusions) {
+            if (inc.stack.empty()) {
+                // The main file. Anything else at depth 0 (e.g. a precompiled preamble) is not part of the walk.
+                if (!nodes.empty()) continue;
+            }
+            else {
+                auto site = inc.stack.back();
+                auto parent = lookup.find({ inc.stack.begin(), std::prev(inc.stack.end()) });
+                if (parent == lookup.end()) continue;
+                nodes[parent->second].children.emplace_back(site.second, nodes.size());
+            }
+
+            lookup.emplace(std::move(inc.stack), nodes.size());
+            nodes.push_back(node{ inc.file, {} });
+        }
+
+        if (!nodes.empty()) {
+            flatten(cache, tu, nodes, 0);
+        }
+    }
+
+    const std::vector<segment> &segments() const noexcept { return m_segments; }
+
+    // Returns the segment and position of the token covering offset in file, or of the first token after it
+    // in inclusion order. Returns {segments().size(), 0} if there is no such token.
+    std::pair<std::size_t, unsigned int> find(CXFile file, unsigned int offset) const {
+        auto found = m_segments_of_file.find(file);
+        if (found == m_segments_of_file.end()) {
+            return { m_segments.size(), 0 };
+        }
+
+        const auto &index = *m_segments[found->second.front()].index;
+        auto pos = index.find(offset);
+
+        for (auto id : found->second) {
+            const auto &seg = m_segments[id];
+            if (seg.first <= pos && pos < seg.last) {
+                return { id, pos };
+            }
+            if (pos == seg.last) {
+                // In between the #include directive and the included tokens
+                return (id + 1 < m_segments.size()) ? std::make_pair(id + 1, m_segments[id + 1].first)
+                                                    : std::make_pair(m_segments.size(), 0u);
+            }
+        }
+
+        return { m_segments.size(), 0 };
+    }
+
+    // Approximate number of bytes owned by this index, not counting the file_token_index objects
+    // which are accounted for by the token_cache
+    std::size_t memory_usage() const noexcept {
+        std::size_t bytes = sizeof(*this) + m_segments.capacity() * sizeof(segment);
+        for (const auto &file : m_segments_of_file) {
+            bytes += sizeof(file) + file.second.capacity() * sizeof(std::size_t);
+        }
+        return bytes;
+    }
+};
+
+// Bidirectional iterator over the tokens of a TU in inclusion order (see tu_token_index).
+// Both directions cross #include boundaries in O(1).
+class tu_token_iterator {
+    ref_ptr<const tu_token_index> m_tokens;
+    std::size_t m_segment = 0;
+    unsigned int m_pos = 0;
+
+    const tu_token_index::segment &current() const noexcept {
+        assert(m_tokens);
+        assert(m_segment < m_tokens->segments().size());
+        return m_tokens->segments()[m_segment];
+    }
+
+    tu_token_iterator(ref_ptr<const tu_token_index> tokens, std::pair<std::size_t, unsigned int> pos) noexcept
+    :m_tokens{ std::move(tokens) }, m_segment{ pos.first }, m_pos{ pos.second }
+    {
+        assert(m_tokens);
+    }
+
+public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = CXToken;
+    using pointer = const CXToken*;
+    using reference = const CXToken&;
+    using iterator_category = std::bidirectional_iterator_tag;
+
+    // Singular iterator
+    tu_token_iterator() = default;
+
+    // Token at loc, or the first token after it in inclusion order
+    tu_token_iterator(ref_ptr<const tu_token_index> tokens, const cursor_location &loc)
+    :m_tokens{ std::move(tokens) }
+    {
+        assert(m_tokens);
+        CXFile file = nullptr;
+        unsigned int offset = 0;
+        clang_getSpellingLocation(loc.get(), &file, nullptr, nullptr, &offset);
+        std::tie(m_segment, m_pos) = m_tokens->find(file, offset);
+    }
+
+    // Refers to the same token as it. The end sentinel is not allowed.
+    tu_token_iterator(ref_ptr<const tu_token_index> tokens, const token_iterator &it)
+    :m_tokens{ std::move(tokens) }
+    {
+        assert(m_tokens);
+        assert(!it.is_end_sentinel());
+        assert(it.m_end_offset > 0);
+        std::tie(m_segment, m_pos) = m_tokens->find(it.m_file, it.m_end_offset - 1);
+    }
+
+    static tu_token_iterator begin(ref_ptr<const tu_token_index> tokens) noexcept {
+        unsigned int first = tokens->segments().empty() ? 0 : tokens->segments().front().first;
+        return tu_token_iterator{ std::move(tokens), { 0, first } };
+    }
+
+    static tu_token_iterator end(ref_ptr<const tu_token_index> tokens) noexcept {
+        auto size = tokens->segments().size();
+        return tu_token_iterator{ std::move(tokens), { size, 0 } };
+    }
+
+    // The file of the current token, and the same token as an iterator over that file alone
+    const ref_ptr<const file_token_index> &index() const noexcept { return current().index; }
+    CXFile file() const noexcept { return current().index->file(); }
+    indexed_token_iterator file_iterator() const noexcept { return indexed_token_iterator{ index(), m_pos }; }
+
+    reference operator*() const {
+        return (*current().index)[m_pos];
+    }
+
+    pointer operator->() const {
+        return &operator*();
+    }
+
+    tu_token_iterator &operator++() {
+        if (++m_pos == current().last) {
+            ++m_segment;
+            m_pos = (m_segment < m_tokens->segments().size()) ? current().first : 0;
+        }
+        return *this;
+    }
+
+    tu_token_iterator &operator--() {
+        assert(m_tokens);
+        if (m_segment == m_tokens->segments().size() || m_pos == current().first) {
+            assert(m_segment > 0);
+            --m_segment;
+            m_pos = current().last;
+        }
+        --m_pos;
+        return *this;
+    }
+
+    tu_token_iterator operator++(int) {
+        auto temp = *this;
+        operator++();
+        return temp;
+    }
+
+    tu_token_iterator operator--(int) {
+        auto temp = *this;
+        operator--();
+        return temp;
+    }
+
+    bool operator==(const tu_token_iterator &other) const noexcept {
+        assert(m_tokens == other.m_tokens);
+        return m_segment == other.m_segment && m_pos == other.m_pos;
+    }
+
+    bool operator!=(const tu_token_iterator &other) const noexcept { return !operator==(other); }
+
+    friend void swap(tu_token_iterator &lhs, tu_token_iterator &rhs) noexcept {
+        swap(lhs.m_tokens, rhs.m_tokens);
+        std::swap(lhs.m_segment, rhs.m_segment);
+        std::swap(lhs.m_pos, rhs.m_pos);
+    }
+};
+
+// Concurrency
+// 
+// libclang allows different CXTranslationUnits to be used from different threads at the same time,
+// but a CXTranslationUnit (and the CXIndex it was parsed in) must only be used by one thread at a time.
+// Everything in this file inherits that rule from the TU it reads:
+// 
+// - Iterators, ranges, token_window, file_token_index, tu_token_index and lexical_spans are confined
+//   to the thread that uses their TU. ref_ptr counts are not atomic, so not even copies may cross threads.
+// - token_cache is not synchronized. Use one per thread.
+// - The helpers that do not touch libclang (cursor_location, the whitespace scans) are thread-safe.
+// - generate_tokens() with prefetching hands the TU to a helper thread while it runs (see below).
+// - A file_token_index built with replicas lexes one file on several threads, one TU per thread.
+//   Each of those TUs must have its own CXIndex.
+// 
+// Work on many TUs is therefore parallelized by TU, with one CXIndex per TU (or per thread, as long as
+// the TUs of each index stay on its thread). parallel_for_each_token() does exactly that.
+
+// A fixed set of jobs shared out between workers. Each worker takes jobs from the back of its own queue
+// and, once that is empty, steals from the front of the others'. No jobs are added after construction,
+// so a worker that finds every queue empty is done.
+class work_stealing_queues {
+    struct queue {
+        std::mutex mutex;
+        std::deque<std::size_t> jobs;
+    };
+
+    std::vector<std::unique_ptr<queue>> m_queues;
+
+public:
+    work_stealing_queues(std::size_t num_jobs, std::size_t num_workers) {
+        assert(num_workers > 0);
+        m_queues.reserve(num_workers);
+        for (std::size_t i = 0; i < num_workers; ++i) {
+            m_queues.push_back(std::make_unique<queue>());
+        }
+
+        // Contiguous blocks, so that a worker which is never robbed visits its jobs in order
+        for (std::size_t job = 0; job < num_jobs; ++job) {
+            m_queues[job * num_workers / std::max<std::size_t>(num_jobs, 1)]->jobs.push_front(job);
+        }
+    }
+
+    std::size_t size() const noexcept { return m_queues.size(); }
+
+    bool pop(std::size_t worker, std::size_t &job) {
+        assert(worker < m_queues.size());
+
+        for (std::size_t i = 0; i < m_queues.size(); ++i) {
+            auto &q = *m_queues[(worker + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock{ q.mutex };
+            if (q.jobs.empty()) continue;
+
+            if (i == 0) {
+                job = q.jobs.back();
+                q.jobs.pop_back();
+            }
+            else {
+                job = q.jobs.front();
+                q.jobs.pop_front();
+            }
+            return true;
+        }
+
+        return false;
+    }
+};
+
+// Runs fn(worker, job) for every job in [0, num_jobs) on up to num_workers threads, the calling thread included.
+// A worker is identified by the same number in every call of fn it makes. If fewer threads can be started,
+// the jobs run on those that were, and some worker numbers are never used.
+// The first exception thrown by fn stops the remaining jobs and is rethrown once every worker has finished.
+template <typename Fn>
+void parallel_for_each_job(std::size_t num_jobs, std::size_t num_workers, Fn &&fn) {
+    num_workers = std::max<std::size_t>(1, std::min(num_workers, num_jobs));
+    work_stealing_queues queues{ num_jobs, num_workers };
+
+    std::atomic<bool> failed{ false };
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&](std::size_t worker) {
+        try {
+            std::size_t job = 0;
+            while (!failed.load(std::memory_order_relaxed) && queues.pop(worker, job)) {
+                fn(worker, job);
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock{ error_mutex };
+            if (!error) error = std::current_exception();
+            failed = true;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    try {
+        threads.reserve(num_workers - 1);
+        for (std::size_t worker = 1; worker < num_workers; ++worker) {
+            threads.emplace_back(work, worker);
+        }
+    }
+    catch (...) {
+        // Out of threads. The jobs of the workers that did not start are stolen by those that did,
+        // which must still be joined.
+    }
+    work(0);
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+inline std::size_t default_num_workers() noexcept {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+inline ref_ptr<const token_table> file_token_index::lex_parallel(gsl::not_null<CXTranslationUnit> tu, CXFile file,
+                                                                 gsl::span<const CXTranslationUnit> replicas) {
+    assert(file);
+    std::size_t file_size = 0;
+    const char* file_buffer = clang_getFileContents(tu, file, &file_size);
+    assert(file_buffer);
+    const auto buffer = gsl::make_span(file_buffer, file_size);
+
+    // The file in each TU, found by name. Worker 0 is the calling thread, with tu.
+    // Replicas that do not have the file, or not with the same contents, would lex different tokens and are
+    // left out. Without any replica left, this is a serial lex.
+    std::vector<std::pair<CXTranslationUnit, CXFile>> lexers{ { tu.get(), file } };
+    CXString file_name = clang_getFileName(file);
+    for (auto replica : replicas) {
+        CXFile replica_file = clang_getFile(replica, clang_getCString(file_name));
+        if (!replica_file) continue;
+
+        std::size_t replica_size = 0;
+        const char* replica_buffer = clang_getFileContents(replica, replica_file, &replica_size);
+        if (!replica_buffer || replica_size != file_size || std::memcmp(replica_buffer, file_buffer, file_size) != 0) {
+            continue;
+        }
+        lexers.emplace_back(replica, replica_file);
+    }
+    clang_disposeString(file_name);
+
+    std::vector<unsigned int> splits{ 0 };
+    const auto num_chunks = std::min(file_size / parallel_chunk_bytes, lexers.size() * chunks_per_worker);
+    if (num_chunks > 1) {
+        lexical_spans spans{ buffer };
+        for (std::size_t i = 1; i < num_chunks; ++i) {
+            auto split = spans.next_line_break(buffer, gsl::narrow_cast<unsigned int>(file_size * i / num_chunks));
+            if (split > splits.back() && split < file_size) splits.push_back(split);
+        }
+    }
+    splits.push_back(gsl::narrow<unsigned int>(file_size));
+
+    // Each window is created and released by the worker that lexed it, on the worker's TU
+    std::vector<token_table> chunks(splits.size() - 1);
+    parallel_for_each_job(chunks.size(), lexers.size(), [&](std::size_t worker, std::size_t job) {
+        auto window = lex(lexers[worker].first, lexers[worker].second, splits[job], splits[job + 1]);
+        chunks[job].reserve(window->size());
+        chunks[job].append(*window);
+    });
+
+    std::size_t num_tokens = 0;
+    for (const auto &chunk : chunks) {
+        num_tokens += chunk.size();
+    }
+
+    // The kind of a token can depend on the token before it: after "@", an Objective-C keyword is a keyword rather than
+    // an identifier. The first token of each chunk was lexed without the last token of the chunk before, so it is
+    // lexed again together with it.
+    auto table = make_ref<token_table>();
+    table->reserve(num_tokens);
+    for (const auto &chunk : chunks) {
+        if (chunk.size() == 0) continue;
+        unsigned int first = 0;
+        if (table->size() > 0) {
+            auto window = lex(tu, file, table->begin_offsets()[table->size() - 1], chunk.end_offsets()[0]);
+            assert(window->size() == 2 && window->begin_offset(1) == chunk.begin_offsets()[0]);
+            table->append(*window, 1, 2);
+            first = 1;
+        }
+        table->append(chunk, first, chunk.size());
+    }
+    assert(std::is_sorted(table->end_offsets().begin(), table->end_offsets().end()));
+    return table;
+}
+
+// Calls fn(tu, token) for every token of the main file of each TU, on num_workers threads.
+// 
+// A TU is only ever handled by one worker, and each worker has its own token_cache. Workers are handed
+// any of the TUs, so each one must have been parsed in a CXIndex of its own.
+// The TUs must not be used by anyone else until this returns.
+// fn is called concurrently from different threads, for different TUs.
+template <typename Fn>
+void parallel_for_each_token(gsl::span<const CXTranslationUnit> tus, Fn &&fn,
+                             std::size_t num_workers = default_num_workers()) {
+    num_workers = std::max<std::size_t>(1, std::min<std::size_t>(num_workers, tus.size()));
+    std::vector<std::unique_ptr<token_cache>> caches;
+    for (std::size_t i = 0; i < num_workers; ++i) {
+        caches.push_back(std::make_unique<token_cache>());
+    }
+
+    parallel_for_each_job(tus.size(), num_workers, [&](std::size_t worker, std::size_t job) {
+        CXTranslationUnit tu = tus[job];
+        auto &cache = *caches[worker];
+
+        // Release the cached tokens on this worker, even if fn throws
+        struct cache_entry {
+            CXTranslationUnit tu;
+            token_cache &cache;
+            ~cache_entry() { cache.invalidate(tu); }
+        } entry{ tu, cache };
+
+        for (token_iterator it{ cache, tu, cursor_location{ clang_getTranslationUnitCursor(tu) } }; it; ++it) {
+            fn(tu, *it);
+        }
+    });
+}
+
+// A translation unit to be parsed by parallel_for_each_token().
+// The strings and unsaved file buffers must outlive the call.
+struct translation_unit_source {
+    std::string file_name;
+    std::vector<std::string> args;
+    std::vector<CXUnsavedFile> unsaved_files;
+    unsigned int options = CXTranslationUnit_None;
+};
+
+// Parses and walks every source, on num_workers threads. Each worker parses into its own CXIndex,
+// and disposes each TU once fn has seen all of its tokens.
+// fn is called as in the overload above. Returns the number of sources that failed to parse.
+template <typename Fn>
+std::size_t parallel_for_each_token(gsl::span<const translation_unit_source> sources, Fn &&fn,
+                                    std::size_t num_workers = default_num_workers()) {
+    struct worker_state {
+        CXIndex index = nullptr;
+        token_cache cache;
+        ~worker_state() { if (index) clang_disposeIndex(index); }
+    };
+
+    num_workers = std::max<std::size_t>(1, std::min<std::size_t>(num_workers, sources.size()));
+    std::vector<std::unique_ptr<worker_state>> workers;
+    for (std::size_t i = 0; i < num_workers; ++i) {
+        workers.push_back(std::make_unique<worker_state>());
+    }
+
+    std::atomic<std::size_t> num_failed{ 0 };
+
+    parallel_for_each_job(sources.size(), num_workers, [&](std::size_t worker, std::size_t job) {
+        const auto &source = sources[job];
+        auto &state = *workers[worker];
+        if (!state.index) {
+            state.index = clang_createIndex(0, 0);
+        }
+
+        std::vector<const char*> args;
+        args.reserve(source.args.size());
+        for (const auto &arg : source.args) {
+            args.push_back(arg.c_str());
+        }
+
+        CXTranslationUnit tu = nullptr;
+        auto error = clang_parseTranslationUnit2(state.index, source.file_name.c_str(),
+                                                 args.data(), gsl::narrow<int>(args.size()),
+                                                 const_cast<CXUnsavedFile*>(source.unsaved_files.data()),
+                                                 gsl::narrow<unsigned int>(source.unsaved_files.size()),
+                                                 source.options, &tu);
+        if (error != CXError_Success) {
+            ++num_failed;
+            return;
+        }
+
+        // Release the cached tokens before the TU, even if fn throws
+        struct tu_owner {
+            CXTranslationUnit tu;
+            token_cache &cache;
+            ~tu_owner() {
+                cache.invalidate(tu);
+                clang_disposeTranslationUnit(tu);
+            }
+        } owner{ tu, state.cache };
+
+        for (token_iterator it{ state.cache, tu, cursor_location{ clang_getTranslationUnitCursor(tu) } }; it; ++it) {
+            fn(tu, *it);
+        }
+    });
+
+    return num_failed;
+}
+
+#if TOKEN_ITERATOR_COROUTINES
+// Lexes a file chunk by chunk, from a given location to the end, into decoded token_views.
+// No CXTokens outlive a call to next(), so the chunks can be handed to another thread.
+class token_chunk_lexer {
+    CXTranslationUnit m_tu = nullptr;
+    CXFile m_file = nullptr;
+    std::string_view m_buffer;
+    unsigned int m_offset = 0;
+    unsigned int m_chunk_bytes;
+
+public:
+    token_chunk_lexer(gsl::not_null<CXTranslationUnit> tu, const cursor_location &loc, unsigned int chunk_bytes)
+    :m_tu{ tu }, m_chunk_bytes{ chunk_bytes }
+    {
+        assert(chunk_bytes > 0);
+        clang_getSpellingLocation(loc.get(), &m_file, nullptr, nullptr, &m_offset);
+
+        std::size_t file_size = 0;
+        const char* file_buffer = m_file ? clang_getFileContents(m_tu, m_file, &file_size) : nullptr;
+        m_buffer = std::string_view{ file_buffer, file_buffer ? file_size : 0 };
+    }
+
+    // Replaces the contents of chunk with the next tokens, keeping its capacity.
+    // Returns false once past the last token.
+    bool next(std::vector<token_view> &chunk) {
+        chunk.clear();
+
+        // Keep growing the chunk until it contains at least one token (i.e. skip over large comment blocks)
+        for (std::size_t length = m_chunk_bytes; m_offset < m_buffer.size(); length *= 2) {
+            auto end_offset = gsl::narrow<unsigned int>(std::min<std::size_t>(m_offset + length, m_buffer.size()));
+            auto range = clang_getRange(clang_getLocationForOffset(m_tu, m_file, m_offset),
+                                        clang_getLocationForOffset(m_tu, m_file, end_offset));
+            stats_instrumentation::count(token_counter::location_for_offset, 2);
+
+            CXToken* tokens = nullptr;
+            unsigned int num_tokens = 0;
+            clang_tokenize(m_tu, range, &tokens, &num_tokens);
+            stats_instrumentation::count(token_counter::tokenize);
+
+            for (unsigned int i = 0; i < num_tokens; ++i) {
+                auto extent = clang_getTokenExtent(m_tu, tokens[i]);
+                stats_instrumentation::count(token_counter::get_token_extent);
+
+                auto begin = spelling_offset(clang_getRangeStart(extent));
+                auto end = spelling_offset(clang_getRangeEnd(extent));
+                chunk.push_back(token_view{ clang_getTokenKind(tokens[i]), m_file, begin, end,
+                                            m_buffer.substr(begin, end - begin) });
+            }
+
+            clang_disposeTokens(m_tu, tokens, num_tokens);
+            stats_instrumentation::count(token_counter::dispose_tokens);
+
+            if (!chunk.empty()) {
+                m_offset = chunk.back().end_offset;
+                return true;
+            }
+            if (end_offset >= m_buffer.size()) break;
+        }
+
+        m_offset = gsl::narrow_cast<unsigned int>(m_buffer.size());
+        return false;
+    }
+};
+
+// Runs a token_chunk_lexer up to depth chunks ahead of the consumer, on a helper thread.
+// With a depth of 0, chunks are lexed on the calling thread when asked for, and no thread is started.
+// The helper thread is the only user of the TU from construction until destruction.
+class token_prefetcher {
+    token_chunk_lexer m_lexer;
+    std::size_t m_depth;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::vector<token_view>> m_ready;
+    std::vector<std::vector<token_view>> m_spare;
+    std::exception_ptr m_error;
+    bool m_done = false;
+    bool m_stop = false;
+
+    // Started last, once everything it reads is set up
+    std::thread m_thread;
+
+    void run() {
+        while (true) {
+            std::vector<token_view> chunk;
+            {
+                std::unique_lock<std::mutex> lock{ m_mutex };
+                m_cv.wait(lock, [this] { return m_stop || m_ready.size() < m_depth; });
+                if (m_stop) return;
+                if (!m_spare.empty()) {
+                    chunk = std::move(m_spare.back());
+                    m_spare.pop_back();
+                }
+            }
+
+            bool more = false;
+            std::exception_ptr error;
+            try {
+                more = m_lexer.next(chunk);
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{ m_mutex };
+                if (more) {
+                    m_ready.push_back(std::move(chunk));
+                }
+                else {
+                    m_error = error;
+                    m_done = true;
+                }
+            }
+            m_cv.notify_all();
+            if (!more) return;
+        }
+    }
+
+public:
+    token_prefetcher(token_chunk_lexer lexer, std::size_t depth)
+    :m_lexer{ lexer }, m_depth{ depth }
+    {
+        if (m_depth > 0) {
+            m_thread = std::thread{ [this] { run(); } };
+        }
+    }
+
+    token_prefetcher(const token_prefetcher&) = delete;
+    token_prefetcher &operator=(const token_prefetcher&) = delete;
+
+    ~token_prefetcher() {
+        if (m_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock{ m_mutex };
+                m_stop = true;
+            }
+            m_cv.notify_all();
+            m_thread.join();
+        }
+    }
+
+    // Replaces chunk with the next one. Its storage is recycled for a later chunk.
+    // Returns false once past the last token, and rethrows anything the helper thread threw.
+    bool next(std::vector<token_view> &chunk) {
+        if (m_depth == 0) return m_lexer.next(chunk);
+
+        std::unique_lock<std::mutex> lock{ m_mutex };
+        if (chunk.capacity() > 0) {
+            chunk.clear();
+            m_spare.push_back(std::move(chunk));
+        }
+        m_cv.wait(lock, [this] { return !m_ready.empty() || m_done; });
+
+        if (m_ready.empty()) {
+            chunk.clear();
+            if (m_error) std::rethrow_exception(m_error);
+            return false;
+        }
+
+        chunk = std::move(m_ready.front());
+        m_ready.pop_front();
+        lock.unlock();
+        m_cv.notify_all();
+        return true;
+    }
+};
+
+// A lazy sequence of token_views, produced by a coroutine. Move-only, and can be iterated once.
+class token_generator {
+public:
+    struct promise_type {
+        const token_view* current = nullptr;
+        std::exception_ptr error;
+
+        token_generator get_return_object() noexcept {
+            return token_generator{ std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        std::suspend_always final_suspend() const noexcept { return {}; }
+
+        // view must stay alive while the coroutine is suspended, i.e. be a local of the coroutine
+        std::suspend_always yield_value(const token_view &view) noexcept {
+            current = &view;
+            return {};
+        }
+
+        void return_void() const noexcept {}
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+    };
+
+    using handle = std::coroutine_handle<promise_type>;
+
+    class iterator {
+        handle m_coroutine;
+
+        friend class token_generator;
+
+        explicit iterator(handle coroutine) noexcept
+        :m_coroutine{ coroutine }
+        {}
+
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = token_view;
+        using iterator_concept = std::input_iterator_tag;
+
+        iterator() = default;
+
+        const token_view &operator*() const noexcept {
+            assert(m_coroutine && !m_coroutine.done());
+            return *m_coroutine.promise().current;
+        }
+
+        const token_view* operator->() const noexcept { return &**this; }
+
+        iterator &operator++() {
+            assert(m_coroutine && !m_coroutine.done());
+            m_coroutine.resume();
+            token_generator::rethrow(m_coroutine);
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        friend bool operator==(const iterator &it, std::default_sentinel_t) noexcept {
+            return !it.m_coroutine || it.m_coroutine.done();
+        }
+    };
+
+    token_generator(token_generator &&other) noexcept
+    :m_coroutine{ std::exchange(other.m_coroutine, nullptr) }
+    {}
+
+    token_generator &operator=(token_generator &&other) noexcept {
+        std::swap(m_coroutine, other.m_coroutine);
+        return *this;
+    }
+
+    ~token_generator() {
+        if (m_coroutine) m_coroutine.destroy();
+    }
+
+    // Starts the coroutine. Call once.
+    iterator begin() {
+        assert(m_coroutine);
+        m_coroutine.resume();
+        rethrow(m_coroutine);
+        return iterator{ m_coroutine };
+    }
+
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+private:
+    handle m_coroutine;
+
+    explicit token_generator(handle coroutine) noexcept
+    :m_coroutine{ coroutine }
+    {}
+
+    static void rethrow(handle coroutine) {
+        if (coroutine.done() && coroutine.promise().error) {
+            std::rethrow_exception(std::exchange(coroutine.promise().error, nullptr));
+        }
+    }
+};
+
+struct token_prefetch_options {
+    // Bytes of the file lexed by each clang_tokenize() call
+    unsigned int chunk_bytes = 16 * 1024;
+    // Chunks lexed ahead of the consumer. 0 lexes on the consumer's thread, without a helper thread.
+    std::size_t prefetch_depth = 2;
+};
+
+// Every token from loc to the end of its file, as token_views.
+// 
+// With a non-zero prefetch depth, the next chunks are lexed on a helper thread while the consumer works on
+// the current one, so that lexing overlaps with whatever is done to each token. That thread uses the TU
+// from the first step of the generator until the generator is destroyed, during which the consumer
+// must not use the TU itself (token_views need no libclang calls). Use a depth of 0 to interleave.
+inline token_generator generate_tokens(gsl::not_null<CXTranslationUnit> tu, cursor_location loc,
+                                       token_prefetch_options options = {}) {
+    token_prefetcher prefetcher{ token_chunk_lexer{ tu, loc, options.chunk_bytes }, options.prefetch_depth };
+
+    std::vector<token_view> chunk;
+    while (prefetcher.next(chunk)) {
+        for (const auto &view : chunk) {
+            co_yield view;
+        }
+    }
+}
+#endif
+
+#ifdef __cpp_lib_ranges
+static_assert(std::ranges::forward_range<token_range>);
+static_assert(std::ranges::random_access_range<indexed_token_range>);
+static_assert(std::ranges::sized_range<indexed_token_range>);
+static_assert(std::random_access_iterator<indexed_token_iterator>);
+static_assert(std::random_access_iterator<reverse_token_iterator>);
+static_assert(std::bidirectional_iterator<tu_token_iterator>);
+static_assert(std::random_access_iterator<token_view_iterator>);
+static_assert(std::random_access_iterator<reverse_token_view_iterator>);
+static_assert(std::bidirectional_iterator<identifier_token_iterator>);
+static_assert(std::bidirectional_iterator<expansion_token_iterator>);
+#if TOKEN_ITERATOR_COROUTINES
+static_assert(std::ranges::input_range<token_generator>);
+#endif
+#endif
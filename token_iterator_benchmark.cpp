@@ -0,0 +1,510 @@
+// Google Benchmark suite for token_iterator.
+//
+// Each benchmark reports tokens/sec (items_per_second) so that the different walks,
+// and the raw clang_tokenize() baseline, can be compared directly.
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <clang-c/Index.h>
+#include "token_iterator.cpp"
+#include "token_iterator_check.h"
+
+namespace {
+
+enum class input_kind { small, header_heavy, macro_heavy, literals_and_comments };
+
+std::string make_source(input_kind kind) {
+    std::string source;
+
+    switch (kind) {
+    case input_kind::small:
+        source += "#include <cstddef>\n";
+        for (int i = 0; i < 50; ++i) {
+            source += "static int f" + std::to_string(i) + "(int a, int b) { return a * b + " + std::to_string(i) + "; }\n";
+        }
+        break;
+
+    case input_kind::header_heavy:
+        source += "#include <algorithm>\n#include <map>\n#include <memory>\n#include <string>\n#include <vector>\n";
+        for (int i = 0; i < 40000; ++i) {
+            source += "struct s" + std::to_string(i) + " { std::vector<int> v; std::map<int, std::string> m; };\n";
+        }
+        break;
+
+    case input_kind::macro_heavy:
+        source += "#define CAT(a, b) a ## b\n#define STR(a) #a\n#define DECL(n) int CAT(var_, n) = sizeof(STR(n));\n";
+        for (int i = 0; i < 5000; ++i) {
+            source += "DECL(" + std::to_string(i) + ")\n";
+            source += "#if defined(CAT) && " + std::to_string(i % 2) + "\nint CAT(alt_, " + std::to_string(i) + ");\n#endif\n";
+        }
+        break;
+
+    case input_kind::literals_and_comments:
+        source += "/*\n" + std::string(4000, '*') + "\n * License header\n */\n";
+        for (int i = 0; i < 2000; ++i) {
+            source += "/// Doxygen comment for v" + std::to_string(i) + "\n/// " + std::string(200, '-') + "\n";
+            source += "const char* v" + std::to_string(i) + " = \"" + std::string(500, 'x') + "\";\n";
+            source += "const char* r" + std::to_string(i) + " = R\"(" + std::string(1000, ' ') + ")\"; // trailing\n";
+        }
+        break;
+    }
+
+    return source;
+}
+
+const char* file_name(input_kind kind) {
+    switch (kind) {
+    case input_kind::small: return "small.cpp";
+    case input_kind::header_heavy: return "header_heavy.cpp";
+    case input_kind::macro_heavy: return "macro_heavy.cpp";
+    case input_kind::literals_and_comments: return "literals_and_comments.cpp";
+    }
+    return nullptr;
+}
+
+// A parsed translation unit for one of the inputs, kept alive for the whole run
+class parsed_input {
+    std::string m_file_name;
+    std::string m_source;
+    CXIndex m_index = nullptr;
+    CXTranslationUnit m_tu = nullptr;
+
+public:
+    explicit parsed_input(input_kind kind)
+    :m_file_name{ file_name(kind) }, m_source{ make_source(kind) }
+    {
+        const char* args[] = { "-xc++", "-std=c++17" };
+        CXUnsavedFile unsaved{ m_file_name.c_str(), m_source.c_str(), static_cast<unsigned long>(m_source.size()) };
+
+        m_index = clang_createIndex(0, 0);
+        auto error = clang_parseTranslationUnit2(m_index, m_file_name.c_str(), args, 2, &unsaved, 1,
+                                                 CXTranslationUnit_None, &m_tu);
+        if (error != CXError_Success) {
+            std::abort();
+        }
+    }
+
+    parsed_input(const parsed_input&) = delete;
+    parsed_input &operator=(const parsed_input&) = delete;
+
+    ~parsed_input() {
+        clang_disposeTranslationUnit(m_tu);
+        clang_disposeIndex(m_index);
+    }
+
+    CXTranslationUnit tu() const noexcept { return m_tu; }
+    CXFile file() const { return clang_getFile(m_tu, m_file_name.c_str()); }
+    CXCursor cursor() const { return clang_getTranslationUnitCursor(m_tu); }
+
+    static const parsed_input &get(input_kind kind) {
+        static std::unique_ptr<parsed_input> inputs[4];
+        auto &input = inputs[static_cast<int>(kind)];
+        if (!input) input = std::make_unique<parsed_input>(kind);
+        return *input;
+    }
+};
+
+// The whole-file index, used as ground truth for token counts and start locations
+ref_ptr<const file_token_index> index_of(const parsed_input &input) {
+    return make_ref<const file_token_index>(input.tu(), input.file());
+}
+
+void set_tokens_processed(benchmark::State &state, std::size_t tokens_per_iteration) {
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * tokens_per_iteration));
+}
+
+// Baseline: what it costs to lex the whole file with a single libclang call
+void raw_tokenize(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    auto tu = input.tu();
+    auto file = input.file();
+
+    std::size_t file_size = 0;
+    clang_getFileContents(tu, file, &file_size);
+    auto range = clang_getRange(clang_getLocationForOffset(tu, file, 0),
+                                clang_getLocationForOffset(tu, file, static_cast<unsigned int>(file_size)));
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        CXToken* tokens = nullptr;
+        unsigned int count = 0;
+        clang_tokenize(tu, range, &tokens, &count);
+
+        for (unsigned int i = 0; i < count; ++i) {
+            benchmark::DoNotOptimize(clang_getTokenExtent(tu, tokens[i]));
+        }
+        clang_disposeTokens(tu, tokens, count);
+        num_tokens = count;
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+// Every token of the file into arrays, reusing their capacity across iterations
+void extract_soa(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+
+    token_soa tokens;
+    for (auto _ : state) {
+        extract_tokens(input.tu(), input.cursor(), tokens);
+        benchmark::DoNotOptimize(tokens.kinds.data());
+    }
+    set_tokens_processed(state, tokens.size());
+}
+
+void forward_walk(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        num_tokens = 0;
+        for (token_iterator it{ input.tu(), cursor_location{ input.cursor() } }; it; ++it) {
+            benchmark::DoNotOptimize(*it);
+            ++num_tokens;
+        }
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+void cached_forward_walk(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    token_cache cache;
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        num_tokens = 0;
+        for (token_iterator it{ cache, input.tu(), cursor_location{ input.cursor() } }; it; ++it) {
+            benchmark::DoNotOptimize(*it);
+            ++num_tokens;
+        }
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+// Walks token_iterator::operator-- from the last token, starting from a freshly lexed iterator
+// so that every step pays for the backward search.
+void backward_walk(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    auto index = index_of(input);
+    if (index->size() < 2) {
+        state.SkipWithError("input has too few tokens");
+        return;
+    }
+
+    auto last_loc = clang_getLocationForOffset(input.tu(), input.file(), index->begin_offset(index->size() - 1));
+    auto steps = std::min<std::size_t>(index->size() - 1, static_cast<std::size_t>(state.range(0)));
+
+    for (auto _ : state) {
+        token_iterator it{ input.tu(), cursor_location{ last_loc } };
+        for (std::size_t i = 0; i < steps; ++i) {
+            --it;
+            benchmark::DoNotOptimize(*it);
+        }
+    }
+    set_tokens_processed(state, steps);
+}
+
+void reverse_walk(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    auto index = index_of(input);
+    if (index->size() == 0) {
+        state.SkipWithError("input has no tokens");
+        return;
+    }
+
+    auto last_loc = clang_getLocationForOffset(input.tu(), input.file(), index->begin_offset(index->size() - 1));
+
+    for (auto _ : state) {
+        for (reverse_token_iterator it{ index, cursor_location{ last_loc } }; it; ++it) {
+            benchmark::DoNotOptimize(*it);
+        }
+    }
+    set_tokens_processed(state, index->size());
+}
+
+// The same walk over the token table only, through basic_token_iterator<token_policy<token_view, false>>
+void reverse_view_walk(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    auto index = index_of(input);
+
+    for (auto _ : state) {
+        auto end = reverse_token_view_iterator::end(index);
+        for (auto it = reverse_token_view_iterator::begin(index); it != end; ++it) {
+            benchmark::DoNotOptimize((*it).begin_offset);
+        }
+    }
+    set_tokens_processed(state, index->size());
+}
+
+// check_token_iterator() over the first state.range(0) backward steps. With TOKEN_ITERATOR_STATS, also reports
+// the probes per backward step, to catch regressions in the number of libclang calls as well as in time.
+void check_walk(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    token_iterator_check_options options;
+    options.max_backward_steps = static_cast<std::size_t>(state.range(0));
+
+    token_iterator_check_result result;
+    for (auto _ : state) {
+        result = check_token_iterator(input.tu(), input.file(), options);
+    }
+    if (!result.correct()) {
+        state.SkipWithError("token_iterator disagrees with clang_tokenize()");
+        return;
+    }
+
+    state.counters["probes_per_step"] = result.average_probes();
+    state.counters["slow_steps"] = static_cast<double>(result.slow_steps.size());
+    set_tokens_processed(state, result.num_tokens + result.backward_steps);
+}
+
+// STL algorithms copy iterators around freely
+void copy_heavy_algorithms(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    auto tu = input.tu();
+
+    auto is_kind = [](CXTokenKind kind) {
+        return [kind](const CXToken &tok) { return clang_getTokenKind(tok) == kind; };
+    };
+    auto same_kind = [](const CXToken &lhs, const CXToken &rhs) {
+        return clang_getTokenKind(lhs) == clang_getTokenKind(rhs);
+    };
+
+    // The kinds of the last three tokens, which std::search only finds near the end of the file
+    std::vector<CXToken> needle;
+    for (token_iterator it{ tu, cursor_location{ input.cursor() } }; it; ++it) {
+        if (needle.size() == 3) needle.erase(needle.begin());
+        needle.push_back(*it);
+    }
+
+    auto run = [&](token_iterator begin, token_iterator end) {
+        auto comment = std::find_if(begin, end, is_kind(CXToken_Comment));
+        auto pair = std::adjacent_find(begin, end, same_kind);
+        auto identifiers = std::count_if(begin, end, is_kind(CXToken_Identifier));
+        auto match = std::search(begin, end, needle.begin(), needle.end(), same_kind);
+        return std::make_tuple(comment, pair, identifiers, match);
+    };
+
+    // Each algorithm stops at its match, so count the tokens walked up to it, once, out of the timed loop
+    std::size_t num_tokens = 0;
+    {
+        token_iterator begin{ tu, cursor_location{ input.cursor() } };
+        token_iterator end;
+        auto walked = [&](const token_iterator &it, std::size_t past) {
+            auto distance = static_cast<std::size_t>(std::distance(begin, it));
+            return (it == end) ? distance : distance + past;
+        };
+
+        auto found = run(begin, end);
+        num_tokens = walked(std::get<0>(found), 1) + walked(std::get<1>(found), 2) + walked(end, 0) +
+                     walked(std::get<3>(found), needle.size());
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(run(token_iterator{ tu, cursor_location{ input.cursor() } }, token_iterator{}));
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+// Identifiers and keywords only, over the cached kind array
+void filtered_walk(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    auto index = index_of(input);
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        num_tokens = 0;
+        auto end = identifier_token_iterator::end(index);
+        for (auto it = identifier_token_iterator::begin(index); it != end; ++it) {
+            benchmark::DoNotOptimize(*it);
+            ++num_tokens;
+        }
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+// The hot loop of keyword matching, through clang_getTokenSpelling() and through token_iterator::spelling()
+bool is_keyword(std::string_view spelling) {
+    return spelling == "int" || spelling == "const" || spelling == "struct" || spelling == "return";
+}
+
+void keyword_match_cxstring(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        num_tokens = 0;
+        for (token_iterator it{ input.tu(), cursor_location{ input.cursor() } }; it; ++it) {
+            CXString spelling = clang_getTokenSpelling(input.tu(), *it);
+            benchmark::DoNotOptimize(is_keyword(clang_getCString(spelling)));
+            clang_disposeString(spelling);
+            ++num_tokens;
+        }
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+void keyword_match_string_view(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        num_tokens = 0;
+        for (token_iterator it{ input.tu(), cursor_location{ input.cursor() } }; it; ++it) {
+            benchmark::DoNotOptimize(is_keyword(it.spelling()));
+            ++num_tokens;
+        }
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+// Line and column of every token, decoded by libclang and looked up in the line table
+void line_column_libclang(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        num_tokens = 0;
+        for (token_iterator it{ input.tu(), cursor_location{ input.cursor() } }; it; ++it) {
+            unsigned int line = 0;
+            unsigned int column = 0;
+            clang_getSpellingLocation(clang_getRangeStart(clang_getTokenExtent(input.tu(), *it)), nullptr, &line, &column, nullptr);
+            benchmark::DoNotOptimize(line + column);
+            ++num_tokens;
+        }
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+void line_column_table(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        num_tokens = 0;
+        for (token_iterator it{ input.tu(), cursor_location{ input.cursor() } }; it; ++it) {
+            benchmark::DoNotOptimize(it.line() + it.column());
+            ++num_tokens;
+        }
+    }
+    set_tokens_processed(state, num_tokens);
+}
+
+// A dozen token patterns in a single forward pass over the file
+void multi_pattern_match(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    token_range range{ input.tu(), input.cursor() };
+
+    token_matcher matcher;
+    for (auto pattern : { "std :: move (", "std :: forward <", "new", "delete [ ]", "reinterpret_cast <", "const_cast <",
+                          ". begin ( )", ". end ( )", "-> get ( )", "sizeof (", "# define", "return nullptr ;" }) {
+        matcher.add_spellings(pattern);
+    }
+    matcher.add({ token_matcher::spelled("new"), token_matcher::of_kind(CXToken_Identifier), token_matcher::spelled("[") });
+
+    std::size_t num_matches = 0;
+    for (auto _ : state) {
+        num_matches = 0;
+        matcher.find_all(range, [&](const token_matcher::match &) { ++num_matches; });
+        benchmark::DoNotOptimize(num_matches);
+    }
+    set_tokens_processed(state, range.size());
+}
+
+void equality(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    token_iterator begin{ input.tu(), cursor_location{ input.cursor() } };
+    token_iterator other = begin;
+    ++other;
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(begin == other);
+        benchmark::DoNotOptimize(begin != token_iterator{});
+    }
+    set_tokens_processed(state, 2);
+}
+
+// The token table of the whole file lexed on state.range(0) threads, each with its own parse of the input.
+// The replicas are parsed once, outside the timed loop, so what it took is reported next to the result
+// (replica_parse_seconds): lexing in parallel only pays off when the replicas exist for another reason.
+void parallel_lex(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    std::vector<std::unique_ptr<parsed_input>> replica_inputs;
+    std::vector<CXTranslationUnit> replicas;
+    const auto parse_start = std::chrono::steady_clock::now();
+    for (std::int64_t i = 1; i < state.range(0); ++i) {
+        replica_inputs.push_back(std::make_unique<parsed_input>(kind));
+        replicas.push_back(replica_inputs.back()->tu());
+    }
+    const std::chrono::duration<double> parse_time = std::chrono::steady_clock::now() - parse_start;
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        auto index = make_ref<const file_token_index>(input.tu(), input.file(), gsl::make_span(replicas));
+        num_tokens = index->size();
+        benchmark::DoNotOptimize(index->table()->kinds().data());
+    }
+    state.counters["replica_parse_seconds"] = parse_time.count();
+    set_tokens_processed(state, num_tokens);
+}
+
+#if TOKEN_ITERATOR_COROUTINES
+// The generator front end, with state.range(0) chunks prefetched on a helper thread (0: none)
+void generator_walk(benchmark::State &state, input_kind kind) {
+    const auto &input = parsed_input::get(kind);
+    token_prefetch_options options;
+    options.prefetch_depth = static_cast<std::size_t>(state.range(0));
+
+    std::size_t num_tokens = 0;
+    for (auto _ : state) {
+        num_tokens = 0;
+        for (const auto &view : generate_tokens(input.tu(), cursor_location{ input.cursor() }, options)) {
+            benchmark::DoNotOptimize(view.kind);
+            ++num_tokens;
+        }
+    }
+    set_tokens_processed(state, num_tokens);
+}
+#endif
+
+#define TOKEN_ITERATOR_BENCHMARKS(kind)                                                    \
+    BENCHMARK_CAPTURE(raw_tokenize, kind, input_kind::kind);                               \
+    BENCHMARK_CAPTURE(extract_soa, kind, input_kind::kind);                                \
+    BENCHMARK_CAPTURE(forward_walk, kind, input_kind::kind);                               \
+    BENCHMARK_CAPTURE(cached_forward_walk, kind, input_kind::kind);                        \
+    BENCHMARK_CAPTURE(backward_walk, kind, input_kind::kind)->Arg(1000);                   \
+    BENCHMARK_CAPTURE(check_walk, kind, input_kind::kind)->Arg(1000);                      \
+    BENCHMARK_CAPTURE(reverse_walk, kind, input_kind::kind);                               \
+    BENCHMARK_CAPTURE(reverse_view_walk, kind, input_kind::kind);                          \
+    BENCHMARK_CAPTURE(copy_heavy_algorithms, kind, input_kind::kind);                      \
+    BENCHMARK_CAPTURE(filtered_walk, kind, input_kind::kind);                              \
+    BENCHMARK_CAPTURE(keyword_match_cxstring, kind, input_kind::kind);                     \
+    BENCHMARK_CAPTURE(keyword_match_string_view, kind, input_kind::kind);                  \
+    BENCHMARK_CAPTURE(line_column_libclang, kind, input_kind::kind);                       \
+    BENCHMARK_CAPTURE(line_column_table, kind, input_kind::kind);                          \
+    BENCHMARK_CAPTURE(multi_pattern_match, kind, input_kind::kind);                        \
+    BENCHMARK_CAPTURE(equality, kind, input_kind::kind)
+
+TOKEN_ITERATOR_BENCHMARKS(small);
+TOKEN_ITERATOR_BENCHMARKS(header_heavy);
+TOKEN_ITERATOR_BENCHMARKS(macro_heavy);
+TOKEN_ITERATOR_BENCHMARKS(literals_and_comments);
+
+BENCHMARK_CAPTURE(parallel_lex, header_heavy, input_kind::header_heavy)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+BENCHMARK_CAPTURE(parallel_lex, literals_and_comments, input_kind::literals_and_comments)->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+
+#if TOKEN_ITERATOR_COROUTINES
+BENCHMARK_CAPTURE(generator_walk, small, input_kind::small)->Arg(0)->Arg(2);
+BENCHMARK_CAPTURE(generator_walk, literals_and_comments, input_kind::literals_and_comments)->Arg(0)->Arg(2);
+#endif
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,148 @@
+// Differential checks of token_iterator against clang_tokenize(), shared by token_iterator_test.cpp,
+// token_iterator_fuzzer.cpp and token_iterator_benchmark.cpp. Not part of the library.
+//
+// Include after token_iterator.cpp.
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+#include <clang-c/Index.h>
+
+// Differential check of token_iterator against clang_tokenize(), for fuzzing the backward search of operator--
+// and for catching performance regressions in it.
+//
+// Walks every token of a file forward with operator++, and backward with operator-- from the last token,
+// comparing each token landed on with those of one clang_tokenize() of the whole file. The backward walk starts
+// from a freshly lexed iterator, so that every step goes through the backward search. With TOKEN_ITERATOR_STATS,
+// the probes (clang_getToken() calls) of each backward step are recorded too, and steps that make too many are
+// reported. token_iterator_fuzzer.cpp runs it on the sources of make_fuzz_source() under libFuzzer.
+struct token_iterator_check_options {
+    // A backward step that makes more probes than this is slow
+    unsigned int max_probes_per_step = 64;
+    // So is a backward walk that makes more probes per step than this on average
+    double max_average_probes = 8.0;
+    // Each backward step is a search, so long files can be checked on their last tokens only
+    std::size_t max_backward_steps = std::numeric_limits<std::size_t>::max();
+};
+
+struct token_iterator_check_result {
+    // According to clang_tokenize()
+    std::size_t num_tokens = 0;
+
+    // Position of the first token (in file order) where a walk landed on a different token or ended early, or not_found.
+    // A forward walk that goes on past the last token mismatches at num_tokens.
+    std::size_t forward_mismatch = not_found;
+    std::size_t backward_mismatch = not_found;
+
+    // Only recorded with TOKEN_ITERATOR_STATS. probes[i] counts the probes of the step onto token i,
+    // and is 0 for the tokens the backward walk did not reach.
+    std::vector<unsigned int> probes;
+    std::uint64_t total_probes = 0;
+    std::size_t backward_steps = 0;
+
+    // Positions of the tokens whose step made more than max_probes_per_step probes
+    std::vector<std::size_t> slow_steps;
+    bool slow_average = false;
+
+    double average_probes() const noexcept {
+        return backward_steps ? static_cast<double>(total_probes) / static_cast<double>(backward_steps) : 0.0;
+    }
+
+    bool correct() const noexcept { return forward_mismatch == not_found && backward_mismatch == not_found; }
+    bool fast() const noexcept { return slow_steps.empty() && !slow_average; }
+    bool ok() const noexcept { return correct() && fast(); }
+};
+
+inline token_iterator_check_result check_token_iterator(gsl::not_null<CXTranslationUnit> tu, CXFile file,
+                                                        const token_iterator_check_options &options = {}) {
+    assert(file);
+    token_iterator_check_result result;
+
+    std::size_t file_size = 0;
+    clang_getFileContents(tu, file, &file_size);
+    auto extent = clang_getRange(clang_getLocationForOffset(tu, file, 0),
+                                 clang_getLocationForOffset(tu, file, gsl::narrow<unsigned int>(file_size)));
+
+    token_soa truth;
+    extract_tokens(tu, extent, truth);
+    result.num_tokens = truth.size();
+    if (truth.empty()) return result;
+
+    auto matches = [&](const token_iterator &it, std::size_t i) {
+        auto view = it.view();
+        return view.begin_offset == truth.begin_offsets[i] && view.end_offset == truth.end_offsets[i] &&
+               view.kind == truth.kinds[i];
+    };
+
+    auto location_of = [&](std::size_t i) {
+        return cursor_location{ clang_getLocationForOffset(tu, file, truth.begin_offsets[i]) };
+    };
+
+    std::size_t i = 0;
+    token_iterator forward{ tu, location_of(0) };
+    for (; forward && i < truth.size() && matches(forward, i); ++forward) {
+        ++i;
+    }
+    if (forward || i < truth.size()) {
+        result.forward_mismatch = i;
+    }
+
+    result.probes.assign(truth.size(), 0);
+    i = truth.size() - 1;
+    token_iterator backward{ tu, location_of(i) };
+    if (!backward || !matches(backward, i)) {
+        result.backward_mismatch = i;
+        return result;
+    }
+
+    for (auto steps = std::min(i, options.max_backward_steps); steps > 0; --steps) {
+#if TOKEN_ITERATOR_STATS
+        const auto probes_before = token_iterator_stats::local().probes;
+#endif
+        --backward;
+        --i;
+        ++result.backward_steps;
+#if TOKEN_ITERATOR_STATS
+        const auto probes = token_iterator_stats::local().probes - probes_before;
+        result.probes[i] = gsl::narrow_cast<unsigned int>(probes);
+        result.total_probes += probes;
+        if (probes > options.max_probes_per_step) result.slow_steps.push_back(i);
+#endif
+
+        if (!backward || !matches(backward, i)) {
+            result.backward_mismatch = i;
+            break;
+        }
+    }
+
+    result.slow_average = result.average_probes() > options.max_average_probes;
+    return result;
+}
+
+// Turns arbitrary bytes into source text for check_token_iterator(): each byte picks a fragment that is hard
+// on the backward search (numbers with signs and separators, prefixed and raw literals, comments and line
+// continuations, punctuators that are prefixes of longer ones, ...). Fragments run into each other unseparated,
+// so that mutating the input also makes tokens merge and split.
+inline std::string make_fuzz_source(gsl::span<const std::uint8_t> data) {
+    static constexpr const char* fragments[] = {
+        "x", "identifier_", "_", "$", "int", "R", "u8", "L", " ", "  ", "\t", "\n", "\r\n", "\\\n", "\\ \n",
+        "0", "42", "0x1F", "1.", ".5", "1e+5", "1.e5", "0x1p-3", "1'000", "10ull", "1_km",
+        "'a'", "'\\''", "u8'x'", "\"s\"", "\"\\\"\"", "L\"w\"", "\"lit\"_sv", "R\"(raw\n)\"", "R\"d(a)\"b)d\"",
+        "'", "\"", "\"unterminated\n",
+        "// line\n", "// continued \\\n", "/* block */", "/*\n*/", "/**/", "*/",
+        "+", "++", "+=", "-", "->", "->*", "::", ":", ".", "..", "...", "<", "<<", "<<=", "<=>", ">", ">>=",
+        "#", "##", "%:", "<:", "<%", "(", ")", "{", "}", "[", "]", ";", ",", "?", "!", "~", "&&", "||", "^", "=", "==",
+        "#define M(a) a\n", "#include <x.h>\n", "#if 0\n", "#endif\n", "@", "`", "\x80", "\xc3\xa9",
+    };
+
+    std::string source;
+    source.reserve(data.size() * 4);
+    for (auto byte : data) {
+        source += fragments[byte % std::size(fragments)];
+    }
+    return source;
+}
@@ -0,0 +1,41 @@
+// libFuzzer target for token_iterator.
+//
+// Each input is turned into source text by make_fuzz_source(), and every token of it is walked forward and
+// backward by check_token_iterator(), against one clang_tokenize() of the whole file. Aborts on the first
+// input where a walk lands on a different token, or where a backward step makes too many probes
+// (with TOKEN_ITERATOR_STATS only).
+//
+//     clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address -DTOKEN_ITERATOR_STATS token_iterator_fuzzer.cpp -lclang
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <clang-c/Index.h>
+#include "token_iterator.cpp"
+#include "token_iterator_check.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size) {
+    static CXIndex index = clang_createIndex(0, 0);
+
+    auto source = make_fuzz_source(gsl::make_span(data, size));
+    const char* args[] = { "-xc++", "-std=c++17" };
+    CXUnsavedFile unsaved{ "fuzz.cpp", source.data(), static_cast<unsigned long>(source.size()) };
+
+    CXTranslationUnit tu = nullptr;
+    if (clang_parseTranslationUnit2(index, "fuzz.cpp", args, 2, &unsaved, 1, CXTranslationUnit_None, &tu) != CXError_Success) {
+        return 0;
+    }
+
+    auto result = check_token_iterator(tu, clang_getFile(tu, "fuzz.cpp"));
+    clang_disposeTranslationUnit(tu);
+
+    if (!result.ok()) {
+        std::fprintf(stderr, "token_iterator: %zu tokens, forward mismatch at %zu, backward mismatch at %zu, "
+                             "%zu slow steps, %.2f probes per step\n",
+                     result.num_tokens, result.forward_mismatch, result.backward_mismatch,
+                     result.slow_steps.size(), result.average_probes());
+        std::abort();
+    }
+    return 0;
+}
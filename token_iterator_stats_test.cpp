@@ -0,0 +1,143 @@
+// Tests of the instrumentation of token_iterator: the libclang calls a known walk makes, and the probes of the
+// backward search.
+//
+// Built with TOKEN_ITERATOR_STATS (as 1, or defined empty) or TOKEN_ITERATOR_STATS_TIMING, which the other tests
+// are not. Like token_iterator_test.cpp, the exit status is the number of failed checks.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <clang-c/Index.h>
+#include "token_iterator.cpp"
+#include "token_iterator_check.h"
+
+#if !TOKEN_ITERATOR_STATS
+#error "Build with TOKEN_ITERATOR_STATS or TOKEN_ITERATOR_STATS_TIMING"
+#endif
+
+namespace {
+
+int num_failures = 0;
+
+#define TOKEN_ITERATOR_CHECK(expr)                                                      \
+    do {                                                                                \
+        if (!(expr)) {                                                                  \
+            std::printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #expr);        \
+            ++num_failures;                                                             \
+        }                                                                               \
+    } while (0)
+
+// A C++ translation unit parsed from source into a CXIndex of its own, disposed with the object
+class parsed_source {
+    std::string m_file_name;
+    std::string m_source;
+    CXIndex m_index = nullptr;
+    CXTranslationUnit m_tu = nullptr;
+
+public:
+    parsed_source(std::string file_name, std::string source)
+    :m_file_name{ std::move(file_name) }, m_source{ std::move(source) }
+    {
+        const char* args[] = { "-xc++", "-std=c++17" };
+        CXUnsavedFile unsaved{ m_file_name.c_str(), m_source.c_str(), static_cast<unsigned long>(m_source.size()) };
+        m_index = clang_createIndex(0, 0);
+        if (clang_parseTranslationUnit2(m_index, m_file_name.c_str(), args, 2, &unsaved, 1, CXTranslationUnit_None,
+                                        &m_tu) != CXError_Success) {
+            std::printf("cannot parse %s\n", m_file_name.c_str());
+            std::abort();
+        }
+    }
+
+    parsed_source(const parsed_source&) = delete;
+    parsed_source &operator=(const parsed_source&) = delete;
+
+    ~parsed_source() {
+        clang_disposeTranslationUnit(m_tu);
+        clang_disposeIndex(m_index);
+    }
+
+    CXTranslationUnit tu() const noexcept { return m_tu; }
+    CXFile file() const { return clang_getFile(m_tu, m_file_name.c_str()); }
+};
+
+// A forward walk over a file smaller than a window lexes it with one clang_tokenize(), decodes each token once,
+// and makes one more clang_tokenize() past the last token to find the end. Every CXToken is disposed of.
+void forward_walk_counts() {
+    parsed_source parsed{ "counted.cpp", "int a = 1;\nint b = 2;\n" };
+    auto tu = parsed.tu();
+
+    auto &stats = token_iterator_stats::local();
+    stats.reset();
+    unsigned int num_tokens = 0;
+    for (token_iterator it{ tu, cursor_location{ clang_getLocationForOffset(tu, parsed.file(), 0) } }; it; ++it) {
+        ++num_tokens;
+    }
+
+    TOKEN_ITERATOR_CHECK(num_tokens == 10);
+    TOKEN_ITERATOR_CHECK(stats.location_for_offset == 4);
+    TOKEN_ITERATOR_CHECK(stats.tokenize == 2);
+    TOKEN_ITERATOR_CHECK(stats.dispose_tokens == 2);
+    TOKEN_ITERATOR_CHECK(stats.get_token_extent == 10);
+    TOKEN_ITERATOR_CHECK(stats.steps == 10);
+    TOKEN_ITERATOR_CHECK(stats.get_token == 0);
+    TOKEN_ITERATOR_CHECK(stats.backward_searches == 0 && stats.probes == 0);
+#if TOKEN_ITERATOR_STATS_TIMING
+    TOKEN_ITERATOR_CHECK(stats.increments.count() == 10 && stats.decrements.count() == 0);
+#endif
+
+    // collect() adds the counters of the calling thread to those of the threads that have exited, of which there are
+    // none here
+    const auto total = token_iterator_stats::collect();
+    TOKEN_ITERATOR_CHECK(total.tokenize == stats.tokenize && total.steps == stats.steps);
+}
+
+// The same walk with no_instrumentation records nothing, not even the libclang calls of the windows it lexes
+void uninstrumented_walk_records_nothing() {
+    parsed_source parsed{ "uncounted.cpp", "int a = 1;\nint b = 2;\n" };
+    auto tu = parsed.tu();
+    using uncounted_iterator = basic_token_iterator<token_policy<CXToken, true, 0xFF, no_instrumentation, live_tokens>>;
+
+    auto &stats = token_iterator_stats::local();
+    stats.reset();
+    unsigned int num_tokens = 0;
+    for (uncounted_iterator it{ tu, cursor_location{ clang_getLocationForOffset(tu, parsed.file(), 0) } }; it; ++it) {
+        ++num_tokens;
+    }
+
+    TOKEN_ITERATOR_CHECK(num_tokens == 10);
+    TOKEN_ITERATOR_CHECK(stats.location_for_offset == 0 && stats.tokenize == 0 && stats.dispose_tokens == 0);
+    TOKEN_ITERATOR_CHECK(stats.get_token_extent == 0 && stats.get_token == 0 && stats.steps == 0);
+}
+
+// Each backward step over long identifiers joined by operators, with and without spaces, probes from the first
+// character of the identifier, or at the operator itself, rather than searching for where the token starts
+void backward_walk_probes_stay_few() {
+    std::string source;
+    auto identifier = [](int i) { return "identifier_" + std::string(100 + (i * 37) % 150, 'x') + std::to_string(i); };
+    for (int i = 1; i < 2000; ++i) {
+        source += "int " + identifier(i) + " = " + identifier(i - 1) + "+" + identifier(i - 1) + " * " +
+                  identifier(i - 1) + "-" + identifier(i - 1) + ";\n";
+    }
+    parsed_source parsed{ "identifiers.cpp", source };
+
+    token_iterator_check_options options;
+    options.max_average_probes = 3.0;
+    const auto result = check_token_iterator(parsed.tu(), parsed.file(), options);
+    TOKEN_ITERATOR_CHECK(result.correct());
+    TOKEN_ITERATOR_CHECK(result.backward_steps + 1 == result.num_tokens && result.num_tokens > 20000);
+    TOKEN_ITERATOR_CHECK(result.fast() && result.average_probes() <= 3.0);
+}
+
+} // namespace
+
+int main() {
+    forward_walk_counts();
+    uninstrumented_walk_records_nothing();
+    backward_walk_probes_stay_few();
+
+    if (num_failures) {
+        std::printf("%d checks failed\n", num_failures);
+    }
+    return num_failures;
+}
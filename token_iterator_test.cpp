@@ -0,0 +1,1800 @@
+// Tests for token_iterator, against libclang itself.
+//
+// A plain executable: each test prints what failed, and the exit status is the number of failed checks.
+// Sources are parsed from memory, so no files are needed.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include <clang-c/Index.h>
+#include "token_iterator.cpp"
+#include "token_iterator_check.h"
+
+namespace {
+
+int num_failures = 0;
+
+#define TOKEN_ITERATOR_CHECK(expr)                                                      \
+    do {                                                                                \
+        if (!(expr)) {                                                                  \
+            std::printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #expr);        \
+            ++num_failures;                                                             \
+        }                                                                               \
+    } while (0)
+
+// A translation unit parsed from source into a CXIndex of its own, disposed with the object.
+// Each one can be handed to a different thread, as parallel_for_each_token() and replicas require.
+class parsed_source {
+public:
+    // The name and contents of a file that source can #include "name"
+    using header = std::pair<std::string, std::string>;
+
+private:
+    std::string m_file_name;
+    std::string m_source;
+    std::vector<header> m_headers;
+    CXIndex m_index = nullptr;
+    CXTranslationUnit m_tu = nullptr;
+
+public:
+    parsed_source(std::string file_name, std::string source, std::vector<header> headers = {},
+                  unsigned int options = CXTranslationUnit_None,
+                  const std::vector<std::string> &arguments = { "-xc++", "-std=c++17" })
+    :m_file_name{ std::move(file_name) }, m_source{ std::move(source) }, m_headers{ std::move(headers) }
+    {
+        std::vector<const char*> args;
+        for (const auto &arg : arguments) {
+            args.push_back(arg.c_str());
+        }
+        std::vector<CXUnsavedFile> unsaved{ { m_file_name.c_str(), m_source.c_str(), static_cast<unsigned long>(m_source.size()) } };
+        for (const auto &h : m_headers) {
+            unsaved.push_back({ h.first.c_str(), h.second.c_str(), static_cast<unsigned long>(h.second.size()) });
+        }
+
+        m_index = clang_createIndex(0, 0);
+        auto error = clang_parseTranslationUnit2(m_index, m_file_name.c_str(), args.data(), static_cast<int>(args.size()),
+                                                 unsaved.data(), static_cast<unsigned int>(unsaved.size()), options, &m_tu);
+        if (error != CXError_Success) {
+            std::printf("cannot parse %s\n", m_file_name.c_str());
+            std::abort();
+        }
+    }
+
+    parsed_source(const parsed_source&) = delete;
+    parsed_source &operator=(const parsed_source&) = delete;
+
+    ~parsed_source() {
+        clang_disposeTranslationUnit(m_tu);
+        clang_disposeIndex(m_index);
+    }
+
+    const std::string &file_name() const noexcept { return m_file_name; }
+    const std::string &source() const noexcept { return m_source; }
+    CXTranslationUnit tu() const noexcept { return m_tu; }
+    CXFile file() const { return clang_getFile(m_tu, m_file_name.c_str()); }
+    CXCursor cursor() const { return clang_getTranslationUnitCursor(m_tu); }
+};
+
+std::string spelling_of(CXTranslationUnit tu, const CXToken &tok) {
+    CXString spelling = clang_getTokenSpelling(tu, tok);
+    std::string result = clang_getCString(spelling);
+    clang_disposeString(spelling);
+    return result;
+}
+
+std::string file_name_of(CXTranslationUnit tu, const CXToken &tok) {
+    CXFile file = nullptr;
+    clang_getSpellingLocation(clang_getTokenLocation(tu, tok), &file, nullptr, nullptr, nullptr);
+    CXString name = clang_getFileName(file);
+    std::string result = clang_getCString(name);
+    clang_disposeString(name);
+    return result;
+}
+
+// The spellings of every token of the main file, walked serially without a cache
+std::vector<std::string> serial_spellings(const parsed_source &source) {
+    std::vector<std::string> spellings;
+    for (token_iterator it{ source.tu(), cursor_location{ source.cursor() } }; it; ++it) {
+        spellings.push_back(spelling_of(source.tu(), *it));
+    }
+    return spellings;
+}
+
+std::string numbered_source(int n) {
+    std::string source = "// source " + std::to_string(n) + "\n";
+    for (int i = 0; i < 200 + 50 * n; ++i) {
+        source += "int f" + std::to_string(i) + "(int a) { return a * " + std::to_string(n) + " + \"s\"[0]; }\n";
+    }
+    return source;
+}
+
+struct lexed_token {
+    CXTokenKind kind;
+    unsigned int begin_offset;
+    unsigned int end_offset;
+    std::string spelling;
+
+    bool operator==(const lexed_token &other) const {
+        return kind == other.kind && begin_offset == other.begin_offset && end_offset == other.end_offset &&
+               spelling == other.spelling;
+    }
+};
+
+// tok as libclang decodes it
+lexed_token lexed(CXTranslationUnit tu, const CXToken &tok) {
+    auto extent = clang_getTokenExtent(tu, tok);
+    return lexed_token{ clang_getTokenKind(tok), spelling_offset(clang_getRangeStart(extent)),
+                        spelling_offset(clang_getRangeEnd(extent)), spelling_of(tu, tok) };
+}
+
+// The tokens of the main file of source from offset on, by one clang_tokenize()
+std::vector<lexed_token> tokenized_from(const parsed_source &source, unsigned int offset) {
+    auto tu = source.tu();
+    auto file = source.file();
+    auto range = clang_getRange(clang_getLocationForOffset(tu, file, offset),
+                                clang_getLocationForOffset(tu, file, static_cast<unsigned int>(source.source().size())));
+    CXToken* tokens = nullptr;
+    unsigned int num_tokens = 0;
+    clang_tokenize(tu, range, &tokens, &num_tokens);
+
+    std::vector<lexed_token> result;
+    for (unsigned int i = 0; i < num_tokens; ++i) {
+        result.push_back(lexed(tu, tokens[i]));
+    }
+    clang_disposeTokens(tu, tokens, num_tokens);
+    return result;
+}
+
+// The tokens a forward walk from offset steps onto
+template <typename Iterator>
+std::vector<lexed_token> walked_from(const parsed_source &source, unsigned int offset) {
+    auto loc = clang_getLocationForOffset(source.tu(), source.file(), offset);
+    std::vector<lexed_token> walked;
+    for (Iterator it{ source.tu(), cursor_location{ loc } }; it; ++it) {
+        walked.push_back(lexed(source.tu(), *it));
+    }
+    return walked;
+}
+
+// Across windows, one of which has to grow past a comment longer than a window, and from starts at a token and in
+// the whitespace before it
+void forward_walk_matches_tokenize() {
+    parsed_source parsed{ "forward.cpp", numbered_source(20) + "/*" + std::string(40000, '*') + "*/\n" + numbered_source(1) };
+    TOKEN_ITERATOR_CHECK(parsed.source().size() > 4 * 16 * 1024);
+
+    const auto expected = tokenized_from(parsed, 0);
+    TOKEN_ITERATOR_CHECK(walked_from<token_iterator>(parsed, 0) == expected);
+
+    const auto middle = static_cast<unsigned int>(parsed.source().find("int f100"));
+    const auto expected_from_middle = tokenized_from(parsed, middle);
+    TOKEN_ITERATOR_CHECK(!expected_from_middle.empty() && expected_from_middle.front().spelling == "int");
+    TOKEN_ITERATOR_CHECK(walked_from<token_iterator>(parsed, middle) == expected_from_middle);
+    TOKEN_ITERATOR_CHECK(walked_from<token_iterator>(parsed, middle - 1) == expected_from_middle);
+
+    // Past the last token, at the end sentinel
+    TOKEN_ITERATOR_CHECK(walked_from<token_iterator>(parsed, static_cast<unsigned int>(parsed.source().size())).empty());
+}
+
+// Copies share their window, but each walks on its own, and a copy keeps the window it holds alive after the
+// original has moved on to the next one
+void copies_walk_independently() {
+    parsed_source parsed{ "copies.cpp", numbered_source(10) };
+    auto tu = parsed.tu();
+    const auto expected = tokenized_from(parsed, 0);
+
+    token_iterator it{ tu, cursor_location{ parsed.cursor() } };
+    std::vector<token_iterator> copies;
+    std::vector<std::size_t> positions;
+    for (std::size_t i = 0; it; ++it, ++i) {
+        if (i % 500 == 0) {
+            copies.push_back(it);
+            positions.push_back(i);
+        }
+    }
+    TOKEN_ITERATOR_CHECK(copies.size() > 2);
+
+    for (std::size_t c = 0; c < copies.size(); ++c) {
+        auto copy = copies[c];
+        TOKEN_ITERATOR_CHECK(lexed(tu, *copy) == expected[positions[c]]);
+
+        // Walking the copy leaves the one it was copied from where it was
+        std::vector<lexed_token> walked;
+        for (; copy; ++copy) {
+            walked.push_back(lexed(tu, *copy));
+        }
+        TOKEN_ITERATOR_CHECK(std::equal(walked.begin(), walked.end(), expected.begin() + positions[c], expected.end()));
+        TOKEN_ITERATOR_CHECK(lexed(tu, *copies[c]) == expected[positions[c]]);
+    }
+
+    // Swapping exchanges the tokens, windows and all
+    auto first = copies.front();
+    auto last = copies.back();
+    swap(first, last);
+    TOKEN_ITERATOR_CHECK(lexed(tu, *first) == expected[positions.back()] && lexed(tu, *last) == expected.front());
+}
+
+// From the last token to the first, built every way there is, against clang_tokenize() reversed
+void reverse_walk_matches_tokenize() {
+    parsed_source parsed{ "reverse.cpp", numbered_source(5) };
+    auto tu = parsed.tu();
+    auto expected = tokenized_from(parsed, 0);
+    std::reverse(expected.begin(), expected.end());
+
+    auto walked = [&](reverse_token_iterator it) {
+        std::vector<lexed_token> walked;
+        for (; it; ++it) {
+            walked.push_back(lexed(tu, *it));
+        }
+        return walked;
+    };
+
+    token_cache cache;
+    auto index = cache.get(tu, parsed.file());
+    const cursor_location last{ clang_getLocationForOffset(tu, parsed.file(), expected.front().begin_offset) };
+    TOKEN_ITERATOR_CHECK(walked(reverse_token_iterator{ index, last }) == expected);
+    TOKEN_ITERATOR_CHECK(walked(reverse_token_iterator{ cache, tu, last }) == expected);
+
+    const token_iterator forward{ tu, last };
+    TOKEN_ITERATOR_CHECK(walked(reverse_token_iterator{ forward }) == expected);
+    TOKEN_ITERATOR_CHECK(walked(reverse_token_iterator{ index, forward }) == expected);
+    TOKEN_ITERATOR_CHECK(walked(reverse_token_iterator{ cache, forward }) == expected);
+
+    // Iterators over different indices of the file are equal at the same token
+    TOKEN_ITERATOR_CHECK((reverse_token_iterator{ forward } == reverse_token_iterator{ cache, forward }));
+
+    // From the first token, the next step is the end sentinel
+    reverse_token_iterator first{ cache, tu, cursor_location{ parsed.cursor() } };
+    TOKEN_ITERATOR_CHECK(first && lexed(tu, *first) == expected.back());
+    auto past = first;
+    ++past;
+    TOKEN_ITERATOR_CHECK(!past && past == reverse_token_iterator{});
+    TOKEN_ITERATOR_CHECK(walked(first) == std::vector<lexed_token>{ expected.back() });
+
+    // operator-- walks towards the end of the file, and converting keeps the token
+    auto it = first;
+    for (std::size_t i = expected.size() - 1; i-- > 0;) {
+        --it;
+        TOKEN_ITERATOR_CHECK(lexed(tu, *it) == expected[i]);
+    }
+    TOKEN_ITERATOR_CHECK(token_iterator{ it } == forward);
+}
+
+// Random steps, differences and comparisons, against the indices of the same tokens in one clang_tokenize()
+void indexed_iterator_matches_token_indices() {
+    parsed_source parsed{ "indexed.cpp", numbered_source(3) };
+    auto tu = parsed.tu();
+    const auto expected = tokenized_from(parsed, 0);
+    const auto size = static_cast<std::ptrdiff_t>(expected.size());
+
+    token_cache cache;
+    auto index = cache.get(tu, parsed.file());
+    const auto begin = indexed_token_iterator::begin(index);
+    const auto end = indexed_token_iterator::end(index);
+    TOKEN_ITERATOR_CHECK(end - begin == size);
+    TOKEN_ITERATOR_CHECK(std::distance(begin, end) == size);
+
+    std::mt19937 random{ 5 };
+    for (int step = 0; step < 2000; ++step) {
+        const auto i = static_cast<std::ptrdiff_t>(random() % size);
+        const auto j = static_cast<std::ptrdiff_t>(random() % (size + 1));
+
+        auto it = begin;
+        it += i;
+        const auto jt = end - (size - j);
+        TOKEN_ITERATOR_CHECK(it.position() == i && jt.position() == j);
+        TOKEN_ITERATOR_CHECK(lexed(tu, *it) == expected[i]);
+        TOKEN_ITERATOR_CHECK(lexed(tu, begin[i]) == expected[i]);
+        TOKEN_ITERATOR_CHECK(lexed(tu, *(i + begin)) == expected[i]);
+        if (j < size) TOKEN_ITERATOR_CHECK(lexed(tu, it[j - i]) == expected[j]);
+
+        TOKEN_ITERATOR_CHECK(jt - it == j - i && it - jt == i - j);
+        TOKEN_ITERATOR_CHECK((it == jt) == (i == j) && (it != jt) == (i != j));
+        TOKEN_ITERATOR_CHECK((it < jt) == (i < j) && (it > jt) == (i > j));
+        TOKEN_ITERATOR_CHECK((it <= jt) == (i <= j) && (it >= jt) == (i >= j));
+
+        auto back = jt;
+        back -= j - i;
+        TOKEN_ITERATOR_CHECK(back == it);
+        auto advanced = it;
+        std::advance(advanced, j - i);
+        TOKEN_ITERATOR_CHECK(advanced == jt);
+    }
+
+    // At the token a location is in, or the first one after a location in whitespace, and at the token of a
+    // token_iterator
+    auto at = [&](unsigned int offset) {
+        return indexed_token_iterator{ cache, tu, cursor_location{ clang_getLocationForOffset(tu, parsed.file(), offset) } };
+    };
+    for (std::ptrdiff_t i = 0; i < size; i += 97) {
+        const auto offset = expected[i].begin_offset;
+        TOKEN_ITERATOR_CHECK(at(offset) - begin == i);
+        TOKEN_ITERATOR_CHECK(at(expected[i].end_offset - 1) - begin == i);
+        if (offset > 0 && parsed.source()[offset - 1] == ' ') TOKEN_ITERATOR_CHECK(at(offset - 1) - begin == i);
+
+        const token_iterator live{ tu, cursor_location{ clang_getLocationForOffset(tu, parsed.file(), offset) } };
+        TOKEN_ITERATOR_CHECK(indexed_token_iterator(index, live) - begin == i);
+    }
+    TOKEN_ITERATOR_CHECK(indexed_token_iterator(index, token_iterator{}) == end);
+
+    // Iterators over another index of the file are equal at the same token, and at the end
+    auto other = make_ref<const file_token_index>(tu, parsed.file());
+    TOKEN_ITERATOR_CHECK(indexed_token_iterator(other, 3) == begin + 3 && indexed_token_iterator(other, 3) != begin + 4);
+    TOKEN_ITERATOR_CHECK(indexed_token_iterator::end(other) == end && indexed_token_iterator::end(other) != begin);
+}
+
+// Iterators lexed separately, into different windows, are equal at the same token and ordered like the tokens
+void iterators_compare_by_token() {
+    parsed_source parsed{ "compared.cpp", numbered_source(10) };
+    auto tu = parsed.tu();
+    const auto expected = tokenized_from(parsed, 0);
+    auto at = [&](unsigned int offset) {
+        return token_iterator{ tu, cursor_location{ clang_getLocationForOffset(tu, parsed.file(), offset) } };
+    };
+
+    token_iterator walked{ tu, cursor_location{ parsed.cursor() } };
+    token_iterator previous;
+    for (std::size_t i = 0; walked; ++walked, ++i) {
+        if (i % 37 != 0) {
+            previous = walked;
+            continue;
+        }
+
+        const auto same = at(expected[i].begin_offset);
+        TOKEN_ITERATOR_CHECK(walked == same && !(walked != same));
+        TOKEN_ITERATOR_CHECK(!(walked < same) && !(same < walked));
+        if (previous) {
+            TOKEN_ITERATOR_CHECK(previous != same && previous < same && !(same < previous));
+        }
+        if (i + 1 < expected.size()) {
+            const auto next = at(expected[i + 1].begin_offset);
+            TOKEN_ITERATOR_CHECK(next != walked && walked < next);
+        }
+        TOKEN_ITERATOR_CHECK(walked != token_iterator{} && walked < token_iterator{});
+        previous = walked;
+    }
+
+    // The end sentinels of a walk and a default-constructed one are all equal
+    TOKEN_ITERATOR_CHECK(walked == token_iterator{} && !(walked < token_iterator{}));
+    TOKEN_ITERATOR_CHECK(at(static_cast<unsigned int>(parsed.source().size())) == token_iterator{});
+
+    // The same token of another TU is another token
+    parsed_source other{ "compared.cpp", parsed.source() };
+    const token_iterator other_first{ other.tu(), cursor_location{ other.cursor() } };
+    TOKEN_ITERATOR_CHECK(other_first != at(0));
+}
+
+// The children of cursor that are spelled in the main file
+std::vector<CXCursor> main_file_children(CXCursor cursor) {
+    std::vector<CXCursor> children;
+    clang_visitChildren(cursor, [](CXCursor child, CXCursor, CXClientData data) {
+        if (clang_Location_isFromMainFile(clang_getCursorLocation(child))) {
+            static_cast<std::vector<CXCursor>*>(data)->push_back(child);
+        }
+        return CXChildVisit_Continue;
+    }, &children);
+    return children;
+}
+
+// The tokens that start within range, by clang_tokenize() over it
+std::vector<lexed_token> tokenized_in(CXTranslationUnit tu, CXSourceRange range) {
+    CXToken* tokens = nullptr;
+    unsigned int num_tokens = 0;
+    clang_tokenize(tu, range, &tokens, &num_tokens);
+
+    // clang_tokenize() also returns a token that starts at (or after) the end
+    const auto end_offset = spelling_offset(clang_getRangeEnd(range));
+    std::vector<lexed_token> result;
+    for (unsigned int i = 0; i < num_tokens; ++i) {
+        auto tok = lexed(tu, tokens[i]);
+        if (tok.begin_offset >= end_offset) break;
+        result.push_back(std::move(tok));
+    }
+    clang_disposeTokens(tu, tokens, num_tokens);
+    return result;
+}
+
+// Cursor extents that begin and end mid-line, ranges that end inside a token or at one, and empty ranges,
+// against clang_tokenize() over the same range
+void ranges_match_tokenize() {
+    parsed_source parsed{ "ranges.cpp", "int x = 1; int f(int a) { return a + 1; } int y;\nstruct s {\n  int m;\n}; int z;\n" };
+    auto tu = parsed.tu();
+    token_cache cache;
+    auto index = cache.get(tu, parsed.file());
+
+    auto matches = [&](const token_range &live, const indexed_token_range &indexed, const std::vector<lexed_token> &expected) {
+        std::vector<lexed_token> walked;
+        for (const auto &tok : live) {
+            walked.push_back(lexed(tu, tok));
+        }
+        std::vector<lexed_token> walked_indexed;
+        for (const auto &tok : indexed) {
+            walked_indexed.push_back(lexed(tu, tok));
+        }
+        std::vector<lexed_token> subscripted;
+        for (std::size_t i = 0; i < indexed.size(); ++i) {
+            subscripted.push_back(lexed(tu, indexed[i]));
+        }
+        return live.size() == expected.size() && live.empty() == expected.empty() && walked == expected &&
+               indexed.size() == expected.size() && indexed.empty() == expected.empty() &&
+               walked_indexed == expected && subscripted == expected;
+    };
+
+    const auto cursors = main_file_children(parsed.cursor());
+    TOKEN_ITERATOR_CHECK(cursors.size() == 5);
+    for (const auto &cursor : cursors) {
+        const auto expected = tokenized_in(tu, clang_getCursorExtent(cursor));
+        TOKEN_ITERATOR_CHECK(!expected.empty());
+        TOKEN_ITERATOR_CHECK(matches(token_range{ tu, cursor }, indexed_token_range{ cache, tu, cursor }, expected));
+    }
+
+    const auto &source = parsed.source();
+    auto range = [&](std::size_t begin, std::size_t end) {
+        return clang_getRange(clang_getLocationForOffset(tu, parsed.file(), static_cast<unsigned int>(begin)),
+                              clang_getLocationForOffset(tu, parsed.file(), static_cast<unsigned int>(end)));
+    };
+    const auto function = source.find("int f");
+    const auto ret = source.find("return");
+    const std::pair<std::size_t, std::size_t> ranges[] = {
+        { function, ret + 3 },                              // Ends inside "return"
+        { function, ret },                                  // Ends at "return"
+        { function, ret - 1 },                              // Ends in whitespace
+        { source.find("y;"), source.find("m;") + 1 },       // Across lines
+        { 0, source.size() },                               // The whole file
+        { ret - 1, ret - 1 }, { ret, ret }, { ret + 3, ret + 3 }, { source.size(), source.size() } };
+    for (const auto &r : ranges) {
+        const auto extent = range(r.first, r.second);
+        const auto expected = tokenized_in(tu, extent);
+        TOKEN_ITERATOR_CHECK(expected.empty() == (r.first == r.second));
+        if (!matches(token_range{ tu, extent }, indexed_token_range{ index, extent }, expected)) {
+            std::printf("range [%zu, %zu) does not match clang_tokenize()\n", r.first, r.second);
+            TOKEN_ITERATOR_CHECK(false);
+        }
+    }
+}
+
+// The locations an iterator decodes once per window, against clang_getTokenExtent() of the token it refers to.
+// Forward through whole windows, and backward through the tokens operator-- lexes a few at a time.
+void cached_locations_match_token_extents() {
+    parsed_source parsed{ "extents.cpp", "/* c */ int a = 1; // d\n" + numbered_source(1) + "const char* s = \"x\" R\"(y\n)\";\n" };
+    auto tu = parsed.tu();
+    const auto expected = tokenized_from(parsed, 0);
+
+    auto matches_extent = [&](const token_iterator &it, std::size_t i) {
+        const auto view = it.view();
+        const auto tok = lexed(tu, *it);
+        return tok == expected[i] && view.kind == tok.kind && clang_File_isEqual(view.file, parsed.file()) &&
+               view.begin_offset == tok.begin_offset && view.end_offset == tok.end_offset;
+    };
+
+    std::size_t i = 0;
+    token_iterator last;
+    for (token_iterator it{ tu, cursor_location{ parsed.cursor() } }; it; ++it, ++i) {
+        TOKEN_ITERATOR_CHECK(i < expected.size() && matches_extent(it, i));
+        last = it;
+    }
+    TOKEN_ITERATOR_CHECK(i == expected.size());
+
+    // From an iterator of its own, so that no window of the forward walk is reused
+    token_iterator it{ tu, cursor_location{ clang_getLocationForOffset(tu, parsed.file(), expected.back().begin_offset) } };
+    TOKEN_ITERATOR_CHECK(it == last);
+    for (i = expected.size(); it && i > 0; --it) {
+        --i;
+        TOKEN_ITERATOR_CHECK(matches_extent(it, i));
+    }
+    TOKEN_ITERATOR_CHECK(!it && i == 0);
+}
+
+// line() and column() of every iterator against clang_getSpellingLocation(), over "\n", "\r\n" and lone "\r" line
+// endings, tabs (a column is a byte), and line continuations ending either way, inside and between tokens
+void lines_match_spelling_locations() {
+    std::string source = "int a;\nint\tb;\r\nint c;\rint d;\n\tint\t\te = 1 +\\\n2;\r\n";
+    source += "int f\\\r\ng = 3; const char* s = \"x\\\ry\";\r\r\n\n";
+    source += numbered_source(1);
+    source += "#define M(x) \\\r\n  (x)\t// \\\n  comment\rint h = M(4);\n\t\t}";
+    parsed_source parsed{ "lines.cpp", source };
+    auto tu = parsed.tu();
+
+    std::vector<std::pair<unsigned int, unsigned int>> expected;
+    {
+        auto file = parsed.file();
+        auto range = clang_getRange(clang_getLocationForOffset(tu, file, 0),
+                                    clang_getLocationForOffset(tu, file, static_cast<unsigned int>(source.size())));
+        CXToken* tokens = nullptr;
+        unsigned int num_tokens = 0;
+        clang_tokenize(tu, range, &tokens, &num_tokens);
+        for (unsigned int i = 0; i < num_tokens; ++i) {
+            unsigned int line = 0;
+            unsigned int column = 0;
+            clang_getSpellingLocation(clang_getTokenLocation(tu, tokens[i]), nullptr, &line, &column, nullptr);
+            expected.emplace_back(line, column);
+        }
+        clang_disposeTokens(tu, tokens, num_tokens);
+    }
+    TOKEN_ITERATOR_CHECK(expected.size() > 1000 && expected.back().first > 200);
+
+    std::vector<std::pair<unsigned int, unsigned int>> walked;
+    token_iterator last;
+    for (token_iterator it{ tu, cursor_location{ parsed.cursor() } }; it; ++it) {
+        walked.emplace_back(it.line(), it.column());
+        last = it;
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    walked.clear();
+    for (auto it = last; it; --it) {
+        walked.emplace_back(it.line(), it.column());
+    }
+    std::reverse(walked.begin(), walked.end());
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    token_cache cache;
+    auto index = cache.get(tu, parsed.file());
+    walked.clear();
+    for (auto it = indexed_token_iterator::begin(index), end = indexed_token_iterator::end(index); it != end; ++it) {
+        walked.emplace_back(it.line(), it.column());
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    walked.clear();
+    for (auto it = token_view_iterator::begin(index), end = token_view_iterator::end(index); it != end; ++it) {
+        walked.emplace_back(it.line(), it.column());
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected);
+}
+
+// The storage of a released window goes to the next window made on the thread that released it, even if another
+// thread made it. Windows released during thread exit, once the pool of the thread is gone, go to the heap.
+void windows_recycle_through_pool() {
+    parsed_source parsed{ "pooled.cpp", "int a;\n" };
+    auto tu = parsed.tu();
+
+    auto window = make_ref<const token_window>(tu, nullptr, 0u);
+    const void* storage = window.get();
+    window = {};
+    window = make_ref<const token_window>(tu, nullptr, 0u);
+    TOKEN_ITERATOR_CHECK(window.get() == storage);
+
+    std::vector<unsigned int> offsets;
+    offsets.reserve(100);
+    const auto* offsets_storage = offsets.data();
+    token_window_pool::local()->give_back(std::move(offsets));
+    auto taken = token_window_pool::local()->take_offsets();
+    TOKEN_ITERATOR_CHECK(taken.empty() && taken.data() == offsets_storage);
+
+    ref_ptr<const token_window> foreign;
+    std::thread{ [&] { foreign = make_ref<const token_window>(tu, nullptr, 0u); } }.join();
+    const void* foreign_storage = foreign.get();
+    foreign = {};
+    window = make_ref<const token_window>(tu, nullptr, 0u);
+    TOKEN_ITERATOR_CHECK(window.get() == foreign_storage);
+
+    std::atomic<bool> released_without_pool{ false };
+    std::thread{ [&] {
+        struct late_window {
+            ref_ptr<const token_window> window;
+            std::atomic<bool>* released_without_pool = nullptr;
+
+            ~late_window() {
+                *released_without_pool = token_window_pool::local() == nullptr;
+                window = {};
+            }
+        };
+
+        // Constructed before the pool of the thread, so destroyed after it
+        static thread_local late_window late;
+        late.released_without_pool = &released_without_pool;
+        late.window = make_ref<const token_window>(tu, nullptr, 0u);
+    } }.join();
+    TOKEN_ITERATOR_CHECK(released_without_pool);
+}
+
+// A source with comments, literals and a line splice inside a string, but none inside an identifier or a keyword,
+// whose spellings clang_getTokenSpelling() gives with the splice removed rather than as written
+std::string spelled_source() {
+    return "/* c */ int a = 1; // d\n" + numbered_source(1) +
+           "const char* s = \"x\\\ny\" R\"(z\n)\" u8\"w\";\nchar c = '\\'' ;\n";
+}
+
+lexed_token lexed(const token_view &view) {
+    return lexed_token{ view.kind, view.begin_offset, view.end_offset, std::string{ view.spelling } };
+}
+
+// The views of token_view_iterator both ways, and of token_iterator::view(), against what libclang reports
+void views_match_tokenize() {
+    static_assert(std::is_trivially_copyable<token_view>::value, "token_view is copied around by value");
+
+    parsed_source parsed{ "views.cpp", spelled_source() };
+    auto tu = parsed.tu();
+    const auto expected = tokenized_from(parsed, 0);
+
+    token_cache cache;
+    auto index = cache.get(tu, parsed.file());
+    std::vector<lexed_token> walked;
+    bool same_file = true;
+    for (auto it = token_view_iterator::begin(index), end = token_view_iterator::end(index); it != end; ++it) {
+        const token_view view = *it;
+        walked.push_back(lexed(view));
+        same_file = same_file && clang_File_isEqual(view.file, parsed.file());
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected && same_file);
+
+    walked.clear();
+    for (auto it = reverse_token_view_iterator::begin(index), end = reverse_token_view_iterator::end(index); it != end; ++it) {
+        walked.push_back(lexed(*it));
+    }
+    std::reverse(walked.begin(), walked.end());
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    walked.clear();
+    for (token_iterator it{ tu, cursor_location{ parsed.cursor() } }; it; ++it) {
+        walked.push_back(lexed(it.view()));
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    // Random access views the same tokens
+    const auto begin = token_view_iterator::begin(index);
+    for (std::size_t i = 0; i < expected.size(); i += 53) {
+        TOKEN_ITERATOR_CHECK(lexed(begin[static_cast<std::ptrdiff_t>(i)]) == expected[i]);
+    }
+}
+
+// spelling() against clang_getTokenSpelling(), both ways, and the spellings of a cached index
+void spellings_match_get_token_spelling() {
+    parsed_source parsed{ "spelled.cpp", spelled_source() };
+    auto tu = parsed.tu();
+    std::vector<std::string> expected;
+    for (const auto &tok : tokenized_from(parsed, 0)) {
+        expected.push_back(tok.spelling);
+    }
+
+    std::vector<std::string> walked;
+    token_iterator last;
+    for (token_iterator it{ tu, cursor_location{ parsed.cursor() } }; it; ++it) {
+        walked.push_back(std::string{ it.spelling() });
+        last = it;
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    walked.clear();
+    for (; last; --last) {
+        walked.push_back(std::string{ last.spelling() });
+    }
+    std::reverse(walked.begin(), walked.end());
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    token_cache cache;
+    auto index = cache.get(tu, parsed.file());
+    walked.clear();
+    for (unsigned int i = 0; i < index->size(); ++i) {
+        walked.push_back(std::string{ index->spelling(i) });
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    // An identifier split by a line continuation is spelled as written
+    parsed_source spliced{ "spliced_identifier.cpp", "int ab\\\ncd = 1;\n" };
+    token_iterator it{ spliced.tu(), cursor_location{ spliced.cursor() } };
+    ++it;
+    TOKEN_ITERATOR_CHECK(it.spelling() == "ab\\\ncd");
+}
+
+// A filtered walk over index both ways, against the tokens of expected whose kind is in KindMask
+template <unsigned int KindMask>
+bool filtered_walks_match(CXTranslationUnit tu, const ref_ptr<const file_token_index> &index,
+                          const std::vector<lexed_token> &expected) {
+    std::vector<lexed_token> matching;
+    std::copy_if(expected.begin(), expected.end(), std::back_inserter(matching),
+                 [](const lexed_token &tok) { return (kind_bit(tok.kind) & KindMask) != 0; });
+
+    using iterator = filtered_token_iterator<KindMask>;
+    std::vector<lexed_token> forward;
+    for (auto it = iterator::begin(index), end = iterator::end(index); it != end; ++it) {
+        forward.push_back(lexed(tu, *it));
+    }
+
+    std::vector<lexed_token> backward;
+    for (auto it = iterator::end(index), begin = iterator::begin(index); it != begin;) {
+        --it;
+        backward.push_back(lexed(tu, *it));
+    }
+    std::reverse(backward.begin(), backward.end());
+    return forward == matching && backward == matching;
+}
+
+// Filtered walks against clang_tokenize() filtered by kind
+void filtered_walks_match_tokenize() {
+    parsed_source parsed{ "filtered.cpp", spelled_source() };
+    auto tu = parsed.tu();
+    const auto expected = tokenized_from(parsed, 0);
+
+    token_cache cache;
+    auto index = cache.get(tu, parsed.file());
+    TOKEN_ITERATOR_CHECK((filtered_walks_match<kind_bit(CXToken_Identifier) | kind_bit(CXToken_Keyword)>(tu, index, expected)));
+    TOKEN_ITERATOR_CHECK(filtered_walks_match<kind_bit(CXToken_Identifier)>(tu, index, expected));
+    TOKEN_ITERATOR_CHECK(filtered_walks_match<kind_bit(CXToken_Comment)>(tu, index, expected));
+    TOKEN_ITERATOR_CHECK((filtered_walks_match<kind_bit(CXToken_Literal) | kind_bit(CXToken_Punctuation)>(tu, index, expected)));
+
+    // From a location, at the first identifier or keyword at or after it
+    for (std::size_t i = 0; i < expected.size(); i += 11) {
+        auto next = std::find_if(expected.begin() + static_cast<std::ptrdiff_t>(i), expected.end(), [](const lexed_token &tok) {
+            return tok.kind == CXToken_Identifier || tok.kind == CXToken_Keyword;
+        });
+        const cursor_location loc{ clang_getLocationForOffset(tu, parsed.file(), expected[i].begin_offset) };
+        identifier_token_iterator it{ cache, tu, loc };
+        if (next == expected.end()) TOKEN_ITERATOR_CHECK(it == identifier_token_iterator::end(index));
+        else TOKEN_ITERATOR_CHECK(lexed(tu, *it) == *next);
+    }
+}
+
+// extract_tokens() against clang_tokenize() over the same extent, and with lines, against the lines and columns
+// of clang_getSpellingLocation(). The same token_soa is reused throughout.
+void extracted_tokens_match_tokenize() {
+    parsed_source parsed{ "extracted.cpp", spelled_source() + "int f(int a) {\r\n\treturn a; }\rint g;\n" };
+    auto tu = parsed.tu();
+    token_soa soa;
+
+    auto matches = [&](const std::vector<lexed_token> &expected, bool with_lines) {
+        if (soa.size() != expected.size() || soa.begin_offsets.size() != expected.size() ||
+            soa.end_offsets.size() != expected.size()) {
+            return false;
+        }
+        if (!with_lines) return soa.lines.empty() && soa.columns.empty();
+        if (soa.lines.size() != expected.size() || soa.columns.size() != expected.size()) return false;
+        if (!expected.empty() && !clang_File_isEqual(soa.file, parsed.file())) return false;
+
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+            unsigned int line = 0;
+            unsigned int column = 0;
+            clang_getSpellingLocation(clang_getLocationForOffset(tu, parsed.file(), expected[i].begin_offset),
+                                      nullptr, &line, &column, nullptr);
+            if (soa.kinds[i] != expected[i].kind || soa.begin_offsets[i] != expected[i].begin_offset ||
+                soa.end_offsets[i] != expected[i].end_offset || soa.lines[i] != line || soa.columns[i] != column) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    const auto whole_file = clang_getRange(clang_getLocationForOffset(tu, parsed.file(), 0),
+                                           clang_getLocationForOffset(tu, parsed.file(), static_cast<unsigned int>(parsed.source().size())));
+    for (bool with_lines : { false, true }) {
+        extract_tokens(tu, whole_file, soa, with_lines);
+        TOKEN_ITERATOR_CHECK(matches(tokenized_in(tu, whole_file), with_lines));
+    }
+
+    // Smaller extents reuse the capacity
+    const auto capacity = soa.kinds.capacity();
+    for (const auto &cursor : main_file_children(parsed.cursor())) {
+        for (bool with_lines : { true, false }) {
+            extract_tokens(tu, cursor, soa, with_lines);
+            TOKEN_ITERATOR_CHECK(matches(tokenized_in(tu, clang_getCursorExtent(cursor)), with_lines));
+            TOKEN_ITERATOR_CHECK(soa.kinds.capacity() == capacity);
+        }
+    }
+
+    const auto empty = clang_getRange(clang_getLocationForOffset(tu, parsed.file(), 3), clang_getLocationForOffset(tu, parsed.file(), 3));
+    extract_tokens(tu, empty, soa, true);
+    TOKEN_ITERATOR_CHECK(soa.empty() && matches({}, true));
+}
+
+// The MacroExpansion cursors of a detailed preprocessing record against macro_expansion_map, token by token, and
+// expansion_token_iterator's steps against them. Cursors produced by an expansion, nested ones included, land on
+// the outermost expansion their clang_getExpansionLocation() is in.
+void expansions_match_preprocessing_record() {
+    parsed_source parsed{ "expanded.cpp",
+                          "#define ZERO 0\n"
+                          "#define ID(x) x\n"
+                          "#define ADD(a, b) ((a) + (b))\n"
+                          "int a = ZERO;\n"
+                          "int b = ID(1);\n"
+                          "int c = ADD(ID(2),\n"
+                          "            ZERO);\n"
+                          "int d = 3;\n",
+                          {}, CXTranslationUnit_DetailedPreprocessingRecord };
+    auto tu = parsed.tu();
+    const auto tokens = tokenized_from(parsed, 0);
+
+    // The token ranges [first, past) of the expansions libclang reports, of which the outermost are kept
+    std::vector<std::pair<std::size_t, std::size_t>> reported;
+    for (const auto &cursor : main_file_children(parsed.cursor())) {
+        if (clang_getCursorKind(cursor) != CXCursor_MacroExpansion) continue;
+        const auto expanded = tokenized_in(tu, clang_getCursorExtent(cursor));
+        const auto first = static_cast<std::size_t>(std::find(tokens.begin(), tokens.end(), expanded.front()) - tokens.begin());
+        reported.emplace_back(first, first + expanded.size());
+    }
+    std::sort(reported.begin(), reported.end(), [](const auto &lhs, const auto &rhs) {
+        return lhs.first != rhs.first ? lhs.first < rhs.first : lhs.second > rhs.second;
+    });
+
+    std::vector<std::size_t> first_of(tokens.size());
+    std::vector<std::size_t> past_of(tokens.size());
+    std::vector<bool> expanded(tokens.size());
+    for (std::size_t i = 0; i < tokens.size(); ++i) {
+        first_of[i] = i;
+        past_of[i] = i + 1;
+    }
+    std::size_t num_outermost = 0;
+    std::size_t covered = 0;
+    for (const auto &range : reported) {
+        if (range.first < covered) continue;
+        covered = range.second;
+        ++num_outermost;
+        for (auto i = range.first; i < range.second; ++i) {
+            first_of[i] = range.first;
+            past_of[i] = range.second;
+            expanded[i] = true;
+        }
+    }
+    TOKEN_ITERATOR_CHECK(reported.size() == 5 && num_outermost == 3);
+
+    token_cache cache;
+    auto map = cache.expansions(tu, parsed.file());
+    TOKEN_ITERATOR_CHECK(map->size() == tokens.size() && map->num_expansions() == num_outermost);
+    for (unsigned int i = 0; i < map->size() && i < tokens.size(); ++i) {
+        if (map->first(i) != first_of[i] || map->past(i) != past_of[i] || map->in_expansion(i) != expanded[i] ||
+            map->expansion_begin_offset(i) != tokens[first_of[i]].begin_offset ||
+            map->expansion_end_offset(i) != tokens[past_of[i] - 1].end_offset) {
+            std::printf("token %u (%s) is not in the expansion libclang reports\n", i, tokens[i].spelling.c_str());
+            TOKEN_ITERATOR_CHECK(false);
+        }
+    }
+
+    // One step per expansion, or per token outside of one, both ways
+    std::vector<std::size_t> expected_steps;
+    for (std::size_t i = 0; i < tokens.size(); i = past_of[i]) {
+        expected_steps.push_back(i);
+    }
+
+    std::vector<std::size_t> steps;
+    for (auto it = expansion_token_iterator::begin(map), end = expansion_token_iterator::end(map); it != end; ++it) {
+        const auto pos = it.position();
+        steps.push_back(pos);
+        TOKEN_ITERATOR_CHECK(lexed(tu, *it) == tokens[pos] && it.in_expansion() == expanded[pos]);
+        TOKEN_ITERATOR_CHECK(it.expansion_begin().position() == first_of[pos] && it.expansion_end().position() == past_of[pos]);
+    }
+    TOKEN_ITERATOR_CHECK(steps == expected_steps);
+
+    steps.clear();
+    for (auto it = expansion_token_iterator::end(map), begin = expansion_token_iterator::begin(map); it != begin;) {
+        --it;
+        steps.push_back(it.position());
+    }
+    std::reverse(steps.begin(), steps.end());
+    TOKEN_ITERATOR_CHECK(steps == expected_steps);
+
+    // The literals, four of which come from expansions
+    std::vector<CXCursor> literals;
+    clang_visitChildren(parsed.cursor(), [](CXCursor cursor, CXCursor, CXClientData data) {
+        if (clang_getCursorKind(cursor) == CXCursor_IntegerLiteral) static_cast<std::vector<CXCursor>*>(data)->push_back(cursor);
+        return CXChildVisit_Recurse;
+    }, &literals);
+    TOKEN_ITERATOR_CHECK(literals.size() == 5);
+
+    for (const auto &literal : literals) {
+        unsigned int offset = 0;
+        clang_getExpansionLocation(clang_getRangeStart(clang_getCursorExtent(literal)), nullptr, nullptr, nullptr, &offset);
+        auto at = std::find_if(tokens.begin(), tokens.end(), [&](const lexed_token &tok) { return offset < tok.end_offset; });
+        TOKEN_ITERATOR_CHECK(at != tokens.end() && at->begin_offset <= offset);
+        if (at == tokens.end()) continue;
+
+        const expansion_token_iterator it{ cache, tu, cursor_location{ literal } };
+        TOKEN_ITERATOR_CHECK(it.position() == first_of[static_cast<std::size_t>(at - tokens.begin())]);
+    }
+}
+
+void parallel_for_each_token_matches_serial_walk() {
+    std::vector<std::unique_ptr<parsed_source>> sources;
+    std::vector<CXTranslationUnit> tus;
+    for (int n = 0; n < 8; ++n) {
+        sources.push_back(std::make_unique<parsed_source>("tu" + std::to_string(n) + ".cpp", numbered_source(n)));
+        tus.push_back(sources.back()->tu());
+    }
+
+    // One slot per TU, so that workers never write to the same one
+    std::map<CXTranslationUnit, std::vector<std::string>> walked;
+    for (auto tu : tus) {
+        walked[tu];
+    }
+
+    parallel_for_each_token(gsl::make_span(tus), [&](CXTranslationUnit tu, const CXToken &tok) {
+        walked.at(tu).push_back(spelling_of(tu, tok));
+    }, 4);
+
+    for (const auto &source : sources) {
+        TOKEN_ITERATOR_CHECK(walked.at(source->tu()) == serial_spellings(*source));
+    }
+
+    // The same, parsing the sources on the workers
+    std::vector<translation_unit_source> unparsed;
+    for (const auto &source : sources) {
+        translation_unit_source tu_source;
+        tu_source.file_name = source->file_name();
+        tu_source.args = { "-xc++", "-std=c++17" };
+        tu_source.unsaved_files.push_back({ source->file_name().c_str(), source->source().c_str(),
+                                            static_cast<unsigned long>(source->source().size()) });
+        unparsed.push_back(std::move(tu_source));
+    }
+
+    std::mutex mutex;
+    std::map<std::string, std::vector<std::string>> parsed_walked;
+    auto failed = parallel_for_each_token(gsl::make_span(unparsed), [&](CXTranslationUnit tu, const CXToken &tok) {
+        auto name = file_name_of(tu, tok);
+        auto spelling = spelling_of(tu, tok);
+        std::lock_guard<std::mutex> lock{ mutex };
+        parsed_walked[name].push_back(std::move(spelling));
+    }, 4);
+
+    TOKEN_ITERATOR_CHECK(failed == 0);
+    for (const auto &source : sources) {
+        TOKEN_ITERATOR_CHECK(parsed_walked[source->file_name()] == serial_spellings(*source));
+    }
+
+    // An exception from fn ends the walk and is rethrown, with the workers' cached tokens released on the workers
+    bool thrown = false;
+    try {
+        parallel_for_each_token(gsl::make_span(tus), [](CXTranslationUnit, const CXToken &) {
+            throw std::runtime_error{ "fn" };
+        }, 4);
+    }
+    catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    TOKEN_ITERATOR_CHECK(thrown);
+    TOKEN_ITERATOR_CHECK(serial_spellings(*sources.front()) == walked.at(sources.front()->tu()));
+}
+
+void parallel_for_each_job_rethrows() {
+    bool thrown = false;
+    try {
+        parallel_for_each_job(1000, 4, [&](std::size_t, std::size_t job) {
+            if (job == 10) throw std::runtime_error{ "job 10" };
+        });
+    }
+    catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    TOKEN_ITERATOR_CHECK(thrown);
+
+    // Every job runs exactly once
+    std::vector<std::atomic<int>> runs(1000);
+    parallel_for_each_job(runs.size(), 4, [&](std::size_t, std::size_t job) { ++runs[job]; });
+    TOKEN_ITERATOR_CHECK(std::all_of(runs.begin(), runs.end(), [](const std::atomic<int> &n) { return n == 1; }));
+}
+
+bool same_tokens(const file_token_index &lhs, const file_token_index &rhs) {
+    const auto &l = *lhs.table();
+    const auto &r = *rhs.table();
+    return l.size() == r.size() &&
+           std::equal(l.begin_offsets().begin(), l.begin_offsets().end(), r.begin_offsets().begin()) &&
+           std::equal(l.end_offsets().begin(), l.end_offsets().end(), r.end_offsets().begin()) &&
+           std::equal(l.kinds().begin(), l.kinds().end(), r.kinds().begin());
+}
+
+void lex_parallel_matches_serial_lex() {
+    // Several chunks' worth, with comments, literals and continued lines around the split points
+    std::string source;
+    for (int i = 0; source.size() < 3 * 1024 * 1024; ++i) {
+        source += "/* block " + std::to_string(i) + "\n spanning lines */ const char* s" + std::to_string(i) +
+                  " = \"a \\\" b\" R\"(raw\n)\"; // trailing \\\n   continued\n";
+    }
+
+    parsed_source tu{ "big.cpp", source };
+    parsed_source replica1{ "big.cpp", source };
+    parsed_source replica2{ "big.cpp", source };
+    parsed_source other_name{ "other.cpp", source };
+    parsed_source other_contents{ "big.cpp", source + "int x;\n" };
+
+    auto serial = make_ref<const file_token_index>(tu.tu(), tu.file());
+    TOKEN_ITERATOR_CHECK(serial->size() > 0);
+
+    const std::vector<CXTranslationUnit> replicas{ replica1.tu(), replica2.tu() };
+    auto parallel = make_ref<const file_token_index>(tu.tu(), tu.file(), gsl::make_span(replicas));
+    TOKEN_ITERATOR_CHECK(same_tokens(*parallel, *serial));
+
+    // The CXTokens, lexed on first use, agree with the table
+    TOKEN_ITERATOR_CHECK(parallel->tokens()->size() == parallel->size());
+
+    // Replicas without the file, or with other contents, are left out
+    const std::vector<CXTranslationUnit> mismatched{ other_name.tu(), other_contents.tu(), replica1.tu() };
+    auto fallback = make_ref<const file_token_index>(tu.tu(), tu.file(), gsl::make_span(mismatched));
+    TOKEN_ITERATOR_CHECK(same_tokens(*fallback, *serial));
+
+    const std::vector<CXTranslationUnit> unusable{ other_name.tu(), other_contents.tu() };
+    auto serial_fallback = make_ref<const file_token_index>(tu.tu(), tu.file(), gsl::make_span(unusable));
+    TOKEN_ITERATOR_CHECK(same_tokens(*serial_fallback, *serial));
+
+    // Objective-C, split between "@" and the keyword after it, which is only a keyword when lexed after the "@".
+    // Nearly every split point lands in a comment, and so on the line break that follows it.
+    std::string objc;
+    for (int i = 0; objc.size() < 3 * 1024 * 1024; ++i) {
+        objc += "/* " + std::string(1000, '-') + " */ @\nclass C" + std::to_string(i) + ";\n";
+    }
+    const std::vector<std::string> objc_arguments{ "-xobjective-c" };
+    parsed_source objc_tu{ "big.m", objc, {}, CXTranslationUnit_None, objc_arguments };
+    parsed_source objc_replica1{ "big.m", objc, {}, CXTranslationUnit_None, objc_arguments };
+    parsed_source objc_replica2{ "big.m", objc, {}, CXTranslationUnit_None, objc_arguments };
+
+    auto objc_serial = make_ref<const file_token_index>(objc_tu.tu(), objc_tu.file());
+    TOKEN_ITERATOR_CHECK(objc_serial->size() > 2 && objc_serial->kind(2) == CXToken_Keyword);
+
+    const std::vector<CXTranslationUnit> objc_replicas{ objc_replica1.tu(), objc_replica2.tu() };
+    auto objc_parallel = make_ref<const file_token_index>(objc_tu.tu(), objc_tu.file(), gsl::make_span(objc_replicas));
+    TOKEN_ITERATOR_CHECK(same_tokens(*objc_parallel, *objc_serial));
+}
+
+// A directory of its own under the system's temporary directory, removed with everything in it with the object
+class temp_directory {
+    std::filesystem::path m_path;
+
+public:
+    temp_directory() {
+        std::random_device random;
+        m_path = std::filesystem::temp_directory_path() / ("token_iterator_test." + std::to_string(random()));
+        std::filesystem::create_directories(m_path);
+    }
+
+    temp_directory(const temp_directory&) = delete;
+    temp_directory &operator=(const temp_directory&) = delete;
+
+    ~temp_directory() {
+        std::error_code error;
+        std::filesystem::remove_all(m_path, error);
+    }
+
+    const std::filesystem::path &path() const noexcept { return m_path; }
+
+    // The files in it
+    std::vector<std::filesystem::path> files() const {
+        std::vector<std::filesystem::path> files;
+        for (const auto &entry : std::filesystem::directory_iterator{ m_path }) {
+            files.push_back(entry.path());
+        }
+        return files;
+    }
+};
+
+std::string_view contents_of(const parsed_source &source) {
+    std::size_t size = 0;
+    const char* buffer = clang_getFileContents(source.tu(), source.file(), &size);
+    return { buffer, size };
+}
+
+// Overwrites the bytes of the file at path from offset on
+void overwrite(const std::filesystem::path &path, long offset, const void* data, std::size_t size) {
+    std::FILE* f = std::fopen(path.string().c_str(), "r+b");
+    TOKEN_ITERATOR_CHECK(f);
+    if (!f) return;
+    TOKEN_ITERATOR_CHECK(std::fseek(f, offset, SEEK_SET) == 0 && std::fwrite(data, 1, size, f) == size);
+    std::fclose(f);
+}
+
+// The spellings of every token of index, in order
+std::vector<std::string> indexed_spellings(CXTranslationUnit tu, const ref_ptr<const file_token_index> &index) {
+    std::vector<std::string> spellings;
+    for (auto it = indexed_token_iterator::begin(index), end = indexed_token_iterator::end(index); it != end; ++it) {
+        spellings.push_back(spelling_of(tu, *it));
+    }
+    return spellings;
+}
+
+void store_round_trips() {
+    parsed_source parsed{ "stored.cpp", numbered_source(5) };
+    auto tu = parsed.tu();
+    const auto contents = contents_of(parsed);
+
+    temp_directory directory;
+    token_index_store store{ directory.path().string(), "-xc++ -std=c++17" };
+    TOKEN_ITERATOR_CHECK(!store.load(contents));
+
+    // A stored table walks the same tokens as a fresh lex
+    auto fresh = make_ref<const file_token_index>(tu, parsed.file());
+    TOKEN_ITERATOR_CHECK(store.save(contents, *fresh->table()));
+    TOKEN_ITERATOR_CHECK(directory.files().size() == 1);
+
+    auto table = store.load(contents);
+    TOKEN_ITERATOR_CHECK(table);
+    if (!table) return;
+    auto loaded = make_ref<const file_token_index>(tu, parsed.file(), std::move(table));
+    TOKEN_ITERATOR_CHECK(same_tokens(*loaded, *fresh));
+    TOKEN_ITERATOR_CHECK(indexed_spellings(tu, loaded) == serial_spellings(parsed));
+
+    // Other contents, even of the same size, have no table
+    std::string changed{ contents };
+    changed[changed.find("f0")] = 'g';
+    TOKEN_ITERATOR_CHECK(!store.load(changed));
+    TOKEN_ITERATOR_CHECK(!store.load(std::string{ contents } + "int x;\n"));
+
+    // A table with another salt is not found either
+    token_index_store other_salt{ directory.path().string(), "-xc" };
+    TOKEN_ITERATOR_CHECK(!other_salt.load(contents));
+}
+
+void store_rejects_damaged_files() {
+    parsed_source parsed{ "damaged.cpp", numbered_source(2) };
+    const auto contents = contents_of(parsed);
+    auto fresh = make_ref<const file_token_index>(parsed.tu(), parsed.file());
+
+    temp_directory directory;
+    token_index_store store{ directory.path().string() };
+    auto save = [&] {
+        TOKEN_ITERATOR_CHECK(store.save(contents, *fresh->table()));
+        TOKEN_ITERATOR_CHECK(store.load(contents));
+        return directory.files().front();
+    };
+
+    // Truncated, by a byte and down to part of the header
+    auto path = save();
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+    TOKEN_ITERATOR_CHECK(!store.load(contents));
+    std::filesystem::resize_file(path, 12);
+    TOKEN_ITERATOR_CHECK(!store.load(contents));
+
+    // Wrong magic
+    path = save();
+    overwrite(path, 0, "X", 1);
+    TOKEN_ITERATOR_CHECK(!store.load(contents));
+
+    // Wrong version, which follows the 8 bytes of magic
+    path = save();
+    const std::uint32_t version = 2;
+    overwrite(path, 8, &version, sizeof(version));
+    TOKEN_ITERATOR_CHECK(!store.load(contents));
+
+    // Offsets past the end of the file (the last end offset is just before the kinds)
+    path = save();
+    const auto size = std::filesystem::file_size(path);
+    const auto bad_offset = static_cast<unsigned int>(contents.size() + 1);
+    overwrite(path, static_cast<long>(size - fresh->size() - sizeof(unsigned int)), &bad_offset, sizeof(bad_offset));
+    TOKEN_ITERATOR_CHECK(!store.load(contents));
+}
+
+void cache_warm_starts_from_store() {
+    parsed_source parsed{ "warm.cpp", numbered_source(4) };
+    auto tu = parsed.tu();
+    const auto expected = serial_spellings(parsed);
+
+    temp_directory directory;
+    token_index_store store{ directory.path().string() };
+
+    // A cold cache lexes the file and saves its table
+    {
+        token_cache cold{ token_cache::default_max_bytes, &store };
+        auto index = cold.get(tu, parsed.file());
+        TOKEN_ITERATOR_CHECK(index->has_tokens());
+        TOKEN_ITERATOR_CHECK(directory.files().size() == 1);
+    }
+
+    // A warm one loads the table, and only lexes the CXTokens when they are first used
+    token_cache warm{ token_cache::default_max_bytes, &store };
+    auto index = warm.get(tu, parsed.file());
+    TOKEN_ITERATOR_CHECK(!index->has_tokens());
+
+    std::vector<std::string> walked;
+    for (token_iterator it{ warm, tu, cursor_location{ parsed.cursor() } }; it; ++it) {
+        walked.push_back(spelling_of(tu, *it));
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected);
+    TOKEN_ITERATOR_CHECK(!index->has_tokens());
+
+    TOKEN_ITERATOR_CHECK(index->tokens()->size() == index->size());
+    TOKEN_ITERATOR_CHECK(index->has_tokens());
+    TOKEN_ITERATOR_CHECK(indexed_spellings(tu, index) == expected);
+}
+
+template <typename Fn>
+bool throws_stale(Fn &&fn) {
+    try {
+        fn();
+    }
+    catch (const stale_token_error &) {
+        return true;
+    }
+    return false;
+}
+
+void stale_iterators_throw() {
+    std::string source = numbered_source(20);
+    parsed_source parsed{ "edited.cpp", source };
+    auto tu = parsed.tu();
+
+    token_cache cache;
+    token_iterator it{ cache, tu, cursor_location{ parsed.cursor() } };
+    auto view_it = token_view_iterator::begin(cache.get(tu, parsed.file()));
+    auto index = cache.get(tu, parsed.file());
+    TOKEN_ITERATOR_CHECK(it && !index->stale());
+
+    // Insert a declaration at the start of the file
+    const std::string inserted = "int inserted;\n";
+    source.insert(0, inserted);
+    CXUnsavedFile unsaved{ "edited.cpp", source.c_str(), static_cast<unsigned long>(source.size()) };
+    TOKEN_ITERATOR_CHECK(clang_reparseTranslationUnit(tu, 1, &unsaved, clang_defaultReparseOptions(tu)) == 0);
+    cache.update(tu, parsed.file(), text_edit{ 0, 0, static_cast<unsigned int>(inserted.size()) });
+
+    TOKEN_ITERATOR_CHECK(index->stale());
+    TOKEN_ITERATOR_CHECK(throws_stale([&] { *it; }));
+    TOKEN_ITERATOR_CHECK(throws_stale([&] { ++it; }));
+    TOKEN_ITERATOR_CHECK(throws_stale([&] { it.spelling(); }));
+    TOKEN_ITERATOR_CHECK(throws_stale([&] { (*index)[0]; }));
+    TOKEN_ITERATOR_CHECK(throws_stale([&] { *view_it; }));
+
+    // An iterator over the updated index walks the new tokens both ways, and never lexes the whole file
+    std::vector<std::string> expected;
+    for (token_iterator serial{ tu, cursor_location{ parsed.cursor() } }; serial; ++serial) {
+        expected.push_back(spelling_of(tu, *serial));
+    }
+
+    std::vector<std::string> forward;
+    token_iterator last;
+    for (token_iterator cached{ cache, tu, cursor_location{ parsed.cursor() } }; cached; ++cached) {
+        forward.push_back(spelling_of(tu, *cached));
+        last = cached;
+    }
+    TOKEN_ITERATOR_CHECK(forward == expected);
+
+    std::vector<std::string> backward;
+    for (; last; --last) {
+        backward.push_back(spelling_of(tu, *last));
+    }
+    std::reverse(backward.begin(), backward.end());
+    TOKEN_ITERATOR_CHECK(backward == expected);
+    TOKEN_ITERATOR_CHECK(!cache.get(tu, parsed.file())->has_tokens());
+}
+
+// Runs of punctuators that lex differently from each of their characters
+void backward_walk_splits_punctuators() {
+    const char* sources[] = { "<<<++", ",->*}", "-->*", "a<<<b", "x+++y", "a...b", "/* c */+=x", "a->*b", "<<=<=>",
+                              "a...1.", "0x1p-3+1e+5", "v2.size()", "p1.x", "R1e+5", "?R1e+5", "\"lit\"_sv$x", "'a'x$y",
+                              "x\\\n+y", "+\\ \n+", "1_km\\\nint'0", "a\\\n\"s\"" };
+    for (auto source : sources) {
+        parsed_source parsed{ "punctuators.cpp", source };
+        auto result = check_token_iterator(parsed.tu(), parsed.file());
+        if (!result.correct()) std::printf("backward walk over \"%s\" mismatched at %zu\n", source, result.backward_mismatch);
+        TOKEN_ITERATOR_CHECK(result.correct());
+    }
+}
+
+// Counts what a live iterator records, to check that its instrumentation policy is used
+struct recording_instrumentation {
+    static std::uint64_t counts[8];
+    static std::uint64_t timed;
+
+    struct timer {
+        explicit timer(token_timer) noexcept { ++timed; }
+    };
+
+    static void count(token_counter counter, std::uint64_t n = 1) noexcept {
+        counts[static_cast<std::size_t>(counter)] += n;
+    }
+
+    static std::uint64_t count_of(token_counter counter) noexcept { return counts[static_cast<std::size_t>(counter)]; }
+};
+
+// Replaces removed bytes at offset of source (the contents of parsed) with inserted, reparses and updates cache.
+// The updated index must have the tokens of one made from scratch.
+bool update_matches_fresh_lex(const parsed_source &parsed, std::string &source, token_cache &cache,
+                              unsigned int offset, unsigned int removed, const std::string &inserted) {
+    auto tu = parsed.tu();
+    source.replace(offset, removed, inserted);
+
+    CXUnsavedFile unsaved{ parsed.file_name().c_str(), source.c_str(), static_cast<unsigned long>(source.size()) };
+    TOKEN_ITERATOR_CHECK(clang_reparseTranslationUnit(tu, 1, &unsaved, clang_defaultReparseOptions(tu)) == 0);
+    cache.update(tu, parsed.file(), text_edit{ offset, removed, static_cast<unsigned int>(inserted.size()) });
+
+    auto updated = cache.get(tu, parsed.file());
+    auto fresh = make_ref<const file_token_index>(tu, parsed.file());
+    if (same_tokens(*updated, *fresh)) return true;
+
+    std::printf("%s: edit at %u of %u bytes with \"%s\" does not match a fresh lex\n",
+                parsed.file_name().c_str(), offset, removed, inserted.c_str());
+    return false;
+}
+
+// Random edits that open and close comments, strings and raw strings, each followed by a reparse and update()
+void updates_match_fresh_lex() {
+    std::string source = "/* a */ int a = 1; // b\nconst char* s = \"c\" R\"x(d\n)x\";\n" + numbered_source(0);
+    parsed_source parsed{ "spliced.cpp", source };
+
+    const char* fragments[] = { "/*", "*/", "\"", "'", "R\"(", ")\"", "R\"x(", ")x\"", "//", "\n", "\\\n", "x", " ", "int b;" };
+    std::mt19937 random{ 18 };
+    token_cache cache;
+    cache.get(parsed.tu(), parsed.file());
+
+    for (int step = 0; step < 200; ++step) {
+        const auto offset = static_cast<unsigned int>(random() % (source.size() + 1));
+        const auto removed = std::min(static_cast<unsigned int>(random() % 4), static_cast<unsigned int>(source.size() - offset));
+        const std::string inserted = (random() % 4 == 0) ? "" : fragments[random() % std::size(fragments)];
+        if (!update_matches_fresh_lex(parsed, source, cache, offset, removed, inserted)) {
+            std::printf("at step %d\n", step);
+            TOKEN_ITERATOR_CHECK(false);
+            return;
+        }
+    }
+
+    // In Objective-C, an identifier after "@" is a keyword. Adding or removing an "@" changes the kind of the
+    // token after it, however far the update has to lex to catch up with the old tokens.
+    std::string objc = "@interface I\n@end\n@class C;\nint x = 1;\n";
+    parsed_source objc_parsed{ "at.m", objc, {}, CXTranslationUnit_None, { "-xobjective-c" } };
+    token_cache objc_cache;
+    objc_cache.get(objc_parsed.tu(), objc_parsed.file());
+
+    auto at = [&](const char* text) { return static_cast<unsigned int>(objc.find(text)); };
+    TOKEN_ITERATOR_CHECK(update_matches_fresh_lex(objc_parsed, objc, objc_cache, at("@end"), 1, ""));
+    TOKEN_ITERATOR_CHECK(update_matches_fresh_lex(objc_parsed, objc, objc_cache, at("end"), 0, "@"));
+    TOKEN_ITERATOR_CHECK(update_matches_fresh_lex(objc_parsed, objc, objc_cache, at("@class"), 1, "@ "));
+    TOKEN_ITERATOR_CHECK(update_matches_fresh_lex(objc_parsed, objc, objc_cache, at(";\nint") + 1, 0, " "));
+    TOKEN_ITERATOR_CHECK(update_matches_fresh_lex(objc_parsed, objc, objc_cache, at("int"), 0, "@"));
+
+    const char* objc_fragments[] = { "@", "@", " ", "\n", "class", "end", "x" };
+    for (int step = 0; step < 100; ++step) {
+        const auto offset = static_cast<unsigned int>(random() % (objc.size() + 1));
+        const auto removed = std::min(static_cast<unsigned int>(random() % 2), static_cast<unsigned int>(objc.size() - offset));
+        const std::string inserted = objc_fragments[random() % std::size(objc_fragments)];
+        if (!update_matches_fresh_lex(objc_parsed, objc, objc_cache, offset, removed, inserted)) {
+            std::printf("at step %d\n", step);
+            TOKEN_ITERATOR_CHECK(false);
+            return;
+        }
+    }
+}
+
+// The matches of matcher over every token of the main file of source, as (pattern, first token) pairs in the order reported
+std::vector<std::pair<std::size_t, std::size_t>> matches_in(const token_matcher &matcher, const parsed_source &source) {
+    token_cache cache;
+    auto index = cache.get(source.tu(), source.file());
+    std::vector<std::pair<std::size_t, std::size_t>> matches;
+    matcher.find_all(token_view_iterator::begin(index), token_view_iterator::end(index),
+                     [&](const token_matcher::match &m) { matches.emplace_back(m.pattern, m.first_token); });
+    return matches;
+}
+
+void matcher_wildcards_and_kinds() {
+    parsed_source parsed{ "match.cpp", "int a = 1; return a; return 1 + 2; return b;" };
+    using pairs = std::vector<std::pair<std::size_t, std::size_t>>;
+
+    // Any one token between "return" and ";"
+    token_matcher wildcard;
+    wildcard.add({ token_matcher::spelled("return"), token_matcher::any_token(), token_matcher::spelled(";") });
+    TOKEN_ITERATOR_CHECK((matches_in(wildcard, parsed) == pairs{ { 0, 5 }, { 0, 13 } }));
+
+    // A keyword followed by an identifier, and a literal of any spelling followed by a ";"
+    token_matcher kinds;
+    kinds.add({ token_matcher::of_kind(CXToken_Keyword), token_matcher::of_kind(CXToken_Identifier) });
+    kinds.add({ token_matcher::of_kind(CXToken_Literal), token_matcher::spelled(";") });
+    TOKEN_ITERATOR_CHECK((matches_in(kinds, parsed) == pairs{ { 0, 0 }, { 1, 3 }, { 0, 5 }, { 1, 11 }, { 0, 13 } }));
+
+    // Kind and spelling together
+    token_matcher both;
+    both.add({ token_matcher::of_kind(CXToken_Literal, "1") });
+    TOKEN_ITERATOR_CHECK((matches_in(both, parsed) == pairs{ { 0, 3 }, { 0, 9 } }));
+
+    // Without elements, nothing is added
+    token_matcher empty;
+    TOKEN_ITERATOR_CHECK(empty.add_spellings("") == token_matcher::no_pattern);
+    TOKEN_ITERATOR_CHECK(empty.add_spellings(" \t\n") == token_matcher::no_pattern);
+    TOKEN_ITERATOR_CHECK(empty.empty());
+    TOKEN_ITERATOR_CHECK(empty.add_spellings("return") == 0);
+}
+
+void matcher_overlaps_and_order() {
+    parsed_source parsed{ "overlap.cpp", "a a a b c" };
+    using pairs = std::vector<std::pair<std::size_t, std::size_t>>;
+
+    // Every occurrence, overlapping ones too
+    token_matcher overlapping;
+    overlapping.add_spellings("a a");
+    TOKEN_ITERATOR_CHECK((matches_in(overlapping, parsed) == pairs{ { 0, 0 }, { 0, 1 } }));
+
+    // Matches that end at the same token come in the order their patterns were added, whatever their lengths
+    token_matcher simultaneous;
+    simultaneous.add_spellings("b c");
+    simultaneous.add_spellings("a a b c");
+    simultaneous.add_spellings("c");
+    simultaneous.add_spellings("a b c");
+    TOKEN_ITERATOR_CHECK((matches_in(simultaneous, parsed) == pairs{ { 0, 3 }, { 1, 1 }, { 2, 4 }, { 3, 2 } }));
+}
+
+void matcher_long_patterns_cross_words() {
+    // 70 identifiers, twice, and a mismatch in the middle of a third copy
+    std::string spellings;
+    for (int i = 0; i < 70; ++i) {
+        spellings += "x" + std::to_string(i) + " ";
+    }
+    std::string broken = spellings;
+    broken.replace(broken.find(" x40 "), 5, " y40 ");
+    parsed_source parsed{ "long.cpp", spellings + spellings + broken + spellings };
+
+    // The short pattern first puts the long one at bits 40 to 109 of the state, across the first word boundary
+    token_matcher matcher;
+    matcher.add_spellings("unused_0 unused_1 unused_2 unused_3 unused_4 unused_5 unused_6 unused_7 unused_8 unused_9 "
+                          "unused_10 unused_11 unused_12 unused_13 unused_14 unused_15 unused_16 unused_17 unused_18 "
+                          "unused_19 unused_20 unused_21 unused_22 unused_23 unused_24 unused_25 unused_26 unused_27 "
+                          "unused_28 unused_29 unused_30 unused_31 unused_32 unused_33 unused_34 unused_35 unused_36 "
+                          "unused_37 unused_38 unused_39");
+    const auto id = matcher.add_spellings(spellings);
+    const auto tail = matcher.add_spellings("x60 x61 x62 x63 x64 x65 x66 x67 x68 x69");
+
+    using pairs = std::vector<std::pair<std::size_t, std::size_t>>;
+    TOKEN_ITERATOR_CHECK((matches_in(matcher, parsed) == pairs{ { id, 0 }, { tail, 60 }, { id, 70 }, { tail, 130 },
+                                                                  { tail, 200 }, { id, 210 }, { tail, 270 } }));
+}
+
+// A main file that includes a header that includes another, with tokens before and after each #include
+parsed_source nested_includes() {
+    return parsed_source{ "includer.cpp", "int m0;\n#include \"outer.h\"\nint m1;\n",
+                          { { "outer.h", "int o0;\n#include \"inner.h\"\nint o1;\n" }, { "inner.h", "int i0;\n" } } };
+}
+
+void tu_walks_follow_includes_both_ways() {
+    auto parsed = nested_includes();
+    auto tu = parsed.tu();
+    token_cache cache;
+    auto tokens = make_ref<const tu_token_index>(cache, tu);
+
+    // The tokens of each header follow its #include line
+    const std::vector<std::string> expected{
+        "int", "m0", ";", "#", "include", "\"outer.h\"",
+        "int", "o0", ";", "#", "include", "\"inner.h\"",
+        "int", "i0", ";",
+        "int", "o1", ";",
+        "int", "m1", ";" };
+    const std::vector<std::string> expected_files{
+        "includer.cpp", "includer.cpp", "includer.cpp", "includer.cpp", "includer.cpp", "includer.cpp",
+        "outer.h", "outer.h", "outer.h", "outer.h", "outer.h", "outer.h",
+        "inner.h", "inner.h", "inner.h",
+        "outer.h", "outer.h", "outer.h",
+        "includer.cpp", "includer.cpp", "includer.cpp" };
+
+    std::vector<std::string> forward;
+    std::vector<std::string> forward_files;
+    for (auto it = tu_token_iterator::begin(tokens), end = tu_token_iterator::end(tokens); it != end; ++it) {
+        forward.push_back(spelling_of(tu, *it));
+        forward_files.push_back(file_name_of(tu, *it));
+    }
+    TOKEN_ITERATOR_CHECK(forward == expected);
+    TOKEN_ITERATOR_CHECK(forward_files == expected_files);
+
+    std::vector<std::string> backward;
+    for (auto it = tu_token_iterator::end(tokens), begin = tu_token_iterator::begin(tokens); it != begin;) {
+        --it;
+        backward.push_back(spelling_of(tu, *it));
+    }
+    std::reverse(backward.begin(), backward.end());
+    TOKEN_ITERATOR_CHECK(backward == expected);
+}
+
+void tu_iterator_starts_inside_header() {
+    auto parsed = nested_includes();
+    auto tu = parsed.tu();
+    token_cache cache;
+    auto tokens = make_ref<const tu_token_index>(cache, tu);
+    auto inner = clang_getFile(tu, "inner.h");
+    auto outer = clang_getFile(tu, "outer.h");
+
+    // At a token of the innermost header, then out to the one that included it
+    tu_token_iterator it{ tokens, cursor_location{ clang_getLocationForOffset(tu, inner, 4) } };
+    TOKEN_ITERATOR_CHECK(it.file() == inner && spelling_of(tu, *it) == "i0");
+    ++it;
+    ++it;
+    TOKEN_ITERATOR_CHECK(it.file() == outer && spelling_of(tu, *it) == "int");
+
+    // Back across the #include line, from the first token of the header
+    tu_token_iterator first{ tokens, cursor_location{ clang_getLocationForOffset(tu, inner, 0) } };
+    --first;
+    TOKEN_ITERATOR_CHECK(first.file() == outer && spelling_of(tu, *first) == "\"inner.h\"");
+
+    // In whitespace, at the token after it
+    tu_token_iterator after{ tokens, cursor_location{ clang_getLocationForOffset(tu, outer, 7) } };
+    TOKEN_ITERATOR_CHECK(after.file() == outer && spelling_of(tu, *after) == "#");
+}
+
+// #include lines continued onto the next line, with whitespace between the backslash and the newline:
+// the tokens of the header follow those of the continuation line
+void tu_walk_follows_continued_include_lines() {
+    for (const char* continuation : { "\\\n", "\\ \n", "\\\r\n", "\\\t \r\n" }) {
+        parsed_source parsed{ "continued.cpp", std::string{ "#include \"inner.h\" " } + continuation + "// more\nint m0;\n",
+                              { { "inner.h", "int i0;\n" } } };
+        auto tu = parsed.tu();
+        token_cache cache;
+        auto tokens = make_ref<const tu_token_index>(cache, tu);
+
+        std::vector<std::string> walked;
+        for (auto it = tu_token_iterator::begin(tokens), end = tu_token_iterator::end(tokens); it != end; ++it) {
+            walked.push_back(spelling_of(tu, *it));
+        }
+        TOKEN_ITERATOR_CHECK((walked == std::vector<std::string>{ "#", "include", "\"inner.h\"", "// more",
+                                                                   "int", "i0", ";", "int", "m0", ";" }));
+    }
+}
+
+#if TOKEN_ITERATOR_COROUTINES
+void generator_matches_tokenize() {
+    // A comment longer than a chunk, which the lexer has to grow the chunk past
+    parsed_source parsed{ "generated.cpp", "/*" + std::string(3000, '*') + "*/\n" + numbered_source(2) };
+    const auto middle = static_cast<unsigned int>(parsed.source().find("int f100"));
+
+    for (std::size_t depth : { 0, 1, 3 }) {
+        for (unsigned int offset : { 0u, middle }) {
+            const auto expected = tokenized_from(parsed, offset);
+
+            std::vector<lexed_token> generated;
+            auto loc = clang_getLocationForOffset(parsed.tu(), parsed.file(), offset);
+            for (const auto &view : generate_tokens(parsed.tu(), cursor_location{ loc }, token_prefetch_options{ 256, depth })) {
+                generated.push_back(lexed_token{ view.kind, view.begin_offset, view.end_offset, std::string{ view.spelling } });
+            }
+            if (generated != expected) {
+                std::printf("prefetch depth %zu from offset %u: %zu tokens generated, %zu expected\n",
+                            depth, offset, generated.size(), expected.size());
+            }
+            TOKEN_ITERATOR_CHECK(generated == expected);
+        }
+    }
+}
+
+void generator_destroyed_mid_walk() {
+    parsed_source parsed{ "abandoned.cpp", numbered_source(10) };
+    const auto expected = tokenized_from(parsed, 0);
+
+    for (std::size_t depth : { 0, 2 }) {
+        // Destroying the generator stops the helper thread, even while it waits for room to prefetch into
+        {
+            auto tokens = generate_tokens(parsed.tu(), cursor_location{ parsed.cursor() }, token_prefetch_options{ 64, depth });
+            std::size_t n = 0;
+            for (auto it = tokens.begin(); it != tokens.end() && n < 10; ++it, ++n) {
+                TOKEN_ITERATOR_CHECK(it->spelling == expected[n].spelling);
+            }
+            TOKEN_ITERATOR_CHECK(n == 10);
+        }
+
+        // And before it is started
+        {
+            auto tokens = generate_tokens(parsed.tu(), cursor_location{ parsed.cursor() }, token_prefetch_options{ 64, depth });
+        }
+
+        // After which the TU is the caller's again
+        TOKEN_ITERATOR_CHECK(tokenized_from(parsed, 0) == expected);
+    }
+}
+#endif
+
+// The vectorized scans, against plain loops over the same bytes
+std::size_t scalar_find_last(gsl::span<const char> s, bool space) {
+    for (auto n = s.size(); n > 0; --n) {
+        if (is_space(s[n - 1]) == space) return n - 1;
+    }
+    return not_found;
+}
+
+template <unsigned int KindMask>
+bool kind_scans_match(const std::vector<std::uint8_t> &kinds) {
+    auto span = gsl::make_span(kinds);
+    for (std::size_t pos = 0; pos <= kinds.size(); ++pos) {
+        auto next = pos;
+        while (next < kinds.size() && !kind_in_mask<KindMask>(kinds[next])) ++next;
+        auto prev = pos;
+        while (prev > 0 && !kind_in_mask<KindMask>(kinds[prev - 1])) --prev;
+
+        if (find_next_kind<KindMask>(span, pos) != next) return false;
+        if (find_prev_kind<KindMask>(span, pos) != (prev > 0 ? prev - 1 : not_found)) return false;
+    }
+    return true;
+}
+
+void scans_match_scalar_loops() {
+    std::mt19937 random{ 10 };
+
+    // Mostly whitespace, so that runs fill whole vectors, with bytes from 0x80 on which are never whitespace
+    const char chars[] = { ' ', ' ', ' ', '\t', '\n', '\v', '\f', '\r', '\x08', '\x0e', 'x', '\x80', '\xff', '\x89', '\xa0' };
+    std::vector<char> buffer(130 + 32);
+    for (int round = 0; round < 20; ++round) {
+        for (std::size_t size = 0; size <= 130; ++size) {
+            // At every alignment of the first byte
+            const auto first = random() % 32;
+            const auto density = random() % 8;
+            for (auto &c : buffer) {
+                c = (random() % 8 < density) ? chars[random() % std::size(chars)] : ' ';
+            }
+            auto s = gsl::make_span(buffer.data() + first, size);
+            TOKEN_ITERATOR_CHECK(find_last_space(s) == scalar_find_last(s, true));
+            TOKEN_ITERATOR_CHECK(find_last_not_space(s) == scalar_find_last(s, false));
+        }
+    }
+
+    // Kinds past the last CXTokenKind never match
+    std::vector<std::uint8_t> kinds;
+    for (int round = 0; round < 5; ++round) {
+        for (std::size_t size = 0; size <= 130; ++size) {
+            const auto range = (random() % 2) ? 5 : 256;
+            const auto density = random() % 8 + 1;
+            kinds.resize(size);
+            for (auto &k : kinds) {
+                k = (random() % 64 < density) ? static_cast<std::uint8_t>(random() % range) : 0xF0;
+            }
+            TOKEN_ITERATOR_CHECK(kind_scans_match<kind_bit(CXToken_Identifier)>(kinds));
+            TOKEN_ITERATOR_CHECK((kind_scans_match<kind_bit(CXToken_Punctuation) | kind_bit(CXToken_Comment)>(kinds)));
+            TOKEN_ITERATOR_CHECK(kind_scans_match<0xFF>(kinds));
+        }
+    }
+}
+
+std::uint64_t recording_instrumentation::counts[8] = {};
+std::uint64_t recording_instrumentation::timed = 0;
+
+void live_policies_match_serial_walk() {
+    parsed_source parsed{ "live.cpp", numbered_source(3) };
+    auto tu = parsed.tu();
+
+    std::vector<std::string> expected;
+    std::vector<std::string> expected_identifiers;
+    for (token_iterator it{ tu, cursor_location{ parsed.cursor() } }; it; ++it) {
+        expected.push_back(spelling_of(tu, *it));
+        if (clang_getTokenKind(*it) == CXToken_Identifier) expected_identifiers.push_back(expected.back());
+    }
+
+    // Backward, from the last token
+    using backward = basic_token_iterator<token_policy<CXToken, false, 0xFF, recording_instrumentation, live_tokens>>;
+    auto last_loc = clang_getLocationForOffset(tu, parsed.file(), static_cast<unsigned int>(parsed.source().size() - 2));
+    std::vector<std::string> walked;
+    for (backward it{ tu, cursor_location{ last_loc } }; it; ++it) {
+        walked.push_back(spelling_of(tu, *it));
+    }
+    std::reverse(walked.begin(), walked.end());
+    TOKEN_ITERATOR_CHECK(walked == expected);
+
+    // Every step was recorded, and so were the searches for the tokens before the first of each window
+    TOKEN_ITERATOR_CHECK(recording_instrumentation::count_of(token_counter::steps) == expected.size());
+    TOKEN_ITERATOR_CHECK(recording_instrumentation::timed == expected.size());
+    TOKEN_ITERATOR_CHECK(recording_instrumentation::count_of(token_counter::backward_searches) > 0);
+    TOKEN_ITERATOR_CHECK(recording_instrumentation::count_of(token_counter::probes) > 0);
+
+    // So were the libclang calls of the windows it lexed, up to their disposal
+    TOKEN_ITERATOR_CHECK(recording_instrumentation::count_of(token_counter::tokenize) > 0);
+    TOKEN_ITERATOR_CHECK(recording_instrumentation::count_of(token_counter::get_token_extent) >= expected.size());
+    TOKEN_ITERATOR_CHECK(recording_instrumentation::count_of(token_counter::dispose_tokens) > 0);
+
+    // Identifiers only, both ways
+    using identifiers = basic_token_iterator<token_policy<CXToken, true, kind_bit(CXToken_Identifier),
+                                                          no_instrumentation, live_tokens>>;
+    walked.clear();
+    identifiers last;
+    for (identifiers it{ tu, cursor_location{ parsed.cursor() } }; it; ++it) {
+        walked.push_back(spelling_of(tu, *it));
+        last = it;
+    }
+    TOKEN_ITERATOR_CHECK(walked == expected_identifiers);
+
+    walked.clear();
+    for (; last; --last) {
+        walked.push_back(spelling_of(tu, *last));
+    }
+    std::reverse(walked.begin(), walked.end());
+    TOKEN_ITERATOR_CHECK(walked == expected_identifiers);
+}
+
+void cache_charges_lazy_parts_up_front() {
+    std::string source = numbered_source(20);
+    parsed_source parsed{ "budget.cpp", source };
+    auto tu = parsed.tu();
+
+    token_cache cache;
+    auto index = cache.get(tu, parsed.file());
+    const auto charged = cache.memory_usage();
+    TOKEN_ITERATOR_CHECK(charged == index->projected_memory_usage());
+    TOKEN_ITERATOR_CHECK(charged > index->memory_usage());
+
+    // Building the line table stays within what was charged for it
+    for (auto it = indexed_token_iterator::begin(index), end = indexed_token_iterator::end(index); it != end; ++it) {
+        it.line();
+    }
+    auto stats = cache.memory_breakdown();
+    TOKEN_ITERATOR_CHECK(stats.token_tables + stats.token_windows + stats.line_tables <= charged);
+    cache.get(tu, parsed.file());
+    TOKEN_ITERATOR_CHECK(cache.memory_usage() == charged);
+
+    // After an update, the CXTokens the index lexes on first use are charged before they are lexed
+    const std::string inserted = "int inserted;\n";
+    source.insert(0, inserted);
+    CXUnsavedFile unsaved{ "budget.cpp", source.c_str(), static_cast<unsigned long>(source.size()) };
+    TOKEN_ITERATOR_CHECK(clang_reparseTranslationUnit(tu, 1, &unsaved, clang_defaultReparseOptions(tu)) == 0);
+    cache.update(tu, parsed.file(), text_edit{ 0, 0, static_cast<unsigned int>(inserted.size()) });
+
+    auto updated = cache.get(tu, parsed.file());
+    TOKEN_ITERATOR_CHECK(!updated->has_tokens());
+    const auto charged_updated = cache.memory_usage();
+    updated->tokens();
+    updated->lines();
+    stats = cache.memory_breakdown();
+    TOKEN_ITERATOR_CHECK(stats.token_tables + stats.token_windows + stats.line_tables <= charged_updated);
+}
+
+// Three files of the same size, so that the budget is counted in files. A hit makes a file the most recently used,
+// and shrinking the budget evicts the least recently used ones, which are lexed again on the next get().
+void cache_evicts_least_recently_used() {
+    const auto source = numbered_source(2);
+    parsed_source a{ "a.cpp", source };
+    parsed_source b{ "b.cpp", source };
+    parsed_source c{ "c.cpp", source };
+
+    token_cache cache;
+    auto index_a = cache.get(a.tu(), a.file());
+    auto index_b = cache.get(b.tu(), b.file());
+    auto index_c = cache.get(c.tu(), c.file());
+    const auto file_bytes = index_a->projected_memory_usage();
+    TOKEN_ITERATOR_CHECK(cache.num_files() == 3);
+    TOKEN_ITERATOR_CHECK(cache.memory_usage() == 3 * file_bytes);
+
+    // a is now the most recently used, so b goes first
+    TOKEN_ITERATOR_CHECK(cache.get(a.tu(), a.file()) == index_a);
+    cache.set_max_bytes(2 * file_bytes);
+    TOKEN_ITERATOR_CHECK(cache.num_files() == 2);
+    TOKEN_ITERATOR_CHECK(cache.memory_usage() == 2 * file_bytes);
+    TOKEN_ITERATOR_CHECK(cache.get(a.tu(), a.file()) == index_a);
+    TOKEN_ITERATOR_CHECK(cache.get(c.tu(), c.file()) == index_c);
+
+    // b comes back with an index of its own, and evicts a, used before c
+    auto fresh_b = cache.get(b.tu(), b.file());
+    TOKEN_ITERATOR_CHECK(fresh_b != index_b);
+    TOKEN_ITERATOR_CHECK(same_tokens(*fresh_b, *index_b));
+    TOKEN_ITERATOR_CHECK(cache.num_files() == 2);
+    TOKEN_ITERATOR_CHECK(cache.get(c.tu(), c.file()) == index_c);
+    TOKEN_ITERATOR_CHECK(cache.get(b.tu(), b.file()) == fresh_b);
+    TOKEN_ITERATOR_CHECK(cache.get(a.tu(), a.file()) != index_a);
+}
+
+} // namespace
+
+int main() {
+    forward_walk_matches_tokenize();
+    copies_walk_independently();
+    reverse_walk_matches_tokenize();
+    indexed_iterator_matches_token_indices();
+    iterators_compare_by_token();
+    ranges_match_tokenize();
+    cached_locations_match_token_extents();
+    lines_match_spelling_locations();
+    windows_recycle_through_pool();
+    views_match_tokenize();
+    spellings_match_get_token_spelling();
+    filtered_walks_match_tokenize();
+    extracted_tokens_match_tokenize();
+    expansions_match_preprocessing_record();
+    scans_match_scalar_loops();
+    parallel_for_each_token_matches_serial_walk();
+    parallel_for_each_job_rethrows();
+    lex_parallel_matches_serial_lex();
+    store_round_trips();
+    store_rejects_damaged_files();
+    cache_warm_starts_from_store();
+    stale_iterators_throw();
+    updates_match_fresh_lex();
+    cache_charges_lazy_parts_up_front();
+    cache_evicts_least_recently_used();
+    backward_walk_splits_punctuators();
+    matcher_wildcards_and_kinds();
+    matcher_overlaps_and_order();
+    matcher_long_patterns_cross_words();
+    live_policies_match_serial_walk();
+    tu_walks_follow_includes_both_ways();
+    tu_iterator_starts_inside_header();
+    tu_walk_follows_continued_include_lines();
+#if TOKEN_ITERATOR_COROUTINES
+    generator_matches_tokenize();
+    generator_destroyed_mid_walk();
+#endif
+
+    if (num_failures) {
+        std::printf("%d checks failed\n", num_failures);
+    }
+    return num_failures;
+}